@@ -0,0 +1,135 @@
+/*
+ * Physically contiguous regions.
+ *
+ * Ranges of up to MAX_PAGE_ORDER come from the buddy allocator, on the nodes of the region's
+ * policy: the high-order page is split, its excess tail freed, and the region ends up with
+ * ordinary order-0 pages released like any other. Larger ranges are only available from the DMA
+ * API of the memdev device, i.e. from the CMA area when the kernel has one; they are released as a
+ * whole with dma_free_pages().
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/device.h>
+#include <linux/dma-mapping.h>
+
+#include "memdev.h"
+#include "memdev_trace.h"
+
+#define CONTIG_GFP_FLAGS	(PAGE_GFP_FLAGS | __GFP_THISNODE | __GFP_NOWARN | __GFP_RETRY_MAYFAIL)
+
+static struct device *contig_dev;
+
+static struct page *alloc_contig_node(int node, unsigned long nr)
+{
+	unsigned int order = get_order(nr << PAGE_SHIFT);
+	struct page *page;
+	unsigned long i;
+
+	page = alloc_pages_node(node, CONTIG_GFP_FLAGS, order);
+	if (!page)
+		return NULL;
+
+	split_page(page, order);
+	for (i = nr; i < (1UL << order); i++)
+		__free_page(page + i);
+	return page;
+}
+
+/* the requested node first, then the other allowed ones */
+static struct page *alloc_contig_buddy(struct mapped_region *region, int node)
+{
+	unsigned long nr = region->npages;
+	struct page *page;
+	int n;
+
+	page = alloc_contig_node(node, nr);
+	if (page)
+		return page;
+
+	for_each_node_mask(n, region->policy.allowed) {
+		if (n == node)
+			continue;
+		page = alloc_contig_node(n, nr);
+		if (page)
+			return page;
+	}
+	return NULL;
+}
+
+/* the DMA API does not promise zeroed pages on every configuration */
+static struct page *alloc_contig_dma(struct mapped_region *region)
+{
+	size_t size = region->npages << PAGE_SHIFT;
+	struct page *page;
+	unsigned long i;
+
+	if (!contig_dev)
+		return NULL;
+
+	page = dma_alloc_pages(contig_dev, size, &region->dma_addr, DMA_BIDIRECTIONAL,
+			       GFP_KERNEL | __GFP_NOWARN);
+	if (!page)
+		return NULL;
+
+	for (i = 0; i < region->npages; i++) {
+		clear_highpage(page + i);
+		if (i % 4096 == 0)
+			cond_resched();
+	}
+	region->dma = true;
+	return page;
+}
+
+/*
+ * Back a whole region with one physically contiguous range, preferably on the given node. The
+ * range starts on a page boundary only: huge leaf entries are used where it happens to be
+ * aligned.
+ */
+int memdev_alloc_contig(struct mapped_region *region, int node)
+{
+	u64 start = memdev_trace_start(memdev_alloc);
+	struct page **pages = memdev_region_pages(region, true);
+	struct page *page = NULL;
+	unsigned long i;
+
+	if (region->npages <= MAX_ORDER_NR_PAGES)
+		page = alloc_contig_buddy(region, node);
+	if (!page)
+		page = alloc_contig_dma(region);
+	trace_memdev_alloc(page ? page_to_nid(page) : node, get_order(region->npages << PAGE_SHIFT),
+			   region->npages, page ? region->npages : 0, region->cfg.prot,
+			   memdev_trace_duration(start));
+	if (!page)
+		return -ENOMEM;
+
+	for (i = 0; i < region->npages; i++)
+		pages[i] = page + i;
+	return 0;
+}
+
+/* release the range of a region allocated through the DMA API, along with its page array */
+void memdev_free_contig(struct mapped_region *region)
+{
+	struct page **pages = memdev_region_pages(region, true);
+
+	memdev_reset_pages_memtype(pages, region->npages, region->cfg.prot);
+	dma_free_pages(contig_dev, region->npages << PAGE_SHIFT, pages[0], region->dma_addr,
+		       DMA_BIDIRECTIONAL);
+	kvfree(pages);
+}
+
+/* the device allocations larger than MAX_PAGE_ORDER are made for */
+void memdev_contig_init(struct device *dev)
+{
+	if (dma_coerce_mask_and_coherent(dev, DMA_BIT_MASK(64))) {
+		pr_warn("no DMA mask, contiguous mappings limited to %lu KiB\n",
+			MAX_ORDER_NR_PAGES << (PAGE_SHIFT - 10));
+		return;
+	}
+	contig_dev = dev;
+}
@@ -0,0 +1,1918 @@
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/dma-buf.h>
+#include <linux/cdev.h>
+#include <linux/device.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/types.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/kref.h>
+#include <linux/rcupdate.h>
+#include <linux/ktime.h>
+#include <linux/seq_file.h>
+#include <linux/sched/signal.h>
+#include <linux/capability.h>
+#include <linux/overflow.h>
+#include <linux/atomic.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+#include <linux/nodemask.h>
+#include <linux/topology.h>
+#include <linux/version.h>
+#include <linux/pfn_t.h>
+#include <linux/huge_mm.h>
+#include <linux/set_memory.h>
+#include <uapi/asm-generic/errno-base.h>
+
+#include <linux/numa.h>
+#include <linux/mempolicy.h>
+
+#include "memdev.h"
+#include "memdev_uapi.h"
+
+#define CREATE_TRACE_POINTS
+#include "memdev_trace.h"
+
+#define DEVICE_NAME		 "memdev"
+#define DEVICE_PATH		 "/dev/memdev"
+
+/* backward-compatibility */
+#ifndef MAX_PAGE_ORDER
+#define MAX_PAGE_ORDER MAX_ORDER
+#endif
+#ifndef PMD_ORDER
+#define PMD_ORDER	(PMD_SHIFT - PAGE_SHIFT)
+#endif
+#ifndef PUD_ORDER
+#define PUD_ORDER	(PUD_SHIFT - PAGE_SHIFT)
+#endif
+
+/* high-order chunks are opportunistic: fail fast and fall back to smaller pages */
+#define HUGE_GFP_FLAGS	(PAGE_GFP_FLAGS | __GFP_COMP | __GFP_NOWARN | __GFP_NORETRY)
+
+/* number of neighbouring 4K pages allocated and mapped together with a faulting one */
+#define FAULT_AROUND_PAGES	16
+
+/* pages changed per set_pages_array_*() call, bounding the time between reschedules */
+#define MEMTYPE_BATCH		4096UL
+
+/* interleaving unit, a PMD-sized chunk always comes from a single node */
+#define INTERLEAVE_PAGES	(1UL << PMD_ORDER)
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
+#define HAVE_MPOL_WEIGHTED_INTERLEAVE
+#endif
+
+struct file_state {
+	struct kref ref;
+	/* protects cfg and regions */
+	struct mutex lock;
+	/* applied to the following mmap() calls */
+	struct mmap_config cfg;
+	/* MPOL_WEIGHTED_INTERLEAVE node weights, 0 stands for 1 */
+	u8 weights[MAX_NUMNODES];
+	struct list_head regions;
+	/* in file_list, protected by dev_lock */
+	struct list_head list;
+};
+
+static char *memdev_attr = "normal_cacheable";
+module_param_named(attr, memdev_attr, charp, 0644);
+MODULE_PARM_DESC(attr, "Memory attribute: normal_cacheable, normal_noncacheable, device_noncacheable");
+
+static char *memdev_hugepage = "none";
+module_param_named(hugepage, memdev_hugepage, charp, 0444);
+MODULE_PARM_DESC(hugepage, "Leaf size of aligned ranges: none (4K), pmd (2M), pud (1G, falls back to pmd)");
+
+static bool memdev_populate;
+module_param_named(populate, memdev_populate, bool, 0644);
+MODULE_PARM_DESC(populate, "Allocate all pages at mmap time instead of on first touch");
+
+static enum prot_type g_prot;
+static unsigned int g_page_order;
+
+static dev_t devno;
+static struct cdev memdev_cdev;
+static struct class *memdev_class;
+static struct device *memdev_device;
+
+static const struct attribute_group *memdev_groups[] = {
+	&memdev_pool_attr_group,
+	&memdev_free_attr_group,
+	&memdev_stats_attr_group,
+	NULL,
+};
+
+/* file states, from open() until their last region is gone */
+static LIST_HEAD(file_list);
+static DEFINE_MUTEX(dev_lock);
+
+static atomic_t mapped_count = ATOMIC_INIT(0);
+
+static bool numa_enabled;
+
+static int init_alloc_policy(struct alloc_policy *pol, const struct mempolicy *mpol,
+			     const struct mmap_config *cfg, const u8 *weights)
+{
+	nodemask_t nodes;
+	unsigned int i, weight;
+	int node;
+
+	memset(pol, 0, sizeof(*pol));
+	pol->mode = MPOL_DEFAULT;
+	pol->allowed = cfg->nodes;
+
+#ifdef CONFIG_NUMA
+	if (mpol)
+		pol->mode = mpol->mode;
+
+	switch (pol->mode) {
+	case MPOL_DEFAULT:
+	case MPOL_LOCAL:
+		break;
+	case MPOL_PREFERRED:
+	case MPOL_PREFERRED_MANY:
+		nodes_and(pol->preferred, mpol->nodes, cfg->nodes);
+		break;
+	case MPOL_BIND:
+		nodes_and(pol->allowed, mpol->nodes, cfg->nodes);
+		break;
+	case MPOL_INTERLEAVE:
+#ifdef HAVE_MPOL_WEIGHTED_INTERLEAVE
+	case MPOL_WEIGHTED_INTERLEAVE:
+#endif
+		nodes_and(nodes, mpol->nodes, cfg->nodes);
+		if (nodes_empty(nodes))
+			return -EINVAL;
+
+		for_each_node_mask(node, nodes)
+			pol->il_len += pol->mode == MPOL_INTERLEAVE ? 1 : max_t(u8, weights[node], 1);
+		pol->il_nodes = kmalloc_array(pol->il_len, sizeof(int), GFP_KERNEL);
+		if (!pol->il_nodes)
+			return -ENOMEM;
+
+		i = 0;
+		for_each_node_mask(node, nodes) {
+			weight = pol->mode == MPOL_INTERLEAVE ? 1 : max_t(u8, weights[node], 1);
+			while (weight--)
+				pol->il_nodes[i++] = node;
+		}
+		break;
+	default:
+		return -EOPNOTSUPP;
+	}
+#endif
+
+	if (nodes_empty(pol->allowed))
+		return -EINVAL;
+	return 0;
+}
+
+/* the node to allocate the page at index idx of a region from */
+static int region_alloc_node(const struct alloc_policy *pol, unsigned long idx)
+{
+	int node = numa_node_id();
+
+	if (pol->il_len)
+		return pol->il_nodes[(idx / INTERLEAVE_PAGES) % pol->il_len];
+	if (!nodes_empty(pol->preferred))
+		return node_isset(node, pol->preferred) ? node : first_node(pol->preferred);
+	return node_isset(node, pol->allowed) ? node : first_node(pol->allowed);
+}
+
+static pgprot_t get_pgprot(enum prot_type prot)
+{
+	pgprot_t prot_val = vm_get_page_prot(VM_READ | VM_WRITE);
+	switch (prot) {
+	case PROT_WRITECOMBINE:
+		return pgprot_writecombine(prot_val);
+	case PROT_UNCACHED:
+		return pgprot_noncached(prot_val);
+	case PROT_CACHEABLE:
+		/* fallthrough */
+	default:
+		return prot_val;
+	}
+}
+
+#ifdef CONFIG_X86
+/*
+ * Change the memory type of the allocated pages of pages[0, npages), their direct map alias
+ * included. *done is set to the number of entries changed.
+ */
+static int change_pages_memtype(struct page **pages, unsigned long npages, enum prot_type prot,
+				unsigned long *done)
+{
+	unsigned long i = 0, nr;
+	int ret;
+
+	while (i < npages) {
+		if (!pages[i]) {
+			i++;
+			continue;
+		}
+		for (nr = 1; nr < MEMTYPE_BATCH && i + nr < npages && pages[i + nr]; nr++)
+			;
+
+		switch (prot) {
+		case PROT_WRITECOMBINE:
+			ret = set_pages_array_wc(pages + i, nr);
+			break;
+		case PROT_UNCACHED:
+			ret = set_pages_array_uc(pages + i, nr);
+			break;
+		default:
+			ret = set_pages_array_wb(pages + i, nr);
+			break;
+		}
+		if (ret) {
+			*done = i;
+			return ret;
+		}
+		i += nr;
+		cond_resched();
+	}
+	*done = npages;
+	return 0;
+}
+
+/* the same for nr physically contiguous pages from page */
+static int change_range_memtype(struct page *page, unsigned long nr, enum prot_type prot,
+				unsigned long *done)
+{
+	unsigned long i, n, addr;
+	int ret;
+
+	for (i = 0; i < nr; i += n) {
+		n = min(nr - i, MEMTYPE_BATCH);
+		addr = (unsigned long)page_address(page + i);
+
+		switch (prot) {
+		case PROT_WRITECOMBINE:
+			ret = set_memory_wc(addr, n);
+			break;
+		case PROT_UNCACHED:
+			ret = set_memory_uc(addr, n);
+			break;
+		default:
+			ret = set_memory_wb(addr, n);
+			break;
+		}
+		if (ret) {
+			*done = i;
+			return ret;
+		}
+		cond_resched();
+	}
+	*done = nr;
+	return 0;
+}
+#else
+static int change_pages_memtype(struct page **pages, unsigned long npages, enum prot_type prot,
+				unsigned long *done)
+{
+	*done = npages;
+	return 0;
+}
+
+static int change_range_memtype(struct page *page, unsigned long nr, enum prot_type prot,
+				unsigned long *done)
+{
+	*done = nr;
+	return 0;
+}
+#endif
+
+/*
+ * x86 PAT tracks the memory type of every RAM page, and the PFN based insertions
+ * (vmf_insert_pfn*(), vmf_insert_mixed(), remap_pfn_range()) replace the cache mode of
+ * vm_page_prot with it. Pages of write-combined and uncached regions are therefore given the
+ * type of their region once allocated, before they are published, and WB back before they are
+ * freed. Other architectures map them with vm_page_prot as is.
+ */
+int memdev_set_pages_memtype(struct page **pages, unsigned long npages, enum prot_type prot)
+{
+	unsigned long done, undone;
+	int ret;
+
+	if (prot == PROT_CACHEABLE)
+		return 0;
+
+	ret = change_pages_memtype(pages, npages, prot, &done);
+	if (ret)
+		change_pages_memtype(pages, done, PROT_CACHEABLE, &undone);
+	return ret;
+}
+
+int memdev_set_range_memtype(struct page *page, unsigned long nr, enum prot_type prot)
+{
+	unsigned long done, undone;
+	int ret;
+
+	if (prot == PROT_CACHEABLE)
+		return 0;
+
+	ret = change_range_memtype(page, nr, prot, &done);
+	if (ret)
+		change_range_memtype(page, done, PROT_CACHEABLE, &undone);
+	return ret;
+}
+
+void memdev_reset_pages_memtype(struct page **pages, unsigned long npages, enum prot_type prot)
+{
+	unsigned long done;
+
+	if (prot == PROT_CACHEABLE)
+		return;
+
+	if (change_pages_memtype(pages, npages, PROT_CACHEABLE, &done))
+		pr_warn_ratelimited("failed to restore the memory type of %lu pages\n",
+				    npages - done);
+}
+
+static void release_file_state(struct kref *ref)
+{
+	struct file_state *state = container_of(ref, struct file_state, ref);
+
+	mutex_lock(&dev_lock);
+	list_del(&state->list);
+	mutex_unlock(&dev_lock);
+	kfree(state);
+}
+
+static void free_region_done(void *arg)
+{
+	struct mapped_region *region = arg;
+
+	kfree(region->policy.il_nodes);
+	kfree(region);
+	atomic_dec(&mapped_count);
+}
+
+/* large regions are freed in the background, the region counts as mapped until then */
+static void free_mapped_region(struct mapped_region *region)
+{
+	struct page **pages = memdev_region_pages(region, true);
+
+	if (region->dma) {
+		memdev_stat_resident(pages, region->npages, region->cfg.prot, false);
+		memdev_free_contig(region);
+		free_region_done(region);
+		return;
+	}
+	memdev_release_pages(pages, region->npages, region->cfg.prot, free_region_done, region);
+}
+
+static void release_region(struct kref *ref)
+{
+	struct mapped_region *region = container_of(ref, struct mapped_region, ref);
+	struct file_state *state = region->state;
+
+	mutex_lock(&state->lock);
+	list_del(&region->list);
+	mutex_unlock(&state->lock);
+
+	trace_memdev_region_release(region->pid, region->user_va, region->size, region->cfg.prot);
+	kref_put(&state->ref, release_file_state);
+	free_mapped_region(region);
+}
+
+void memdev_put_region(struct mapped_region *region)
+{
+	kref_put(&region->ref, release_region);
+}
+
+/* the next huge page order to try after an allocation of the given order failed */
+static unsigned int lower_page_order(unsigned int order)
+{
+	return order > PMD_ORDER ? PMD_ORDER : 0;
+}
+
+/* the largest order (not above max_order) usable at index idx of a region mapped at va */
+static unsigned int fit_page_order(unsigned long va, unsigned long idx, unsigned long npages,
+				   unsigned int max_order)
+{
+	unsigned int order;
+
+	for (order = max_order; order > 0; order = lower_page_order(order)) {
+		if (order <= MAX_PAGE_ORDER && IS_ALIGNED(va, PAGE_SIZE << order) &&
+		    idx + (1UL << order) <= npages)
+			return order;
+	}
+	return 0;
+}
+
+static struct page *alloc_region_chunk(struct mapped_region *region, unsigned long idx,
+				       unsigned int order)
+{
+	u64 start = memdev_trace_start(memdev_alloc);
+	int node = region_alloc_node(&region->policy, idx);
+	struct page *page;
+
+	page = __alloc_pages(HUGE_GFP_FLAGS, order, node, &region->policy.allowed);
+	trace_memdev_alloc(node, order, 1UL << order, page ? 1UL << order : 0, region->cfg.prot,
+			   memdev_trace_duration(start));
+	return page;
+}
+
+/* order-0 pages for a region, from the pool first */
+static unsigned long alloc_region_bulk(struct mapped_region *region, int node, unsigned long nr,
+				       struct page **pages)
+{
+	u64 start = memdev_trace_start(memdev_alloc);
+	unsigned long nr_allocated;
+
+	nr_allocated = memdev_pool_alloc_bulk(node, &region->policy.allowed, nr, pages);
+	trace_memdev_alloc(node, 0, nr, nr_allocated, region->cfg.prot,
+			   memdev_trace_duration(start));
+	return nr_allocated;
+}
+
+/*
+ * Back the PMD/PUD-aligned part of a region mapped at va with compound pages. Entries left NULL
+ * (the unaligned head and tail, or chunks whose high-order allocation failed) are to be filled
+ * with order-0 pages by the caller.
+ */
+static void alloc_huge_chunks(struct mapped_region *region, unsigned long va)
+{
+	struct page **pages = memdev_region_pages(region, true);
+	unsigned long i = 0, j;
+	unsigned int order;
+	struct page *page;
+
+	while (i < region->npages) {
+		order = fit_page_order(va + i * PAGE_SIZE, i, region->npages, region->cfg.order);
+		if (!order) {
+			i++;
+			continue;
+		}
+
+		page = alloc_region_chunk(region, i, order);
+		if (!page)
+			memdev_stat_inc(MEMDEV_STAT_HUGE_FALLBACKS);
+		/* retry a smaller chunk before giving the range up to 4K pages */
+		if (!page && lower_page_order(order)) {
+			order = lower_page_order(order);
+			page = alloc_region_chunk(region, i, order);
+		}
+		cond_resched();
+		if (!page) {
+			i++;
+			continue;
+		}
+
+		for (j = 0; j < (1UL << order); j++)
+			pages[i + j] = page + j;
+		i += 1UL << order;
+	}
+}
+
+/*
+ * Fill the remaining entries of a region with order-0 pages, one bulk allocation per interleave
+ * chunk (or a single one if the region is not interleaved). Returns the number of populated
+ * entries.
+ */
+static unsigned long alloc_region_pages(struct mapped_region *region)
+{
+	struct page **pages = memdev_region_pages(region, true);
+	struct alloc_policy *pol = &region->policy;
+	unsigned long i, nr, step, nr_populated = 0;
+
+	step = pol->il_len ? INTERLEAVE_PAGES : region->npages;
+	for (i = 0; i < region->npages; i += step) {
+		nr = min(step, region->npages - i);
+		nr_populated += alloc_region_bulk(region, region_alloc_node(pol, i), nr, pages + i);
+	}
+	return nr_populated;
+}
+
+static int map_pages_to_vma(struct mapped_region *region, struct vm_area_struct *vma)
+{
+	struct page **pages = memdev_region_pages(region, true);
+	unsigned long npages = region->npages;
+	unsigned long npages_unmap = npages;
+	u64 start;
+	int ret;
+
+	/* huge leaf entries can only be installed into PFN mappings, at fault time */
+	if (region->cfg.order)
+		return 0;
+
+	start = memdev_trace_start(memdev_insert);
+	if (region->cfg.contig) {
+		/* one range: the whole VMA in a single call, nothing left to fault in */
+		ret = remap_pfn_range(vma, vma->vm_start, page_to_pfn(pages[0]),
+				      npages << PAGE_SHIFT, vma->vm_page_prot);
+		npages_unmap = ret ? npages : 0;
+	} else {
+		ret = vm_insert_pages(vma, vma->vm_start, pages, &npages_unmap);
+	}
+	trace_memdev_insert(vma->vm_start, npages, npages - npages_unmap, region->cfg.prot,
+			    memdev_trace_duration(start));
+	if (ret)
+		pr_err_ratelimited("%lu of %lu pages failed to be mapped.\n", npages_unmap, npages);
+
+	return ret;
+}
+
+static const struct vm_operations_struct memdev_vm_ops;
+
+static unsigned long region_index(struct mapped_region *region, struct vm_area_struct *vma,
+				  unsigned long addr)
+{
+	return vma->vm_pgoff + ((addr - vma->vm_start) >> PAGE_SHIFT) - region->pgoff;
+}
+
+/* pairs with the release in grow_region(): a new size implies the array covering it */
+static unsigned long region_npages(struct mapped_region *region)
+{
+	return smp_load_acquire(&region->npages);
+}
+
+/* idx must be below region_npages() */
+static struct page *region_page(struct mapped_region *region, unsigned long idx)
+{
+	struct page *page;
+
+	rcu_read_lock();
+	page = smp_load_acquire(&rcu_dereference(region->pages)[idx]);
+	rcu_read_unlock();
+	return page;
+}
+
+/* extend the page array to npages entries, keeping the existing pages */
+static int grow_region(struct mapped_region *region, unsigned long npages)
+{
+	struct page **pages, **old;
+	int ret = 0;
+
+	mutex_lock(&region->lock);
+	if (npages <= region->npages)
+		goto out;
+
+	pages = kvcalloc(npages, sizeof(struct page *), GFP_KERNEL);
+	if (!pages) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	old = memdev_region_pages(region, false);
+	memcpy(pages, old, region->npages * sizeof(struct page *));
+
+	rcu_assign_pointer(region->pages, pages);
+	smp_store_release(&region->npages, npages);
+	region->size = npages << PAGE_SHIFT;
+	kvfree_rcu_mightsleep(old);
+
+out:
+	mutex_unlock(&region->lock);
+	return ret;
+}
+
+/*
+ * The end of the run starting at idx over which the mapping state by the VMAs of mm (other than
+ * skip) does not change; *covered tells whether the run is mapped. Only the VMAs in the span
+ * the region was ever mapped at are looked at, not the whole address space.
+ */
+static unsigned long next_mapped_boundary(struct mapped_region *region, struct mm_struct *mm,
+					  struct vm_area_struct *skip, unsigned long idx,
+					  unsigned long end, bool *covered)
+{
+	unsigned long start, last, next_start = end, covered_end = 0;
+	struct vm_area_struct *vma;
+	VMA_ITERATOR(vmi, mm, region->map_start);
+
+	lockdep_assert_held(&region->lock);
+	for_each_vma_range(vmi, vma, region->map_end) {
+		if (vma == skip || vma->vm_ops != &memdev_vm_ops || vma->vm_private_data != region)
+			continue;
+		start = region_index(region, vma, vma->vm_start);
+		last = region_index(region, vma, vma->vm_end);
+		if (start <= idx && idx < last)
+			covered_end = max(covered_end, last);
+		else if (start > idx)
+			next_start = min(next_start, start);
+	}
+
+	*covered = covered_end > idx;
+	return min(*covered ? covered_end : next_start, end);
+}
+
+/*
+ * Release the pages of [start, end) that no other VMA maps any more. Compound pages straddling
+ * the boundaries are kept: may_split() only allows that for pages not populated at split time.
+ */
+static void release_region_range(struct mapped_region *region, unsigned long start,
+				 unsigned long end)
+{
+	struct page **pages = memdev_region_pages(region, false);
+	struct page *page, *head;
+	unsigned long i, nr;
+
+	if (start < end && (page = pages[start]) && PageTail(page))
+		start += (1UL << compound_order(compound_head(page))) -
+			 (page - compound_head(page));
+	if (start < end && (page = pages[end - 1])) {
+		head = compound_head(page);
+		if (end - 1 - (page - head) + (1UL << compound_order(head)) > end)
+			end -= page - head + 1;
+	}
+	if (start >= end)
+		return;
+
+	nr = memdev_stat_resident(pages + start, end - start, region->cfg.prot, false);
+	memdev_stat_add(MEMDEV_STAT_TRIMMED_PAGES, nr);
+	WRITE_ONCE(region->nr_resident, region->nr_resident - nr);
+	memdev_reset_pages_memtype(pages + start, end - start, region->cfg.prot);
+	memdev_pool_free_pages(pages + start, end - start);
+	for (i = start; i < end; i++)
+		WRITE_ONCE(pages[i], NULL);
+}
+
+/* from now on, pages may be used outside of the VMAs of the creating process */
+void memdev_share_region(struct mapped_region *region)
+{
+	mutex_lock(&region->lock);
+	region->shared = true;
+	mutex_unlock(&region->lock);
+}
+
+/*
+ * An export keeps partial munmap() from releasing pages from its start, since the buffer is
+ * populated first, but the region is only shared for good once the buffer exists.
+ */
+void memdev_begin_export(struct mapped_region *region)
+{
+	mutex_lock(&region->lock);
+	region->exporting++;
+	mutex_unlock(&region->lock);
+}
+
+void memdev_end_export(struct mapped_region *region, bool exported)
+{
+	mutex_lock(&region->lock);
+	region->exporting--;
+	if (exported)
+		region->shared = true;
+	mutex_unlock(&region->lock);
+}
+
+/*
+ * Partial munmap(): release the pages of the closed VMA unless another VMA of the process still
+ * maps them (e.g. the new VMA of an mremap() move). Pages of shared regions are kept: VMAs of
+ * other address spaces cannot be examined safely.
+ */
+static void trim_region(struct mapped_region *region, struct vm_area_struct *vma)
+{
+	struct mm_struct *mm = vma->vm_mm;
+	unsigned long idx, end, next;
+	bool covered;
+
+	/* process exit: the VMA tree is torn down and the region goes away with it */
+	if (!atomic_read(&mm->mm_users))
+		return;
+	mmap_assert_locked(mm);
+
+	mutex_lock(&region->lock);
+	if (region->shared || region->exporting || region->cfg.contig || mm != region->mm)
+		goto out;
+
+	idx = region_index(region, vma, vma->vm_start);
+	end = min(region_index(region, vma, vma->vm_end), region->npages);
+	while (idx < end) {
+		next = next_mapped_boundary(region, mm, vma, idx, end, &covered);
+		if (!covered)
+			release_region_range(region, idx, next);
+		idx = next;
+	}
+out:
+	mutex_unlock(&region->lock);
+}
+
+/*
+ * fork() shares the region with the child (MAP_SHARED semantics), VMA splits and mremap() copies
+ * within the same process share it as well.
+ */
+static void memdev_vma_open(struct vm_area_struct *vma)
+{
+	struct mapped_region *region = vma->vm_private_data;
+
+	kref_get(&region->ref);
+	if (vma->vm_mm != region->mm) {
+		memdev_share_region(region);
+		return;
+	}
+
+	/* the new VMA of an mremap() move may lie anywhere */
+	mutex_lock(&region->lock);
+	region->map_start = min(region->map_start, vma->vm_start);
+	region->map_end = max(region->map_end, vma->vm_end);
+	mutex_unlock(&region->lock);
+}
+
+static void memdev_vma_close(struct vm_area_struct *vma)
+{
+	struct mapped_region *region = vma->vm_private_data;
+	u64 start = memdev_trace_start(memdev_vma_close);
+	enum prot_type prot = region->cfg.prot;
+	bool last;
+
+	trim_region(region, vma);
+	/* the region may be gone past this point */
+	last = kref_put(&region->ref, release_region);
+	trace_memdev_vma_close(vma->vm_start, vma_pages(vma), prot, last,
+			       memdev_trace_duration(start));
+}
+
+/* huge regions only split at the boundaries of their populated compound pages */
+static int memdev_vma_may_split(struct vm_area_struct *vma, unsigned long addr)
+{
+	struct mapped_region *region = vma->vm_private_data;
+	unsigned long idx = region_index(region, vma, addr);
+	struct page *page;
+
+	if (!region->cfg.order || idx >= region_npages(region))
+		return 0;
+
+	page = region_page(region, idx);
+	if (page && PageTail(page))
+		return -EINVAL;
+	return 0;
+}
+
+static int memdev_vma_mremap(struct vm_area_struct *vma)
+{
+	struct mapped_region *region = vma->vm_private_data;
+
+	mutex_lock(&region->lock);
+	if (vma->vm_pgoff == region->pgoff)
+		region->user_va = vma->vm_start;
+	mutex_unlock(&region->lock);
+	return 0;
+}
+
+/*
+ * Allocate the missing order-0 pages of the fault-around window around idx on the given node.
+ * The page at idx is allocated first, so only a failure to get that one is reported.
+ */
+static int populate_region_pages(struct mapped_region *region, unsigned long idx, int node)
+{
+	struct page *batch[FAULT_AROUND_PAGES] = {};
+	unsigned long start = ALIGN_DOWN(idx, FAULT_AROUND_PAGES);
+	unsigned long end = min(start + FAULT_AROUND_PAGES, region->npages);
+	unsigned long i, nr_missing = 0, nr_allocated, next = 1;
+	struct page **pages;
+	int ret = 0;
+
+	mutex_lock(&region->lock);
+	pages = memdev_region_pages(region, false);
+	if (pages[idx])
+		goto out;
+
+	for (i = start; i < end; i++)
+		nr_missing += !pages[i];
+
+	nr_allocated = alloc_region_bulk(region, node, nr_missing, batch);
+	if (!nr_allocated) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	/* insert_region_pte() maps them with the memory type PAT tracks */
+	ret = memdev_set_pages_memtype(batch, nr_allocated, region->cfg.prot);
+	if (ret) {
+		memdev_pool_free_pages(batch, nr_allocated);
+		goto out;
+	}
+
+	smp_store_release(&pages[idx], batch[0]);
+	for (i = start; i < end && next < nr_allocated; i++) {
+		if (!pages[i])
+			smp_store_release(&pages[i], batch[next++]);
+	}
+	memdev_stat_resident(batch, next, region->cfg.prot, true);
+	WRITE_ONCE(region->nr_resident, region->nr_resident + next);
+
+out:
+	mutex_unlock(&region->lock);
+	return ret;
+}
+
+/*
+ * A write fault gets a writable, dirty entry right away, as vmf_insert_pfn_pmd() gives the huge
+ * fault path: a clean one would take a second fault on the first write.
+ */
+static vm_fault_t insert_region_pte(struct vm_area_struct *vma, unsigned long addr,
+				    struct page *page, bool write)
+{
+	unsigned long pfn = page_to_pfn(page);
+	/* special entries in PFN mappings, as vmf_insert_pfn() installs them */
+	pfn_t pfnt = __pfn_to_pfn_t(pfn, vma->vm_flags & VM_PFNMAP ? PFN_SPECIAL : 0);
+
+	if (write)
+		return vmf_insert_mixed_mkwrite(vma, addr, pfnt);
+	if (vma->vm_flags & VM_PFNMAP)
+		return vmf_insert_pfn(vma, addr, pfn);
+	return vmf_insert_mixed(vma, addr, pfnt);
+}
+
+/*
+ * Install the PTE of the faulting page, allocating it on the faulting CPU's node if needed. The
+ * other populated pages of the fault-around window are mapped as well: ->map_pages is not usable
+ * here since it runs under RCU and only serves read faults.
+ */
+static vm_fault_t memdev_vma_fault(struct vm_fault *vmf)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct mapped_region *region = vma->vm_private_data;
+	unsigned long idx = vmf->pgoff - region->pgoff;
+	unsigned long start, end, i, addr;
+	struct page *page;
+	vm_fault_t ret;
+
+	memdev_stat_inc(MEMDEV_STAT_FAULTS);
+
+	/* mremap() extended the VMA past the end of the region */
+	if (idx >= region_npages(region) &&
+	    grow_region(region, region_index(region, vma, vma->vm_end)))
+		return VM_FAULT_OOM;
+
+	page = region_page(region, idx);
+	if (!page) {
+		if (populate_region_pages(region, idx, region_alloc_node(&region->policy, idx)))
+			return VM_FAULT_OOM;
+		page = region_page(region, idx);
+	}
+
+	ret = insert_region_pte(vma, vmf->address, page, vmf->flags & FAULT_FLAG_WRITE);
+	if (ret != VM_FAULT_NOPAGE)
+		return ret;
+
+	start = ALIGN_DOWN(idx, FAULT_AROUND_PAGES);
+	end = min(start + FAULT_AROUND_PAGES, region_npages(region));
+	for (i = start; i < end; i++) {
+		addr = vmf->address + ((long)(i - idx) << PAGE_SHIFT);
+		if (i == idx || addr < vma->vm_start || addr >= vma->vm_end)
+			continue;
+		page = region_page(region, i);
+		if (page && insert_region_pte(vma, addr, page, false) == VM_FAULT_NOPAGE)
+			memdev_stat_inc(MEMDEV_STAT_FAULT_AROUND_PAGES);
+	}
+
+	return VM_FAULT_NOPAGE;
+}
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+/*
+ * Back an aligned chunk of 2^order entries with a single compound page. Chunks that already
+ * have some pages (e.g. a previous huge allocation failed and the 4K path took over) are left
+ * untouched and reported as -EEXIST.
+ */
+static int populate_region_chunk(struct mapped_region *region, unsigned long idx,
+				 unsigned int order)
+{
+	unsigned long i, nr = 1UL << order;
+	struct page **pages, *page;
+	int ret = 0;
+
+	if (order > MAX_PAGE_ORDER)
+		return -EINVAL;
+
+	mutex_lock(&region->lock);
+	pages = memdev_region_pages(region, false);
+	for (i = idx; i < idx + nr; i++) {
+		if (pages[i]) {
+			ret = -EEXIST;
+			goto out;
+		}
+	}
+
+	page = alloc_region_chunk(region, idx, order);
+	if (!page) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	ret = memdev_set_range_memtype(page, nr, region->cfg.prot);
+	if (ret) {
+		__free_pages(page, order);
+		goto out;
+	}
+	for (i = 0; i < nr; i++)
+		smp_store_release(&pages[idx + i], page + i);
+	memdev_stat_resident(pages + idx, nr, region->cfg.prot, true);
+	WRITE_ONCE(region->nr_resident, region->nr_resident + nr);
+
+out:
+	mutex_unlock(&region->lock);
+	return ret;
+}
+
+static vm_fault_t memdev_vma_huge_fault(struct vm_fault *vmf, unsigned int order)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct mapped_region *region = vma->vm_private_data;
+	unsigned long size = PAGE_SIZE << order;
+	unsigned long addr = ALIGN_DOWN(vmf->address, size);
+	bool write = vmf->flags & FAULT_FLAG_WRITE;
+	unsigned long idx, pfn;
+	struct page *page;
+	vm_fault_t ret;
+	int err;
+
+	if (order > region->cfg.order || !(vma->vm_flags & VM_PFNMAP) ||
+	    addr < vma->vm_start || addr + size > vma->vm_end)
+		return VM_FAULT_FALLBACK;
+
+	idx = region_index(region, vma, addr);
+	if (idx + (1UL << order) > region_npages(region))
+		return VM_FAULT_FALLBACK;
+
+	page = region_page(region, idx);
+	if (!page) {
+		err = populate_region_chunk(region, idx, order);
+		if (err == -ENOMEM)
+			memdev_stat_inc(MEMDEV_STAT_HUGE_FALLBACKS);
+		if (err)
+			return VM_FAULT_FALLBACK;
+		page = region_page(region, idx);
+	}
+
+	/* a leaf entry needs a naturally aligned, physically contiguous range of pages */
+	pfn = page_to_pfn(page);
+	if (!IS_ALIGNED(pfn, 1UL << order) ||
+	    (!region->cfg.contig && compound_order(compound_head(page)) < order))
+		return VM_FAULT_FALLBACK;
+
+	if (order == PMD_ORDER)
+		ret = vmf_insert_pfn_pmd(vmf, pfn_to_pfn_t(pfn), write);
+#ifdef CONFIG_HAVE_ARCH_TRANSPARENT_HUGEPAGE_PUD
+	else if (order == PUD_ORDER)
+		ret = vmf_insert_pfn_pud(vmf, pfn_to_pfn_t(pfn), write);
+#endif
+	else
+		return VM_FAULT_FALLBACK;
+
+	if (ret == VM_FAULT_NOPAGE)
+		memdev_stat_inc(MEMDEV_STAT_HUGE_FAULTS);
+	return ret;
+}
+#endif
+
+static const struct vm_operations_struct memdev_vm_ops = {
+	.open = memdev_vma_open,
+	.close = memdev_vma_close,
+	.may_split = memdev_vma_may_split,
+	.mremap = memdev_vma_mremap,
+	.fault = memdev_vma_fault,
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+	.huge_fault = memdev_vma_huge_fault,
+#endif
+};
+
+/*
+ * Allocate every missing page of a region, with the page sizes and placement the fault handlers
+ * would have used. Used before the page array is handed to another user (dma-buf export), which
+ * needs it complete and immutable.
+ */
+int memdev_populate_region(struct mapped_region *region)
+{
+	unsigned long i = 0;
+	unsigned int order __maybe_unused;
+	int ret;
+
+	while (i < region_npages(region)) {
+		if (i % 4096 == 0)
+			cond_resched();
+
+		if (region_page(region, i)) {
+			i++;
+			continue;
+		}
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+		order = fit_page_order(region->user_va + i * PAGE_SIZE, i, region_npages(region),
+				       region->cfg.order);
+		if (order && !populate_region_chunk(region, i, order)) {
+			i += 1UL << order;
+			continue;
+		}
+#endif
+		ret = populate_region_pages(region, i, region_alloc_node(&region->policy, i));
+		if (ret)
+			return ret;
+		i++;
+	}
+	return 0;
+}
+
+static void setup_region_vma(struct mapped_region *region, struct vm_area_struct *vma)
+{
+	if (region->cfg.contig)
+		vm_flags_set(vma, VM_PFNMAP | VM_DONTDUMP | VM_DONTEXPAND);
+	else if (region->cfg.order)
+		vm_flags_set(vma, VM_PFNMAP | VM_DONTDUMP);
+	else
+		vm_flags_set(vma, VM_MIXEDMAP);
+	vma->vm_page_prot = get_pgprot(region->cfg.prot);
+}
+
+/*
+ * Map an existing region into another VMA (an mmap() of its dma-buf), with the cache attribute
+ * it was created with. vm_pgoff is relative to the start of the region.
+ */
+int memdev_mmap_region(struct mapped_region *region, struct vm_area_struct *vma)
+{
+	if (!(vma->vm_flags & VM_SHARED) || vma->vm_pgoff + vma_pages(vma) > region->npages)
+		return -EINVAL;
+
+	setup_region_vma(region, vma);
+	/* the buffer has a fixed size, growing its mappings would grow the region */
+	vm_flags_set(vma, VM_DONTEXPAND);
+	/* the fault handlers index the page array with the offset in the original file */
+	vma->vm_pgoff += region->pgoff;
+	kref_get(&region->ref);
+	vma->vm_private_data = region;
+	vma->vm_ops = &memdev_vm_ops;
+	return 0;
+}
+
+static int memdev_open(struct inode *inode, struct file *filp)
+{
+	struct file_state *state;
+
+	if (!try_module_get(THIS_MODULE))
+		return -EBUSY;
+
+	state = kzalloc(sizeof(*state), GFP_KERNEL);
+	if (!state) {
+		module_put(THIS_MODULE);
+		return -ENOMEM;
+	}
+
+	kref_init(&state->ref);
+	mutex_init(&state->lock);
+	state->cfg.prot = g_prot;
+	state->cfg.order = g_page_order;
+	state->cfg.populate = memdev_populate;
+	state->cfg.nodes = node_states[N_MEMORY];
+	INIT_LIST_HEAD(&state->regions);
+	INIT_LIST_HEAD(&state->list);
+
+	mutex_lock(&dev_lock);
+	list_add(&state->list, &file_list);
+	mutex_unlock(&dev_lock);
+
+	filp->private_data = state;
+
+	return 0;
+}
+
+/*
+ * Every VMA holds a reference to the file, so all regions are normally gone by now. Regions still
+ * referenced elsewhere keep the file state alive until they are released.
+ */
+static int memdev_release(struct inode *inode, struct file *filp)
+{
+	struct file_state *state = filp->private_data;
+
+	if (state)
+		kref_put(&state->ref, release_file_state);
+
+	module_put(THIS_MODULE);
+	return 0;
+}
+
+static int create_region(struct file *filp, struct vm_area_struct *vma)
+{
+	struct file_state *state = filp->private_data;
+	struct mempolicy *mpol = NULL;
+	struct mapped_region *region;
+	size_t size = vma->vm_end - vma->vm_start;
+	unsigned long npages, nr_allocated;
+	struct page **pages;
+	int ret;
+
+	if (size == 0 || (size % PAGE_SIZE) != 0) {
+		pr_err_ratelimited("invalid size %zu\n", size);
+		return -EINVAL;
+	}
+	/* private copies of pages with a non-default cache attribute would silently lose it */
+	if (!(vma->vm_flags & VM_SHARED)) {
+		pr_err_ratelimited("only MAP_SHARED mappings are supported\n");
+		return -EINVAL;
+	}
+	npages = size / PAGE_SIZE;
+
+	region = kzalloc(sizeof(*region), GFP_KERNEL);
+	if (!region) {
+		pr_err("failed to allocate region\n");
+		return -ENOMEM;
+	}
+
+#ifdef CONFIG_NUMA
+	/* a VMA policy only exists if mbind() was called, which cannot happen before mmap() */
+	if (numa_enabled)
+		mpol = vma->vm_policy ? vma->vm_policy : current->mempolicy;
+#endif
+
+	mutex_lock(&state->lock);
+	region->cfg = state->cfg;
+	ret = init_alloc_policy(&region->policy, mpol, &state->cfg, state->weights);
+	mutex_unlock(&state->lock);
+	if (ret) {
+		pr_err_ratelimited("mmap rejected: unsupported mempolicy (mode=%d)\n",
+				   mpol ? mpol->mode : MPOL_DEFAULT);
+		goto err_free_region;
+	}
+
+	/* the bulk allocator only fills NULL entries */
+	pages = kvcalloc(npages, sizeof(struct page *), GFP_KERNEL);
+	if (!pages) {
+		pr_err("failed to allocate page array\n");
+		ret = -ENOMEM;
+		goto err_free_region;
+	}
+	RCU_INIT_POINTER(region->pages, pages);
+	region->npages = npages;
+
+	setup_region_vma(region, vma);
+
+	if (region->cfg.contig) {
+		ret = memdev_alloc_contig(region, region_alloc_node(&region->policy, 0));
+		if (ret) {
+			pr_err_ratelimited("no contiguous range of %lu pages\n", npages);
+			goto err_free_pages;
+		}
+		/* remap_pfn_range() takes the memory type PAT tracks for RAM, WB unless changed */
+		ret = memdev_set_range_memtype(pages[0], npages, region->cfg.prot);
+		if (ret) {
+			pr_err_ratelimited("failed to set the memory type of %lu pages\n", npages);
+			goto err_free_pages;
+		}
+	} else if (region->cfg.populate) {
+		if (region->cfg.order)
+			alloc_huge_chunks(region, vma->vm_start);
+
+		nr_allocated = alloc_region_pages(region);
+		if (nr_allocated != npages) {
+			pr_err_ratelimited("bulk allocation failed: got %lu of %lu pages\n",
+					   nr_allocated, npages);
+			ret = -ENOMEM;
+			goto err_free_pages;
+		}
+		ret = memdev_set_pages_memtype(pages, npages, region->cfg.prot);
+		if (ret) {
+			pr_err_ratelimited("failed to set the memory type of %lu pages\n", npages);
+			goto err_free_pages;
+		}
+	}
+
+	if (region->cfg.populate) {
+		ret = map_pages_to_vma(region, vma);
+		if (ret) {
+			pr_err_ratelimited("failed to map pages: %d\n", ret);
+			goto err_reset_memtype;
+		}
+		memdev_stat_resident(pages, npages, region->cfg.prot, true);
+		region->nr_resident = npages;
+	}
+
+	region->pid = task_pid_nr(current->group_leader);
+	region->user_va = vma->vm_start;
+	region->pgoff = vma->vm_pgoff;
+	region->size = size;
+	region->mm = current->mm;
+	region->map_start = vma->vm_start;
+	region->map_end = vma->vm_end;
+	mutex_init(&region->lock);
+	kref_init(&region->ref);
+	kref_get(&state->ref);
+	region->state = state;
+	INIT_LIST_HEAD(&region->list);
+
+	mutex_lock(&state->lock);
+	list_add(&region->list, &state->regions);
+	mutex_unlock(&state->lock);
+
+	atomic_inc(&mapped_count);
+
+	vma->vm_private_data = region;
+	vma->vm_ops = &memdev_vm_ops;
+	return 0;
+
+err_reset_memtype:
+	/* memdev_free_contig() does it for DMA API ranges */
+	if (!region->dma)
+		memdev_reset_pages_memtype(pages, npages, region->cfg.prot);
+err_free_pages:
+	if (region->dma) {
+		memdev_free_contig(region);
+	} else {
+		memdev_pool_free_pages(pages, npages);
+		kvfree(pages);
+	}
+err_free_region:
+	kfree(region->policy.il_nodes);
+	kfree(region);
+	return ret;
+}
+
+static int memdev_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	u64 start = ktime_get_ns(), duration;
+	struct mapped_region *region;
+	int ret;
+
+	ret = create_region(filp, vma);
+	if (ret) {
+		memdev_stat_inc(MEMDEV_STAT_MMAP_FAILURES);
+		return ret;
+	}
+
+	duration = ktime_get_ns() - start;
+	region = vma->vm_private_data;
+	memdev_stat_inc(MEMDEV_STAT_MMAPS);
+	memdev_stat_hist(MEMDEV_HIST_MMAP, duration);
+	trace_memdev_mmap(region->pid, region->user_va, region->size, region->cfg.prot,
+			  region->cfg.order, region->policy.mode, region->cfg.populate, duration);
+	return 0;
+}
+
+static unsigned int page_size_to_order(u32 page_size)
+{
+	switch (page_size) {
+	case MEMDEV_PAGE_PMD:
+		return PMD_ORDER;
+	case MEMDEV_PAGE_PUD:
+		return PUD_ORDER;
+	case MEMDEV_PAGE_BASE:
+		/* fallthrough */
+	default:
+		return 0;
+	}
+}
+
+static u32 order_to_page_size(unsigned int order)
+{
+	if (order == PUD_ORDER)
+		return MEMDEV_PAGE_PUD;
+	if (order == PMD_ORDER)
+		return MEMDEV_PAGE_PMD;
+	return MEMDEV_PAGE_BASE;
+}
+
+static u32 config_populate(const struct mmap_config *cfg)
+{
+	if (cfg->contig)
+		return MEMDEV_POPULATE_CONTIG;
+	return cfg->populate ? MEMDEV_POPULATE_EAGER : MEMDEV_POPULATE_LAZY;
+}
+
+static int set_mmap_params(struct file_state *state, const struct memdev_mmap_params *params)
+{
+	struct mmap_config cfg;
+	unsigned int node;
+
+	if (params->valid & ~MEMDEV_PARAM_ALL)
+		return -EINVAL;
+
+	mutex_lock(&state->lock);
+	cfg = state->cfg;
+	mutex_unlock(&state->lock);
+
+	if (params->valid & MEMDEV_PARAM_PROT) {
+		if (params->prot > MEMDEV_PROT_UNCACHED)
+			return -EINVAL;
+		cfg.prot = params->prot;
+	}
+
+	if (params->valid & MEMDEV_PARAM_PAGE_SIZE) {
+		if (params->page_size > MEMDEV_PAGE_PUD)
+			return -EINVAL;
+		if (params->page_size != MEMDEV_PAGE_BASE &&
+		    !IS_ENABLED(CONFIG_TRANSPARENT_HUGEPAGE))
+			return -EOPNOTSUPP;
+		cfg.order = page_size_to_order(params->page_size);
+	}
+
+	if (params->valid & MEMDEV_PARAM_POPULATE) {
+		if (params->populate > MEMDEV_POPULATE_CONTIG)
+			return -EINVAL;
+		cfg.populate = params->populate != MEMDEV_POPULATE_LAZY;
+		cfg.contig = params->populate == MEMDEV_POPULATE_CONTIG;
+	}
+
+	if (params->valid & MEMDEV_PARAM_NODEMASK) {
+		nodes_clear(cfg.nodes);
+		for (node = 0; node < MEMDEV_MAX_NODES; node++) {
+			if (!(params->nodemask[node / 64] & (1ULL << (node % 64))))
+				continue;
+			if (node >= MAX_NUMNODES || !node_state(node, N_MEMORY))
+				return -EINVAL;
+			node_set(node, cfg.nodes);
+		}
+		if (nodes_empty(cfg.nodes))
+			return -EINVAL;
+	}
+
+	mutex_lock(&state->lock);
+	state->cfg = cfg;
+	if (params->valid & MEMDEV_PARAM_WEIGHTS)
+		memcpy(state->weights, params->weights, min(MAX_NUMNODES, MEMDEV_MAX_NODES));
+	mutex_unlock(&state->lock);
+	return 0;
+}
+
+static void get_mmap_params(struct file_state *state, struct memdev_mmap_params *params)
+{
+	struct mmap_config cfg;
+	unsigned int node;
+
+	memset(params, 0, sizeof(*params));
+
+	mutex_lock(&state->lock);
+	cfg = state->cfg;
+	memcpy(params->weights, state->weights, min(MAX_NUMNODES, MEMDEV_MAX_NODES));
+	mutex_unlock(&state->lock);
+
+	params->valid = MEMDEV_PARAM_ALL;
+	params->prot = cfg.prot;
+	params->page_size = order_to_page_size(cfg.order);
+	params->populate = config_populate(&cfg);
+	for_each_node_mask(node, cfg.nodes) {
+		if (node < MEMDEV_MAX_NODES)
+			params->nodemask[node / 64] |= 1ULL << (node % 64);
+	}
+}
+
+/* debugfs "regions": one line per live region, grouped by file */
+void memdev_show_regions(struct seq_file *m)
+{
+	struct mapped_region *region;
+	struct file_state *state;
+
+	seq_printf(m, "%-8s %-18s %-14s %-14s %-20s %-5s %-4s %-6s %s\n", "pid", "va", "size",
+		   "resident", "prot", "order", "mpol", "shared", "refs");
+
+	mutex_lock(&dev_lock);
+	list_for_each_entry(state, &file_list, list) {
+		mutex_lock(&state->lock);
+		/* the page arrays are not scanned: a region may have millions of entries */
+		list_for_each_entry(region, &state->regions, list)
+			seq_printf(m, "%-8d %#-18lx %#-14zx %#-14lx %-20s %-5u %-4d %-6d %u\n",
+				   region->pid, region->user_va, region->size,
+				   READ_ONCE(region->nr_resident) << PAGE_SHIFT,
+				   memdev_prot_names[region->cfg.prot], region->cfg.order,
+				   region->policy.mode, region->shared, kref_read(&region->ref));
+		mutex_unlock(&state->lock);
+	}
+	mutex_unlock(&dev_lock);
+}
+
+/* take a reference to the region mapped at va by the calling process, vm_flags may be NULL */
+static struct mapped_region *get_region_by_va(unsigned long va, unsigned long *start,
+					      vm_flags_t *vm_flags)
+{
+	struct mm_struct *mm = current->mm;
+	struct mapped_region *region = NULL;
+	struct vm_area_struct *vma;
+
+	mmap_read_lock(mm);
+	vma = vma_lookup(mm, va);
+	if (vma && vma->vm_ops == &memdev_vm_ops) {
+		region = vma->vm_private_data;
+		kref_get(&region->ref);
+		*start = vma->vm_start - ((vma->vm_pgoff - region->pgoff) << PAGE_SHIFT);
+		if (vm_flags)
+			*vm_flags = vma->vm_flags;
+	}
+	mmap_read_unlock(mm);
+
+	return region;
+}
+
+/* report extents[0, max_extents), count all of them; physical addresses only to admins */
+static int emit_extent(struct memdev_query *query, const struct memdev_extent *extent,
+		       bool show_pa)
+{
+	struct memdev_extent __user *extents = u64_to_user_ptr(query->extents);
+	struct memdev_extent out = *extent;
+
+	if (!extent->size)
+		return 0;
+	if (!show_pa)
+		out.pa = 0;
+	if (query->nr_extents < query->max_extents &&
+	    copy_to_user(&extents[query->nr_extents], &out, sizeof(out)))
+		return -EFAULT;
+	query->nr_extents++;
+	return 0;
+}
+
+/*
+ * Describe the physical layout of a mapping as runs of physically contiguous pages, and count its
+ * pages per node.
+ */
+static int query_region(struct memdev_query *query)
+{
+	u64 __user *unode_pages = u64_to_user_ptr(query->node_pages);
+	/* the same rule as /proc/$PID/pagemap: PFNs help attacks on the physical layout */
+	bool show_pa = capable(CAP_SYS_ADMIN);
+	struct memdev_extent extent = {};
+	struct mapped_region *region;
+	unsigned long i, start, pfn, npages;
+	unsigned long *node_pages;
+	unsigned int order;
+	struct page *page;
+	int node, ret = 0;
+
+	node_pages = kcalloc(nr_node_ids, sizeof(*node_pages), GFP_KERNEL);
+	if (!node_pages)
+		return -ENOMEM;
+
+	region = get_region_by_va(query->va, &start, NULL);
+	if (!region) {
+		kfree(node_pages);
+		return -EINVAL;
+	}
+
+	query->nr_extents = 0;
+	query->start = start;
+	query->size = region->size;
+	query->resident = 0;
+	query->prot = region->cfg.prot;
+	query->page_size = order_to_page_size(region->cfg.order);
+	query->populate = config_populate(&region->cfg);
+	query->pa = region->cfg.contig && show_pa ? page_to_phys(region_page(region, 0)) : 0;
+	query->mempolicy = region->policy.mode;
+
+	npages = region_npages(region);
+	for (i = 0; i < npages; i++) {
+		if (i % 4096 == 0)
+			cond_resched();
+
+		page = region_page(region, i);
+		if (!page) {
+			ret = emit_extent(query, &extent, show_pa);
+			if (ret)
+				goto out;
+			extent.size = 0;
+			continue;
+		}
+
+		query->resident += PAGE_SIZE;
+		pfn = page_to_pfn(page);
+		node = page_to_nid(page);
+		node_pages[node]++;
+		order = compound_order(compound_head(page));
+		if (extent.size && extent.pa + extent.size == PFN_PHYS(pfn) &&
+		    extent.node == node && extent.order == order) {
+			extent.size += PAGE_SIZE;
+			continue;
+		}
+
+		ret = emit_extent(query, &extent, show_pa);
+		if (ret)
+			goto out;
+		extent.offset = i << PAGE_SHIFT;
+		extent.pa = PFN_PHYS(pfn);
+		extent.size = PAGE_SIZE;
+		extent.node = node;
+		extent.order = order;
+	}
+	ret = emit_extent(query, &extent, show_pa);
+	if (ret)
+		goto out;
+
+	for (node = 0; node < nr_node_ids && node < query->max_nodes && unode_pages; node++) {
+		if (put_user((u64)node_pages[node], &unode_pages[node])) {
+			ret = -EFAULT;
+			break;
+		}
+	}
+
+out:
+	memdev_put_region(region);
+	kfree(node_pages);
+	return ret;
+}
+
+/*
+ * The descriptor is only installed once its number has reached user space, nothing is left open
+ * behind an -EFAULT.
+ */
+static int export_region(struct memdev_export *export, struct memdev_export __user *uexport)
+{
+	struct mapped_region *region;
+	struct dma_buf *dmabuf;
+	unsigned long start;
+	vm_flags_t vm_flags;
+	int fd, ret = 0;
+
+	region = get_region_by_va(export->va, &start, &vm_flags);
+	if (!region)
+		return -EINVAL;
+	/* no more access through the buffer than through the mapping */
+	if ((export->flags & O_ACCMODE) == O_RDWR && !(vm_flags & VM_WRITE)) {
+		ret = -EACCES;
+		goto out;
+	}
+
+	fd = get_unused_fd_flags(export->flags & O_CLOEXEC);
+	if (fd < 0) {
+		ret = fd;
+		goto out;
+	}
+
+	dmabuf = memdev_export_region(region, export->flags);
+	if (IS_ERR(dmabuf)) {
+		put_unused_fd(fd);
+		ret = PTR_ERR(dmabuf);
+		goto out;
+	}
+
+	export->fd = fd;
+	if (copy_to_user(uexport, export, sizeof(*export))) {
+		put_unused_fd(fd);
+		/* releases the region reference of the buffer */
+		dma_buf_put(dmabuf);
+		ret = -EFAULT;
+		goto out;
+	}
+	fd_install(fd, dmabuf->file);
+	trace_memdev_export(region->pid, region->user_va, dmabuf->size, fd);
+
+out:
+	memdev_put_region(region);
+	return ret;
+}
+
+/* bytes of [start, end) backed by pages, the range being covered by memdev mappings */
+static u64 count_resident(struct mm_struct *mm, unsigned long start, unsigned long end)
+{
+	struct mapped_region *region;
+	struct vm_area_struct *vma;
+	unsigned long idx, last;
+	u64 resident = 0;
+	VMA_ITERATOR(vmi, mm, start);
+
+	for_each_vma_range(vmi, vma, end) {
+		if (vma->vm_ops != &memdev_vm_ops)
+			continue;
+		region = vma->vm_private_data;
+		idx = region_index(region, vma, max(start, vma->vm_start));
+		last = min(region_index(region, vma, min(end, vma->vm_end)), region_npages(region));
+		for (; idx < last; idx++)
+			resident += region_page(region, idx) ? PAGE_SIZE : 0;
+	}
+	return resident;
+}
+
+/* every VMA of [start, end) is a memdev mapping, without holes */
+static bool range_is_mapped(struct mm_struct *mm, unsigned long start, unsigned long end)
+{
+	struct vm_area_struct *vma;
+	unsigned long addr = start;
+	VMA_ITERATOR(vmi, mm, start);
+
+	for_each_vma_range(vmi, vma, end) {
+		if (vma->vm_start > addr || vma->vm_ops != &memdev_vm_ops)
+			return false;
+		addr = vma->vm_end;
+	}
+	return addr >= end;
+}
+
+/*
+ * mlock() leaves special mappings alone, do its accounting here: the lock is dropped by munmap()
+ * like any other, and not inherited across fork(). Whole VMAs are locked, modules cannot split
+ * them.
+ */
+static int lock_range(struct mm_struct *mm, unsigned long start, unsigned long end)
+{
+	struct vm_area_struct *vma;
+	int ret = 0;
+	VMA_ITERATOR(vmi, mm, start);
+
+	if (mmap_write_lock_killable(mm))
+		return -EINTR;
+
+	if (!range_is_mapped(mm, start, end)) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	for_each_vma_range(vmi, vma, end) {
+		if (vma->vm_flags & VM_LOCKED)
+			continue;
+		ret = __account_locked_vm(mm, vma_pages(vma), true, current,
+					  capable(CAP_IPC_LOCK));
+		if (ret)
+			break;
+		vm_flags_set(vma, VM_LOCKED);
+	}
+out:
+	mmap_write_unlock(mm);
+	return ret;
+}
+
+/*
+ * The end of the leaf entry mapping addr, a fault having just mapped it: the huge fault path maps
+ * a whole PMD or PUD at once. The caller holds the mmap lock, which keeps the upper levels.
+ */
+static unsigned long mapped_leaf_end(struct mm_struct *mm, unsigned long addr)
+{
+	pgd_t *pgdp = pgd_offset(mm, addr);
+	p4d_t *p4dp;
+	pud_t *pudp, pud;
+	pmd_t pmd;
+
+	if (pgd_none(pgdp_get(pgdp)) || unlikely(pgd_bad(pgdp_get(pgdp))))
+		goto out;
+	p4dp = p4d_offset(pgdp, addr);
+	if (p4d_none(p4dp_get(p4dp)) || unlikely(p4d_bad(p4dp_get(p4dp))))
+		goto out;
+	pudp = pud_offset(p4dp, addr);
+	pud = pudp_get(pudp);
+	if (pud_none(pud) || !pud_present(pud))
+		goto out;
+	/* before *_bad(): the PSE bit of an x86 leaf makes it look bad */
+	if (pud_leaf(pud))
+		return (addr & PUD_MASK) + PUD_SIZE;
+	if (unlikely(pud_bad(pud)))
+		goto out;
+	pmd = pmdp_get_lockless(pmd_offset(pudp, addr));
+	if (pmd_present(pmd) && pmd_leaf(pmd))
+		return (addr & PMD_MASK) + PMD_SIZE;
+out:
+	return addr + PAGE_SIZE;
+}
+
+/*
+ * Fault in every page of a range, through the regular fault handlers so that the leaf sizes, the
+ * page placement and the fault-around are those of a first touch.
+ */
+static int prefault_range(struct memdev_prefault *prefault)
+{
+	unsigned int fault_flags = prefault->flags & MEMDEV_PREFAULT_WRITE ? FAULT_FLAG_WRITE : 0;
+	unsigned long start = ALIGN_DOWN(untagged_addr(prefault->va), PAGE_SIZE);
+	struct mm_struct *mm = current->mm;
+	u64 begin = ktime_get_ns();
+	unsigned long end, addr;
+	bool unlocked;
+	int ret = 0;
+
+	if (prefault->flags & ~MEMDEV_PREFAULT_ALL)
+		return -EINVAL;
+	if (!prefault->size || check_add_overflow(untagged_addr(prefault->va), prefault->size, &end) ||
+	    end > TASK_SIZE)
+		return -EINVAL;
+	end = PAGE_ALIGN(end);
+
+	if (prefault->flags & MEMDEV_PREFAULT_LOCK) {
+		ret = lock_range(mm, start, end);
+		if (ret)
+			return ret;
+	}
+
+	if (mmap_read_lock_killable(mm))
+		return -EINTR;
+
+	if (!range_is_mapped(mm, start, end)) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	for (addr = start; addr < end; addr = mapped_leaf_end(mm, addr)) {
+		/* the lock may be dropped to retry a fault, check the range again */
+		unlocked = false;
+		ret = fixup_user_fault(mm, addr, fault_flags, &unlocked);
+		if (!ret && unlocked && !range_is_mapped(mm, addr, end))
+			ret = -EINVAL;
+		if (ret)
+			break;
+
+		if (fatal_signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+		if ((addr >> PAGE_SHIFT) % 4096 == 0)
+			cond_resched();
+	}
+
+	prefault->resident = count_resident(mm, start, end);
+out:
+	mmap_read_unlock(mm);
+	prefault->duration_ns = ktime_get_ns() - begin;
+	return ret;
+}
+
+static long memdev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct file_state *state = filp->private_data;
+	void __user *uarg = (void __user *)arg;
+	struct memdev_mmap_params *params;
+	union {
+		struct memdev_query query;
+		struct memdev_export export;
+		struct memdev_prefault prefault;
+	} param;
+	int ret;
+
+	switch (cmd) {
+	/* over 1K with the node weights, too large for the stack */
+	case MEMDEV_IOC_SET_MMAP_PARAMS:
+		params = memdup_user(uarg, sizeof(*params));
+		if (IS_ERR(params))
+			return PTR_ERR(params);
+		ret = set_mmap_params(state, params);
+		kfree(params);
+		return ret;
+	case MEMDEV_IOC_GET_MMAP_PARAMS:
+		params = kmalloc(sizeof(*params), GFP_KERNEL);
+		if (!params)
+			return -ENOMEM;
+		get_mmap_params(state, params);
+		ret = copy_to_user(uarg, params, sizeof(*params)) ? -EFAULT : 0;
+		kfree(params);
+		return ret;
+	case MEMDEV_IOC_QUERY:
+		if (copy_from_user(&param.query, uarg, sizeof(param.query)))
+			return -EFAULT;
+		ret = query_region(&param.query);
+		if (ret)
+			return ret;
+		if (copy_to_user(uarg, &param.query, sizeof(param.query)))
+			return -EFAULT;
+		break;
+	case MEMDEV_IOC_EXPORT:
+		if (copy_from_user(&param.export, uarg, sizeof(param.export)))
+			return -EFAULT;
+		return export_region(&param.export, uarg);
+	case MEMDEV_IOC_PREFAULT:
+		if (copy_from_user(&param.prefault, uarg, sizeof(param.prefault)))
+			return -EFAULT;
+		param.prefault.resident = 0;
+		ret = prefault_range(&param.prefault);
+		/* progress is reported on failure as well */
+		if (copy_to_user(uarg, &param.prefault, sizeof(param.prefault)))
+			return -EFAULT;
+		return ret;
+	default:
+		return -ENOTTY;
+	}
+
+	return 0;
+}
+
+static const struct file_operations memdev_fops = {
+	.owner		= THIS_MODULE,
+	.open		= memdev_open,
+	.release	= memdev_release,
+	.mmap		= memdev_mmap,
+	/* PMD-aligned user addresses for mappings large enough to hold a huge page */
+	.get_unmapped_area = thp_get_unmapped_area,
+	.unlocked_ioctl	= memdev_ioctl,
+	.compat_ioctl	= compat_ptr_ioctl,
+};
+
+static int __init memdev_init(void)
+{
+	int ret;
+
+#ifdef CONFIG_NUMA
+	numa_enabled = (num_possible_nodes() > 1);
+#else
+	numa_enabled = false;
+#endif
+
+	if (strcmp(memdev_attr, "normal_cacheable") == 0) {
+		g_prot = PROT_CACHEABLE;
+	} else if (strcmp(memdev_attr, "normal_noncacheable") == 0) {
+		g_prot = PROT_WRITECOMBINE;
+	} else if (strcmp(memdev_attr, "device_noncacheable") == 0) {
+		g_prot = PROT_UNCACHED;
+	} else {
+		pr_err("invalid attr '%s'\n", memdev_attr);
+		return -EINVAL;
+	}
+
+	if (strcmp(memdev_hugepage, "none") == 0) {
+		g_page_order = 0;
+	} else if (strcmp(memdev_hugepage, "pmd") == 0) {
+		g_page_order = PMD_ORDER;
+	} else if (strcmp(memdev_hugepage, "pud") == 0) {
+		g_page_order = PUD_ORDER;
+	} else {
+		pr_err("invalid hugepage '%s'\n", memdev_hugepage);
+		return -EINVAL;
+	}
+	if (g_page_order && !IS_ENABLED(CONFIG_TRANSPARENT_HUGEPAGE)) {
+		pr_err("hugepage=%s requires CONFIG_TRANSPARENT_HUGEPAGE\n", memdev_hugepage);
+		return -EINVAL;
+	}
+
+	ret = memdev_stats_init();
+	if (ret) {
+		pr_err("failed to allocate statistics\n");
+		return ret;
+	}
+
+	ret = memdev_pool_init();
+	if (ret) {
+		pr_err("failed to initialize page pool\n");
+		goto err_pool_init;
+	}
+
+	ret = memdev_free_init();
+	if (ret) {
+		pr_err("failed to create free workqueue\n");
+		goto err_free_init;
+	}
+
+	ret = alloc_chrdev_region(&devno, 0, 1, DEVICE_NAME);
+	if (ret < 0) {
+		pr_err("failed to allocate device number\n");
+		goto err_chrdev_region;
+	}
+
+	cdev_init(&memdev_cdev, &memdev_fops);
+	memdev_cdev.owner = THIS_MODULE;
+
+	ret = cdev_add(&memdev_cdev, devno, 1);
+	if (ret < 0) {
+		pr_err("failed to add cdev\n");
+		goto err_cdev_add;
+	}
+
+	memdev_class = class_create(DEVICE_NAME);
+	if (IS_ERR(memdev_class)) {
+		pr_err("failed to create class\n");
+		ret = PTR_ERR(memdev_class);
+		goto err_class_create;
+	}
+
+	memdev_device = device_create_with_groups(memdev_class, NULL, devno, NULL, memdev_groups,
+						  DEVICE_NAME);
+	if (IS_ERR(memdev_device)) {
+		pr_err("failed to create device\n");
+		ret = PTR_ERR(memdev_device);
+		goto err_device_create;
+	}
+	memdev_contig_init(memdev_device);
+
+	pr_info("initialized, device at %s (attr=%s, hugepage=%s, numa=%s, mapped_count=%d)\n",
+		DEVICE_PATH, memdev_attr, memdev_hugepage, numa_enabled ? "enabled" : "disabled",
+		atomic_read(&mapped_count));
+	return 0;
+
+err_device_create:
+	class_destroy(memdev_class);
+err_class_create:
+	cdev_del(&memdev_cdev);
+err_cdev_add:
+	unregister_chrdev_region(devno, 1);
+err_chrdev_region:
+	memdev_free_exit();
+err_free_init:
+	memdev_pool_exit();
+err_pool_init:
+	memdev_stats_exit();
+	return ret;
+}
+
+/*
+ * Open files and exported dma-bufs pin the module, and regions live no longer than their VMAs and
+ * buffers. Only background releases may still be running: wait for them first.
+ */
+static void __exit memdev_exit(void)
+{
+	memdev_free_exit();
+
+	if (atomic_read(&mapped_count) > 0) {
+		pr_warn("refusing unload, %d mappings still active but the device unloaded.\n",
+			atomic_read(&mapped_count));
+		return;
+	}
+
+	device_destroy(memdev_class, devno);
+	class_destroy(memdev_class);
+	cdev_del(&memdev_cdev);
+	unregister_chrdev_region(devno, 1);
+	memdev_pool_exit();
+	memdev_stats_exit();
+	pr_info("unloaded\n");
+}
+
+module_init(memdev_init);
+module_exit(memdev_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Yiqun Liu");
+MODULE_DESCRIPTION("Memory device with configurable cache attributes");
+MODULE_VERSION("0.1");
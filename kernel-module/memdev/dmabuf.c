@@ -0,0 +1,167 @@
+/*
+ * dma-buf exporter for memdev regions.
+ *
+ * A dma-buf holds a reference to its region, so the pages stay allocated as long as any process
+ * or device uses the buffer, independently of the mapping it was exported from. The region is
+ * fully populated and marked shared before export: its pages never change afterwards (the array
+ * may only grow), so the scatterlists handed to importers stay valid, and mmap() of the buffer
+ * goes through the regular fault handlers of the region.
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/fcntl.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-mapping.h>
+#include <linux/scatterlist.h>
+#include <linux/iosys-map.h>
+
+#include "memdev.h"
+
+MODULE_IMPORT_NS(DMA_BUF);
+
+static struct sg_table *memdev_dmabuf_map(struct dma_buf_attachment *attach,
+					  enum dma_data_direction dir)
+{
+	struct mapped_region *region = attach->dmabuf->priv;
+	struct sg_table *sgt;
+	int ret;
+
+	sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+	if (!sgt)
+		return ERR_PTR(-ENOMEM);
+
+	/*
+	 * Physically contiguous pages (compound ones in particular) are merged into one entry. The
+	 * region lock keeps the page array in place in case the region grows meanwhile.
+	 */
+	mutex_lock(&region->lock);
+	ret = sg_alloc_table_from_pages(sgt, memdev_region_pages(region, false),
+					attach->dmabuf->size >> PAGE_SHIFT, 0, attach->dmabuf->size,
+					GFP_KERNEL);
+	mutex_unlock(&region->lock);
+	if (ret)
+		goto err_free;
+
+	ret = dma_map_sgtable(attach->dev, sgt, dir, 0);
+	if (ret)
+		goto err_free_table;
+
+	return sgt;
+
+err_free_table:
+	sg_free_table(sgt);
+err_free:
+	kfree(sgt);
+	return ERR_PTR(ret);
+}
+
+static void memdev_dmabuf_unmap(struct dma_buf_attachment *attach, struct sg_table *sgt,
+				enum dma_data_direction dir)
+{
+	dma_unmap_sgtable(attach->dev, sgt, dir, 0);
+	sg_free_table(sgt);
+	kfree(sgt);
+}
+
+static int memdev_dmabuf_mmap(struct dma_buf *dmabuf, struct vm_area_struct *vma)
+{
+	return memdev_mmap_region(dmabuf->priv, vma);
+}
+
+/* kernel mappings use the cache attribute of the user mappings, aliases must not conflict */
+static pgprot_t kernel_pgprot(enum prot_type prot)
+{
+	switch (prot) {
+	case PROT_WRITECOMBINE:
+		return pgprot_writecombine(PAGE_KERNEL);
+	case PROT_UNCACHED:
+		return pgprot_noncached(PAGE_KERNEL);
+	case PROT_CACHEABLE:
+		/* fallthrough */
+	default:
+		return PAGE_KERNEL;
+	}
+}
+
+static int memdev_dmabuf_vmap(struct dma_buf *dmabuf, struct iosys_map *map)
+{
+	struct mapped_region *region = dmabuf->priv;
+	void *vaddr;
+
+	mutex_lock(&region->lock);
+	vaddr = vmap(memdev_region_pages(region, false), dmabuf->size >> PAGE_SHIFT, VM_MAP,
+		     kernel_pgprot(region->cfg.prot));
+	mutex_unlock(&region->lock);
+	if (!vaddr)
+		return -ENOMEM;
+
+	iosys_map_set_vaddr(map, vaddr);
+	return 0;
+}
+
+static void memdev_dmabuf_vunmap(struct dma_buf *dmabuf, struct iosys_map *map)
+{
+	vunmap(map->vaddr);
+}
+
+static void memdev_dmabuf_release(struct dma_buf *dmabuf)
+{
+	memdev_put_region(dmabuf->priv);
+}
+
+static const struct dma_buf_ops memdev_dmabuf_ops = {
+	.map_dma_buf	= memdev_dmabuf_map,
+	.unmap_dma_buf	= memdev_dmabuf_unmap,
+	.mmap		= memdev_dmabuf_mmap,
+	.vmap		= memdev_dmabuf_vmap,
+	.vunmap		= memdev_dmabuf_vunmap,
+	.release	= memdev_dmabuf_release,
+};
+
+/*
+ * Export a region as a dma-buf. The caller installs it in a file descriptor, or drops it with
+ * dma_buf_put().
+ */
+struct dma_buf *memdev_export_region(struct mapped_region *region, unsigned int flags)
+{
+	DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+	struct dma_buf *dmabuf;
+	size_t size;
+	int ret;
+
+	if (flags & ~(O_ACCMODE | O_CLOEXEC))
+		return ERR_PTR(-EINVAL);
+	if ((flags & O_ACCMODE) != O_RDONLY && (flags & O_ACCMODE) != O_RDWR)
+		return ERR_PTR(-EINVAL);
+
+	/* pages released by a partial munmap() would still be in use by the buffer */
+	memdev_begin_export(region);
+	/* the buffer covers the region as it is now, even if it grows while being populated */
+	mutex_lock(&region->lock);
+	size = region->size;
+	mutex_unlock(&region->lock);
+	ret = memdev_populate_region(region);
+	if (ret) {
+		memdev_end_export(region, false);
+		return ERR_PTR(ret);
+	}
+
+	kref_get(&region->ref);
+	exp_info.ops = &memdev_dmabuf_ops;
+	exp_info.size = size;
+	exp_info.flags = flags & O_ACCMODE;
+	exp_info.priv = region;
+
+	dmabuf = dma_buf_export(&exp_info);
+	/* before the reference of the buffer may be dropped */
+	memdev_end_export(region, !IS_ERR(dmabuf));
+	if (IS_ERR(dmabuf))
+		memdev_put_region(region);
+	return dmabuf;
+}
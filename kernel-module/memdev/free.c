@@ -0,0 +1,239 @@
+/*
+ * Teardown of region page arrays.
+ *
+ * Small arrays are released in the context of the last unmap. Arrays of at least
+ * async_free_pages entries are split into chunks of FREE_CHUNK_PAGES, each released by a work
+ * item of an unbound workqueue, queued on the node of the first page of its chunk if there is
+ * one there, so munmap()/close() return right away and the chunks of different nodes are freed
+ * in parallel. The array itself and the
+ * region go once the last chunk is done.
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/overflow.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/device.h>
+#include <linux/atomic.h>
+
+#include "memdev.h"
+#include "memdev_trace.h"
+
+/* 1G with 4K pages: a whole number of the largest compound pages, one chunk per work item */
+#define FREE_CHUNK_PAGES	(1UL << 18)
+
+static unsigned long async_free_pages = 1UL << 18;
+module_param(async_free_pages, ulong, 0644);
+MODULE_PARM_DESC(async_free_pages, "Regions of at least this many pages are freed by a workqueue, 0 never does");
+
+struct free_job;
+
+struct free_chunk {
+	struct work_struct work;
+	struct free_job *job;
+	unsigned long start;
+	unsigned long nr;
+};
+
+struct free_job {
+	struct page **pages;
+	enum prot_type prot;
+	void (*done)(void *arg);
+	void *arg;
+	ktime_t start;
+	/* chunks not released yet */
+	atomic_t pending;
+	struct free_chunk chunks[];
+};
+
+static struct workqueue_struct *free_wq;
+
+static atomic_long_t freed_pages;
+static atomic_long_t pending_pages;
+static atomic_long_t async_releases;
+static atomic64_t release_time_us;
+static atomic64_t max_release_time_us;
+
+static void account_release(ktime_t start)
+{
+	s64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	s64 us = div_s64(ns, NSEC_PER_USEC);
+	s64 max = atomic64_read(&max_release_time_us);
+
+	memdev_stat_hist(MEMDEV_HIST_RELEASE, ns);
+	atomic64_add(us, &release_time_us);
+	while (us > max && !atomic64_try_cmpxchg(&max_release_time_us, &max, us))
+		;
+}
+
+/* the node of the first page of a chunk, where its struct pages most likely live; walks it */
+static int chunk_node(struct page **pages, unsigned long start, unsigned long nr)
+{
+	unsigned long i;
+
+	for (i = start; i < start + nr; i++) {
+		if (pages[i])
+			return page_to_nid(pages[i]);
+	}
+	return NUMA_NO_NODE;
+}
+
+static void free_chunk_work(struct work_struct *work)
+{
+	struct free_chunk *chunk = container_of(work, struct free_chunk, work);
+	struct free_job *job = chunk->job;
+	u64 start = memdev_trace_start(memdev_free);
+	int node = start ? chunk_node(job->pages, chunk->start, chunk->nr) : NUMA_NO_NODE;
+	unsigned long nr = memdev_stat_resident(job->pages + chunk->start, chunk->nr, job->prot,
+						false);
+
+	memdev_reset_pages_memtype(job->pages + chunk->start, chunk->nr, job->prot);
+	memdev_pool_free_pages(job->pages + chunk->start, chunk->nr);
+	trace_memdev_free(node, chunk->nr, nr, job->prot, true, memdev_trace_duration(start));
+	atomic_long_add(nr, &freed_pages);
+	atomic_long_sub(chunk->nr, &pending_pages);
+
+	if (!atomic_dec_and_test(&job->pending))
+		return;
+
+	kvfree(job->pages);
+	account_release(job->start);
+	job->done(job->arg);
+	kfree(job);
+}
+
+/* move a chunk boundary past the compound page it would cut */
+static unsigned long chunk_boundary(struct page **pages, unsigned long npages, unsigned long idx)
+{
+	struct page *page, *head;
+
+	if (idx >= npages)
+		return npages;
+
+	page = pages[idx];
+	if (!page || !PageTail(page))
+		return idx;
+	head = compound_head(page);
+	return min(idx - (page - head) + (1UL << compound_order(head)), npages);
+}
+
+static bool release_pages_async(struct page **pages, unsigned long npages, enum prot_type prot,
+				void (*done)(void *arg), void *arg, ktime_t start)
+{
+	unsigned long i, end, nr_chunks = DIV_ROUND_UP(npages, FREE_CHUNK_PAGES);
+	struct free_chunk *chunk;
+	struct free_job *job;
+	unsigned int c;
+	int node;
+
+	job = kzalloc(struct_size(job, chunks, nr_chunks), GFP_KERNEL | __GFP_NOWARN);
+	if (!job)
+		return false;
+
+	job->pages = pages;
+	job->prot = prot;
+	job->done = done;
+	job->arg = arg;
+	job->start = start;
+
+	for (i = 0, c = 0; i < npages; i = end, c++) {
+		end = chunk_boundary(pages, npages, i + FREE_CHUNK_PAGES);
+		chunk = &job->chunks[c];
+		INIT_WORK(&chunk->work, free_chunk_work);
+		chunk->job = job;
+		chunk->start = i;
+		chunk->nr = end - i;
+	}
+	atomic_set(&job->pending, c);
+
+	/* counted in array entries: walking a huge array here is what the workqueue avoids */
+	atomic_long_add(npages, &pending_pages);
+	atomic_long_inc(&async_releases);
+	/*
+	 * The job may be gone as soon as its last chunk is queued. Only the first entry of a chunk
+	 * picks its node: a sparsely populated chunk would be scanned in full by chunk_node(), the
+	 * work items are left to run anywhere then.
+	 */
+	for (i = 0; i < c; i++) {
+		chunk = &job->chunks[i];
+		node = pages[chunk->start] ? page_to_nid(pages[chunk->start]) : NUMA_NO_NODE;
+		queue_work_node(node, free_wq, &chunk->work);
+	}
+	return true;
+}
+
+/*
+ * Release the pages of a page array and the (kvmalloc'ed) array itself, then call done(arg). The
+ * pages are taken off the resident bytes of prot, and given back the WB memory type.
+ * Large arrays are released asynchronously: done() then runs from a workqueue.
+ */
+void memdev_release_pages(struct page **pages, unsigned long npages, enum prot_type prot,
+			  void (*done)(void *arg), void *arg)
+{
+	unsigned long threshold = READ_ONCE(async_free_pages);
+	ktime_t start = ktime_get();
+	unsigned long nr;
+	u64 trace_start;
+	int node;
+
+	if (threshold && npages >= threshold &&
+	    release_pages_async(pages, npages, prot, done, arg, start))
+		return;
+
+	trace_start = memdev_trace_start(memdev_free);
+	node = trace_start ? chunk_node(pages, 0, npages) : NUMA_NO_NODE;
+	nr = memdev_stat_resident(pages, npages, prot, false);
+	memdev_reset_pages_memtype(pages, npages, prot);
+	memdev_pool_free_pages(pages, npages);
+	trace_memdev_free(node, npages, nr, prot, false, memdev_trace_duration(trace_start));
+	kvfree(pages);
+	atomic_long_add(nr, &freed_pages);
+	account_release(start);
+	done(arg);
+}
+
+/* sysfs counters under /sys/class/memdev/memdev/free/ */
+#define FREE_COUNTER_SHOW(name, fmt, expr)						\
+static ssize_t name##_show(struct device *dev, struct device_attribute *attr,		\
+			   char *buf)							\
+{											\
+	return sysfs_emit(buf, fmt "\n", expr);						\
+}											\
+static DEVICE_ATTR_RO(name)
+
+FREE_COUNTER_SHOW(freed_pages, "%ld", atomic_long_read(&freed_pages));
+FREE_COUNTER_SHOW(pending_pages, "%ld", atomic_long_read(&pending_pages));
+FREE_COUNTER_SHOW(async_releases, "%ld", atomic_long_read(&async_releases));
+FREE_COUNTER_SHOW(release_time_us, "%lld", atomic64_read(&release_time_us));
+FREE_COUNTER_SHOW(max_release_time_us, "%lld", atomic64_read(&max_release_time_us));
+
+static struct attribute *free_attrs[] = {
+	&dev_attr_freed_pages.attr,
+	&dev_attr_pending_pages.attr,
+	&dev_attr_async_releases.attr,
+	&dev_attr_release_time_us.attr,
+	&dev_attr_max_release_time_us.attr,
+	NULL,
+};
+
+const struct attribute_group memdev_free_attr_group = {
+	.name = "free",
+	.attrs = free_attrs,
+};
+
+int memdev_free_init(void)
+{
+	free_wq = alloc_workqueue("memdev_free", WQ_UNBOUND, 0);
+	return free_wq ? 0 : -ENOMEM;
+}
+
+/* waits for the pending releases */
+void memdev_free_exit(void)
+{
+	destroy_workqueue(free_wq);
+}
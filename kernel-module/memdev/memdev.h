@@ -0,0 +1,237 @@
+#ifndef MEMDEV_H
+#define MEMDEV_H
+
+#include <linux/gfp.h>
+#include <linux/mm_types.h>
+#include <linux/nodemask.h>
+#include <linux/sysfs.h>
+#include <linux/mutex.h>
+#include <linux/kref.h>
+#include <linux/rcupdate.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+
+#include "memdev_uapi.h"
+
+/* pages handed to user space are always zeroed, as anonymous memory is */
+#define PAGE_GFP_FLAGS	(GFP_KERNEL | __GFP_ZERO)
+
+enum prot_type {
+	PROT_CACHEABLE		= MEMDEV_PROT_CACHEABLE,
+	PROT_WRITECOMBINE	= MEMDEV_PROT_WRITECOMBINE,
+	PROT_UNCACHED		= MEMDEV_PROT_UNCACHED,
+	NR_PROT_TYPES,
+};
+
+struct file_state;
+struct seq_file;
+struct device;
+struct dma_buf;
+
+/* how a region is set up: the module parameters, overridden per file through ioctl */
+struct mmap_config {
+	enum prot_type prot;
+	/* the largest page order the region is allowed to be mapped with */
+	unsigned int order;
+	bool populate;
+	/* one physically contiguous range, allocated at mmap time (implies populate) */
+	bool contig;
+	/* nodes pages may be allocated from */
+	nodemask_t nodes;
+};
+
+/*
+ * Page placement of a region, derived from the mempolicy of the mapping task and the nodes allowed
+ * by the configuration.
+ *  - MPOL_DEFAULT, MPOL_LOCAL: the local node
+ *  - MPOL_PREFERRED(_MANY): the policy nodes first, any allowed node after
+ *  - MPOL_BIND: the policy nodes only
+ *  - MPOL_(WEIGHTED_)INTERLEAVE: chunks of INTERLEAVE_PAGES round-robin over the policy nodes,
+ *    each node taking as many consecutive chunks as its weight
+ */
+struct alloc_policy {
+	int mode;
+	/* allocations never leave these nodes */
+	nodemask_t allowed;
+	/* nodes tried first, empty if the local node is preferred */
+	nodemask_t preferred;
+	/* interleave: chunk c comes from il_nodes[c % il_len] */
+	int *il_nodes;
+	unsigned int il_len;
+};
+
+/*
+ * A region is backed by a page array with one entry per base page. A compound page of order N
+ * occupies 2^N consecutive entries (head followed by its tail pages), so the array can always be
+ * indexed by page offset regardless of how the region is backed.
+ *
+ * A region is reference counted: every VMA mapping (a part of) it holds a reference through
+ * vm_private_data, so it is found in O(1) from any VMA and freed when its last user goes away.
+ * An exported dma-buf holds one as well, so the pages outlive the mapping that created them.
+ *
+ * Demand-paged regions start with an all-NULL array. Entries are filled by the fault handlers
+ * under the region lock and published with smp_store_release(), so the fast path may read them
+ * with smp_load_acquire() without locking. An entry only changes back to NULL when no VMA maps
+ * its page any more (partial munmap of an unshared region).
+ *
+ * A region grows when mremap() extends one of its VMAs: the array is replaced under the region
+ * lock, published with rcu_assign_pointer() before the new npages, and the old one is freed
+ * after a grace period. Existing pages are kept.
+ *
+ * Contiguous regions are fully populated at mmap time with consecutive pages of a single
+ * allocation, and keep all of them until released: they are never trimmed and never grow.
+ */
+struct mapped_region {
+	pid_t pid;
+	/* address of the first page, follows mremap() */
+	unsigned long user_va;
+	/* file offset (in pages) of the first page, used to translate vmf->pgoff into an index */
+	unsigned long pgoff;
+	size_t size;
+	/* replaced by a growth under lock, lockless readers go through RCU */
+	struct page __rcu **pages;
+	unsigned long npages;
+	/* populated entries of the page array, updated under lock, read locklessly by debugfs */
+	unsigned long nr_resident;
+	struct mmap_config cfg;
+	struct alloc_policy policy;
+	/* serializes on-demand allocation, trimming and growth */
+	struct mutex lock;
+	struct kref ref;
+	/* the address space that created the region, only compared, never dereferenced */
+	struct mm_struct *mm;
+	/* the VMAs of mm mapping the region all lie in [map_start, map_end), which only grows */
+	unsigned long map_start;
+	unsigned long map_end;
+	/*
+	 * mapped by another address space (fork) or exported: VMAs of other processes may map any
+	 * page, so pages are only released with the region
+	 */
+	bool shared;
+	/* exports in progress: pages are kept as for shared regions, which they become on success */
+	unsigned int exporting;
+	/*
+	 * contiguous regions too large for the buddy allocator come from the DMA API (CMA) and go
+	 * back to it as a whole
+	 */
+	bool dma;
+	dma_addr_t dma_addr;
+	/* the file the region was mapped from, the region holds a reference to it */
+	struct file_state *state;
+	/* in state->regions, protected by state->lock */
+	struct list_head list;
+};
+
+/*
+ * The page array, for code that keeps it from being replaced: holders of region->lock, or the
+ * setup and release of the region (exclusive), when nobody else can reach it.
+ */
+static inline struct page **memdev_region_pages(struct mapped_region *region, bool exclusive)
+{
+	return rcu_dereference_protected(region->pages,
+					 exclusive || lockdep_is_held(&region->lock));
+}
+
+/* core.c: regions */
+int memdev_populate_region(struct mapped_region *region);
+void memdev_share_region(struct mapped_region *region);
+void memdev_begin_export(struct mapped_region *region);
+void memdev_end_export(struct mapped_region *region, bool exported);
+int memdev_mmap_region(struct mapped_region *region, struct vm_area_struct *vma);
+void memdev_put_region(struct mapped_region *region);
+void memdev_show_regions(struct seq_file *m);
+int memdev_set_pages_memtype(struct page **pages, unsigned long npages, enum prot_type prot);
+int memdev_set_range_memtype(struct page *page, unsigned long nr, enum prot_type prot);
+void memdev_reset_pages_memtype(struct page **pages, unsigned long npages, enum prot_type prot);
+
+/* pool.c: per-node pool of pre-zeroed order-0 pages */
+int memdev_pool_init(void);
+void memdev_pool_exit(void);
+unsigned long memdev_pool_alloc_bulk(int node, nodemask_t *nodemask, unsigned long nr,
+				     struct page **pages);
+void memdev_pool_free_pages(struct page **pages, unsigned long npages);
+
+extern const struct attribute_group memdev_pool_attr_group;
+
+/* stats.c: per-CPU statistics */
+enum memdev_stat_item {
+	MEMDEV_STAT_MMAPS,
+	MEMDEV_STAT_MMAP_FAILURES,
+	MEMDEV_STAT_FAULTS,
+	/* neighbours mapped along with a faulting page */
+	MEMDEV_STAT_FAULT_AROUND_PAGES,
+	MEMDEV_STAT_HUGE_FAULTS,
+	/* huge page allocations that failed, the range is backed by smaller pages */
+	MEMDEV_STAT_HUGE_FALLBACKS,
+	MEMDEV_STAT_BULK_ALLOCS,
+	/* bulk allocations returning fewer pages than requested, and the pages missing */
+	MEMDEV_STAT_BULK_SHORTFALLS,
+	MEMDEV_STAT_BULK_MISSING_PAGES,
+	/* pages released by partial munmap() */
+	MEMDEV_STAT_TRIMMED_PAGES,
+	NR_MEMDEV_STATS,
+};
+
+enum memdev_hist {
+	MEMDEV_HIST_MMAP,
+	MEMDEV_HIST_RELEASE,
+	NR_MEMDEV_HISTS,
+};
+
+/* bucket 0: below 1us, bucket b: [2^(b-1), 2^b) us, the last one is open-ended */
+#define MEMDEV_HIST_BUCKETS	24
+
+struct memdev_stats {
+	unsigned long items[NR_MEMDEV_STATS];
+	unsigned long hist[NR_MEMDEV_HISTS][MEMDEV_HIST_BUCKETS];
+};
+
+DECLARE_PER_CPU(struct memdev_stats, memdev_stats);
+
+static inline void memdev_stat_add(enum memdev_stat_item item, unsigned long nr)
+{
+	this_cpu_add(memdev_stats.items[item], nr);
+}
+
+static inline void memdev_stat_inc(enum memdev_stat_item item)
+{
+	this_cpu_inc(memdev_stats.items[item]);
+}
+
+int memdev_stats_init(void);
+void memdev_stats_exit(void);
+void memdev_stat_hist(enum memdev_hist hist, u64 ns);
+unsigned long memdev_stat_resident(struct page **pages, unsigned long npages,
+				   enum prot_type prot, bool add);
+
+extern const struct attribute_group memdev_stats_attr_group;
+extern const char * const memdev_prot_names[NR_PROT_TYPES];
+
+/*
+ * Start time of a phase reported by a memdev_trace.h event, 0 while the event is disabled so the
+ * fast paths do not read the clock for nothing.
+ */
+#define memdev_trace_start(event)	(trace_##event##_enabled() ? ktime_get_ns() : 0)
+
+static inline u64 memdev_trace_duration(u64 start)
+{
+	return start ? ktime_get_ns() - start : 0;
+}
+
+/* free.c: region teardown */
+int memdev_free_init(void);
+void memdev_free_exit(void);
+void memdev_release_pages(struct page **pages, unsigned long npages, enum prot_type prot,
+			  void (*done)(void *arg), void *arg);
+
+extern const struct attribute_group memdev_free_attr_group;
+
+/* contig.c: physically contiguous regions */
+void memdev_contig_init(struct device *dev);
+int memdev_alloc_contig(struct mapped_region *region, int node);
+void memdev_free_contig(struct mapped_region *region);
+
+/* dmabuf.c: sharing regions with other processes and devices */
+struct dma_buf *memdev_export_region(struct mapped_region *region, unsigned int flags);
+
+#endif
@@ -0,0 +1,205 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM memdev
+
+#if !defined(_MEMDEV_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _MEMDEV_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* events under /sys/kernel/tracing/events/memdev/, replacing the per-region log lines */
+
+TRACE_EVENT(memdev_mmap,
+	TP_PROTO(pid_t pid, unsigned long va, size_t size, int prot, unsigned int order, int mpol,
+		 bool populate, u64 duration_ns),
+	TP_ARGS(pid, va, size, prot, order, mpol, populate, duration_ns),
+
+	TP_STRUCT__entry(
+		__field(pid_t, pid)
+		__field(unsigned long, va)
+		__field(size_t, size)
+		__field(int, prot)
+		__field(unsigned int, order)
+		__field(int, mpol)
+		__field(bool, populate)
+		__field(u64, duration_ns)
+	),
+
+	TP_fast_assign(
+		__entry->pid = pid;
+		__entry->va = va;
+		__entry->size = size;
+		__entry->prot = prot;
+		__entry->order = order;
+		__entry->mpol = mpol;
+		__entry->populate = populate;
+		__entry->duration_ns = duration_ns;
+	),
+
+	TP_printk("pid=%d va=%#lx size=%#zx prot=%d order=%u mpol=%d populate=%d duration_ns=%llu",
+		  __entry->pid, __entry->va, __entry->size, __entry->prot, __entry->order,
+		  __entry->mpol, __entry->populate, __entry->duration_ns)
+);
+
+TRACE_EVENT(memdev_region_release,
+	TP_PROTO(pid_t pid, unsigned long va, size_t size, int prot),
+	TP_ARGS(pid, va, size, prot),
+
+	TP_STRUCT__entry(
+		__field(pid_t, pid)
+		__field(unsigned long, va)
+		__field(size_t, size)
+		__field(int, prot)
+	),
+
+	TP_fast_assign(
+		__entry->pid = pid;
+		__entry->va = va;
+		__entry->size = size;
+		__entry->prot = prot;
+	),
+
+	TP_printk("pid=%d va=%#lx size=%#zx prot=%d",
+		  __entry->pid, __entry->va, __entry->size, __entry->prot)
+);
+
+TRACE_EVENT(memdev_export,
+	TP_PROTO(pid_t pid, unsigned long va, size_t size, int fd),
+	TP_ARGS(pid, va, size, fd),
+
+	TP_STRUCT__entry(
+		__field(pid_t, pid)
+		__field(unsigned long, va)
+		__field(size_t, size)
+		__field(int, fd)
+	),
+
+	TP_fast_assign(
+		__entry->pid = pid;
+		__entry->va = va;
+		__entry->size = size;
+		__entry->fd = fd;
+	),
+
+	TP_printk("pid=%d va=%#lx size=%#zx fd=%d",
+		  __entry->pid, __entry->va, __entry->size, __entry->fd)
+);
+
+/*
+ * Phases of a region's life, for latency breakdowns (see test/trace_breakdown.sh). Durations are
+ * in nanoseconds, sizes in base pages; nodes are those the pages were asked from (alloc) or the
+ * node of the first page (free).
+ */
+
+TRACE_EVENT(memdev_alloc,
+	TP_PROTO(int node, unsigned int order, unsigned long nr, unsigned long nr_allocated, int prot,
+		 u64 duration_ns),
+	TP_ARGS(node, order, nr, nr_allocated, prot, duration_ns),
+
+	TP_STRUCT__entry(
+		__field(int, node)
+		__field(unsigned int, order)
+		__field(unsigned long, nr)
+		__field(unsigned long, nr_allocated)
+		__field(int, prot)
+		__field(u64, duration_ns)
+	),
+
+	TP_fast_assign(
+		__entry->node = node;
+		__entry->order = order;
+		__entry->nr = nr;
+		__entry->nr_allocated = nr_allocated;
+		__entry->prot = prot;
+		__entry->duration_ns = duration_ns;
+	),
+
+	TP_printk("node=%d order=%u nr=%lu nr_allocated=%lu prot=%d duration_ns=%llu",
+		  __entry->node, __entry->order, __entry->nr, __entry->nr_allocated, __entry->prot,
+		  __entry->duration_ns)
+);
+
+TRACE_EVENT(memdev_insert,
+	TP_PROTO(unsigned long va, unsigned long nr, unsigned long nr_inserted, int prot,
+		 u64 duration_ns),
+	TP_ARGS(va, nr, nr_inserted, prot, duration_ns),
+
+	TP_STRUCT__entry(
+		__field(unsigned long, va)
+		__field(unsigned long, nr)
+		__field(unsigned long, nr_inserted)
+		__field(int, prot)
+		__field(u64, duration_ns)
+	),
+
+	TP_fast_assign(
+		__entry->va = va;
+		__entry->nr = nr;
+		__entry->nr_inserted = nr_inserted;
+		__entry->prot = prot;
+		__entry->duration_ns = duration_ns;
+	),
+
+	TP_printk("va=%#lx nr=%lu nr_inserted=%lu prot=%d duration_ns=%llu",
+		  __entry->va, __entry->nr, __entry->nr_inserted, __entry->prot,
+		  __entry->duration_ns)
+);
+
+TRACE_EVENT(memdev_vma_close,
+	TP_PROTO(unsigned long start, unsigned long nr, int prot, bool last, u64 duration_ns),
+	TP_ARGS(start, nr, prot, last, duration_ns),
+
+	TP_STRUCT__entry(
+		__field(unsigned long, start)
+		__field(unsigned long, nr)
+		__field(int, prot)
+		__field(bool, last)
+		__field(u64, duration_ns)
+	),
+
+	TP_fast_assign(
+		__entry->start = start;
+		__entry->nr = nr;
+		__entry->prot = prot;
+		__entry->last = last;
+		__entry->duration_ns = duration_ns;
+	),
+
+	TP_printk("start=%#lx nr=%lu prot=%d last=%d duration_ns=%llu",
+		  __entry->start, __entry->nr, __entry->prot, __entry->last, __entry->duration_ns)
+);
+
+TRACE_EVENT(memdev_free,
+	TP_PROTO(int node, unsigned long nr, unsigned long nr_freed, int prot, bool async,
+		 u64 duration_ns),
+	TP_ARGS(node, nr, nr_freed, prot, async, duration_ns),
+
+	TP_STRUCT__entry(
+		__field(int, node)
+		__field(unsigned long, nr)
+		__field(unsigned long, nr_freed)
+		__field(int, prot)
+		__field(bool, async)
+		__field(u64, duration_ns)
+	),
+
+	TP_fast_assign(
+		__entry->node = node;
+		__entry->nr = nr;
+		__entry->nr_freed = nr_freed;
+		__entry->prot = prot;
+		__entry->async = async;
+		__entry->duration_ns = duration_ns;
+	),
+
+	TP_printk("node=%d nr=%lu nr_freed=%lu prot=%d async=%d duration_ns=%llu",
+		  __entry->node, __entry->nr, __entry->nr_freed, __entry->prot, __entry->async,
+		  __entry->duration_ns)
+);
+
+#endif /* _MEMDEV_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE memdev_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,141 @@
+#ifndef MEMDEV_UAPI_H
+#define MEMDEV_UAPI_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define MEMDEV_IOC_MAGIC	'M'
+
+/* nodemask size of the ioctl interface, in 64-bit words (1024 nodes) */
+#define MEMDEV_NODEMASK_WORDS	16
+#define MEMDEV_MAX_NODES	(MEMDEV_NODEMASK_WORDS * 64)
+
+/* cache attribute of a mapping */
+enum memdev_prot {
+	MEMDEV_PROT_CACHEABLE		= 0,	/* normal_cacheable */
+	MEMDEV_PROT_WRITECOMBINE	= 1,	/* normal_noncacheable */
+	MEMDEV_PROT_UNCACHED		= 2,	/* device_noncacheable */
+};
+
+/* largest leaf size used for the aligned part of a mapping */
+enum memdev_page_size {
+	MEMDEV_PAGE_BASE	= 0,	/* PAGE_SIZE */
+	MEMDEV_PAGE_PMD		= 1,	/* 2M on x86_64 with 4K pages */
+	MEMDEV_PAGE_PUD		= 2,	/* 1G on x86_64 with 4K pages, falls back to PMD */
+};
+
+/* when pages are allocated */
+enum memdev_populate {
+	MEMDEV_POPULATE_LAZY	= 0,	/* on first touch */
+	MEMDEV_POPULATE_EAGER	= 1,	/* at mmap time */
+	MEMDEV_POPULATE_CONTIG	= 2,	/* at mmap time, as one physically contiguous range */
+};
+
+/* memdev_mmap_params.valid: fields to apply, the others keep their current value */
+#define MEMDEV_PARAM_PROT	(1U << 0)
+#define MEMDEV_PARAM_PAGE_SIZE	(1U << 1)
+#define MEMDEV_PARAM_POPULATE	(1U << 2)
+#define MEMDEV_PARAM_NODEMASK	(1U << 3)
+#define MEMDEV_PARAM_WEIGHTS	(1U << 4)
+#define MEMDEV_PARAM_ALL	(MEMDEV_PARAM_PROT | MEMDEV_PARAM_PAGE_SIZE |		\
+				 MEMDEV_PARAM_POPULATE | MEMDEV_PARAM_NODEMASK |	\
+				 MEMDEV_PARAM_WEIGHTS)
+
+/*
+ * Parameters of the following mmap() calls on a file descriptor. A new descriptor starts with the
+ * module parameters and all memory nodes.
+ *
+ * Page placement follows the mempolicy of the mapping task (set_mempolicy(2), numactl), restricted
+ * to the allowed nodes. Interleaving policies distribute 2M chunks.
+ */
+struct memdev_mmap_params {
+	__u32 valid;
+	__u32 prot;		/* enum memdev_prot */
+	__u32 page_size;	/* enum memdev_page_size */
+	__u32 populate;		/* enum memdev_populate */
+	/* allowed nodes; the local node is used if allowed, the first allowed node otherwise */
+	__u64 nodemask[MEMDEV_NODEMASK_WORDS];
+	/*
+	 * per-node weights under MPOL_WEIGHTED_INTERLEAVE, 0 stands for 1. The system-wide weights
+	 * (/sys/kernel/mm/mempolicy/weighted_interleave) are not visible to modules.
+	 */
+	__u8 weights[MEMDEV_MAX_NODES];
+} __attribute__((aligned(8)));
+
+/* a physically contiguous run of pages of a mapping */
+struct memdev_extent {
+	__u64 offset;		/* from the start of the mapping, in bytes */
+	__u64 pa;		/* 0 without CAP_SYS_ADMIN, as in /proc/$PID/pagemap */
+	__u64 size;
+	__u32 node;
+	__u32 order;		/* order of the pages backing the run */
+} __attribute__((aligned(8)));
+
+struct memdev_query {
+	/* filled by user */
+	__u64 va;		/* any address inside the mapping */
+	__u64 extents;		/* user pointer to an array of struct memdev_extent */
+	__u64 node_pages;	/* user pointer to an array of __u64, or 0 */
+	__u32 max_extents;	/* capacity of extents */
+	__u32 max_nodes;	/* capacity of node_pages */
+
+	/* filled by kernel module */
+	__u32 nr_extents;	/* total number of extents, may exceed max_extents */
+	__u32 mempolicy;	/* MPOL_* mode the pages are placed with */
+	__u64 start;		/* address the first page of the mapping is mapped at */
+	__u64 size;
+	__u64 resident;		/* bytes already allocated */
+	__u32 prot;
+	__u32 page_size;
+	__u32 populate;
+	__u32 pad;
+	/* MEMDEV_POPULATE_CONTIG: physical address of the first page, 0 without CAP_SYS_ADMIN */
+	__u64 pa;
+} __attribute__((aligned(8)));
+
+/*
+ * Export the pages of a mapping as a dma-buf. Missing pages are allocated first. The descriptor
+ * can be passed to other processes (e.g. SCM_RIGHTS over a UNIX socket) and mmap()ed there with
+ * the cache attribute of the mapping, or attached by device drivers. The pages stay allocated
+ * until both the mapping and the last dma-buf reference are gone.
+ */
+struct memdev_export {
+	__u64 va;		/* any address inside the mapping */
+	__u32 flags;		/* O_RDONLY or O_RDWR, optionally O_CLOEXEC */
+	__s32 fd;		/* filled by kernel module */
+} __attribute__((aligned(8)));
+
+/* memdev_prefault.flags */
+#define MEMDEV_PREFAULT_WRITE	(1U << 0)	/* fault for write */
+#define MEMDEV_PREFAULT_LOCK	(1U << 1)	/* lock the mappings, as mlock() */
+#define MEMDEV_PREFAULT_ALL	(MEMDEV_PREFAULT_WRITE | MEMDEV_PREFAULT_LOCK)
+
+/*
+ * Allocate the missing pages of an address range and install all of its page table entries, so
+ * that no access to it faults afterwards. The range is rounded out to pages and must be covered by
+ * memdev mappings of the calling process.
+ *
+ * memdev pages are never reclaimed, swapped or migrated. MEMDEV_PREFAULT_LOCK additionally marks
+ * the mappings containing the range VM_LOCKED, charged against RLIMIT_MEMLOCK: page tables are
+ * then kept too (MADV_DONTNEED is refused) until munmap().
+ */
+struct memdev_prefault {
+	/* filled by user */
+	__u64 va;
+	__u64 size;
+	__u32 flags;		/* MEMDEV_PREFAULT_* */
+	__u32 pad;
+
+	/* filled by kernel module, also when interrupted */
+	__u64 resident;		/* bytes of the range backed by pages, size once fully resident */
+	__u64 duration_ns;
+} __attribute__((aligned(8)));
+
+#define MEMDEV_IOC_SET_MMAP_PARAMS	_IOW(MEMDEV_IOC_MAGIC, 0, struct memdev_mmap_params)
+#define MEMDEV_IOC_GET_MMAP_PARAMS	_IOR(MEMDEV_IOC_MAGIC, 1, struct memdev_mmap_params)
+/* also fills node_pages[node]: allocated pages of the mapping per node */
+#define MEMDEV_IOC_QUERY		_IOWR(MEMDEV_IOC_MAGIC, 2, struct memdev_query)
+#define MEMDEV_IOC_EXPORT		_IOWR(MEMDEV_IOC_MAGIC, 3, struct memdev_export)
+#define MEMDEV_IOC_PREFAULT		_IOWR(MEMDEV_IOC_MAGIC, 4, struct memdev_prefault)
+
+#endif
@@ -0,0 +1,392 @@
+/*
+ * Per-node pool of pre-zeroed order-0 pages.
+ *
+ * Pages released by unmapped regions are parked on the dirty list of their node instead of going
+ * back to the buddy allocator. A work item running on that node zeroes them and moves them to the
+ * clean list, which the allocation paths drain before asking the buddy allocator for more.
+ *
+ * The pool of each node is capped by pool_high_pages; pages beyond the cap are released right
+ * away, and a NUMA-aware shrinker gives pooled pages back under memory pressure.
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/list.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/shrinker.h>
+#include <linux/nodemask.h>
+#include <linux/device.h>
+#include <linux/atomic.h>
+
+#include "memdev.h"
+
+/* pages moved per lock hold, bounding both lock hold time and the latency between reschedules */
+#define POOL_BATCH	256
+
+/* pages handed to release_pages() at once */
+#define FREE_BATCH	64
+
+struct memdev_pool {
+	spinlock_t lock;
+	/* pages are linked through page->lru: pool pages are never on an LRU list */
+	struct list_head clean;
+	struct list_head dirty;
+	unsigned long nr_clean;
+	unsigned long nr_dirty;
+	struct work_struct zero_work;
+	int node;
+
+	atomic_long_t hits;
+	atomic_long_t misses;
+};
+
+static unsigned long pool_high_pages = 65536;
+module_param(pool_high_pages, ulong, 0644);
+MODULE_PARM_DESC(pool_high_pages, "Maximum number of pooled pages per node, 0 disables the pool");
+
+static struct memdev_pool *pools;
+static struct shrinker *pool_shrinker;
+
+static struct page *pool_take_locked(struct memdev_pool *pool)
+{
+	struct page *page;
+
+	page = list_first_entry_or_null(&pool->clean, struct page, lru);
+	if (page) {
+		list_del(&page->lru);
+		pool->nr_clean--;
+	}
+	return page;
+}
+
+/*
+ * Same contract as alloc_pages_bulk_array_node(): fill the NULL entries of pages[0, nr) and
+ * return the number of populated entries. Pooled pages of the preferred node are used first, the
+ * buddy allocator may fall back to the other nodes of the nodemask.
+ */
+unsigned long memdev_pool_alloc_bulk(int node, nodemask_t *nodemask, unsigned long nr,
+				     struct page **pages)
+{
+	struct memdev_pool *pool = &pools[node];
+	unsigned long i, nr_filled = 0, nr_hits = 0, nr_batch = 0, nr_populated;
+	struct page *page;
+	bool locked = false;
+
+	for (i = 0; i < nr; i++) {
+		if (pages[i]) {
+			nr_filled++;
+			continue;
+		}
+		if (!locked) {
+			if (!READ_ONCE(pool->nr_clean))
+				continue;
+			spin_lock(&pool->lock);
+			locked = true;
+		}
+
+		page = pool_take_locked(pool);
+		if (!page) {
+			spin_unlock(&pool->lock);
+			locked = false;
+			continue;
+		}
+		pages[i] = page;
+		nr_filled++;
+		nr_hits++;
+
+		if (++nr_batch >= POOL_BATCH) {
+			spin_unlock(&pool->lock);
+			locked = false;
+			nr_batch = 0;
+			cond_resched();
+		}
+	}
+	if (locked)
+		spin_unlock(&pool->lock);
+
+	nr_populated = nr_filled;
+	if (nr_filled < nr)
+		nr_populated = __alloc_pages_bulk(PAGE_GFP_FLAGS, node, nodemask, nr, NULL, pages);
+
+	atomic_long_add(nr_hits, &pool->hits);
+	atomic_long_add(nr_populated - nr_filled, &pool->misses);
+	memdev_stat_inc(MEMDEV_STAT_BULK_ALLOCS);
+	if (nr_populated < nr) {
+		memdev_stat_inc(MEMDEV_STAT_BULK_SHORTFALLS);
+		memdev_stat_add(MEMDEV_STAT_BULK_MISSING_PAGES, nr - nr_populated);
+	}
+	return nr_populated;
+}
+
+/* park a page on the dirty list of its node, false if the pool cannot take it */
+static bool pool_put_locked(struct memdev_pool *pool, struct page *page)
+{
+	/* someone else (e.g. a pinned GUP reference) still holds the page */
+	if (page_ref_count(page) != 1)
+		return false;
+	if (pool->nr_clean + pool->nr_dirty >= READ_ONCE(pool_high_pages))
+		return false;
+
+	list_add(&page->lru, &pool->dirty);
+	pool->nr_dirty++;
+	return true;
+}
+
+/* drop the references of a batch of order-0 pages, freeing them in one go */
+static void release_batch(struct page **batch, unsigned int *nr)
+{
+	if (*nr) {
+		release_pages(batch, *nr);
+		*nr = 0;
+	}
+}
+
+/*
+ * Release every allocated page of a page array. Order-0 pages go to the pool of their node, those
+ * it cannot take are released in batches with release_pages(), outside of the pool lock.
+ * Compound pages are released to the buddy allocator as a whole.
+ */
+void memdev_pool_free_pages(struct page **pages, unsigned long npages)
+{
+	struct memdev_pool *pool = NULL;
+	nodemask_t dirty_nodes = NODE_MASK_NONE;
+	struct page *batch[FREE_BATCH];
+	unsigned int nr_free = 0;
+	unsigned long i = 0, nr_batch = 0;
+	unsigned int order;
+	struct page *page;
+	int node;
+
+	while (i < npages) {
+		page = pages[i];
+		if (!page) {
+			i++;
+			continue;
+		}
+
+		order = compound_order(page);
+		i += 1UL << order;
+		if (order) {
+			/* may sleep, and has nothing to do with the pool */
+			if (pool) {
+				spin_unlock(&pool->lock);
+				pool = NULL;
+			}
+			__free_pages(page, order);
+			cond_resched();
+			continue;
+		}
+
+		node = page_to_nid(page);
+		if (!pool || pool->node != node || nr_batch >= POOL_BATCH) {
+			if (pool)
+				spin_unlock(&pool->lock);
+			if (nr_batch >= POOL_BATCH) {
+				nr_batch = 0;
+				release_batch(batch, &nr_free);
+				cond_resched();
+			}
+			pool = &pools[node];
+			spin_lock(&pool->lock);
+		}
+		nr_batch++;
+
+		if (pool_put_locked(pool, page))
+			node_set(node, dirty_nodes);
+		else
+			batch[nr_free++] = page;
+
+		if (nr_free == FREE_BATCH) {
+			spin_unlock(&pool->lock);
+			pool = NULL;
+			release_batch(batch, &nr_free);
+		}
+	}
+	if (pool)
+		spin_unlock(&pool->lock);
+	release_batch(batch, &nr_free);
+
+	for_each_node_mask(node, dirty_nodes)
+		queue_work_node(node, system_unbound_wq, &pools[node].zero_work);
+}
+
+/* release up to nr pooled pages of a node, dirty ones first, returns the number released */
+static unsigned long pool_release(struct memdev_pool *pool, unsigned long nr)
+{
+	struct page *batch[FREE_BATCH];
+	unsigned long nr_released = 0;
+	unsigned int nr_free;
+	struct page *page;
+
+	while (nr_released < nr) {
+		nr_free = 0;
+		spin_lock(&pool->lock);
+		while (nr_released < nr && nr_free < FREE_BATCH && pool->nr_dirty) {
+			page = list_first_entry(&pool->dirty, struct page, lru);
+			list_del(&page->lru);
+			pool->nr_dirty--;
+			batch[nr_free++] = page;
+			nr_released++;
+		}
+		while (nr_released < nr && nr_free < FREE_BATCH && (page = pool_take_locked(pool))) {
+			batch[nr_free++] = page;
+			nr_released++;
+		}
+		spin_unlock(&pool->lock);
+
+		if (!nr_free)
+			break;
+		release_batch(batch, &nr_free);
+		cond_resched();
+	}
+	return nr_released;
+}
+
+static void pool_zero_work(struct work_struct *work)
+{
+	struct memdev_pool *pool = container_of(work, struct memdev_pool, zero_work);
+	unsigned long nr, nr_pooled, high;
+	LIST_HEAD(batch);
+	struct page *page;
+
+	for (;;) {
+		spin_lock(&pool->lock);
+		for (nr = 0; nr < POOL_BATCH && pool->nr_dirty; nr++) {
+			page = list_first_entry(&pool->dirty, struct page, lru);
+			list_move(&page->lru, &batch);
+			pool->nr_dirty--;
+		}
+		spin_unlock(&pool->lock);
+		if (!nr)
+			break;
+
+		list_for_each_entry(page, &batch, lru)
+			clear_highpage(page);
+
+		spin_lock(&pool->lock);
+		list_splice_init(&batch, &pool->clean);
+		pool->nr_clean += nr;
+		spin_unlock(&pool->lock);
+		cond_resched();
+	}
+
+	/* the high watermark may have been lowered at runtime */
+	high = READ_ONCE(pool_high_pages);
+	nr_pooled = READ_ONCE(pool->nr_clean) + READ_ONCE(pool->nr_dirty);
+	if (nr_pooled > high)
+		pool_release(pool, nr_pooled - high);
+}
+
+static unsigned long pool_shrink_count(struct shrinker *shrinker, struct shrink_control *sc)
+{
+	struct memdev_pool *pool = &pools[sc->nid];
+	unsigned long nr = READ_ONCE(pool->nr_clean) + READ_ONCE(pool->nr_dirty);
+
+	return nr ? nr : SHRINK_EMPTY;
+}
+
+static unsigned long pool_shrink_scan(struct shrinker *shrinker, struct shrink_control *sc)
+{
+	unsigned long nr_released = pool_release(&pools[sc->nid], sc->nr_to_scan);
+
+	return nr_released ? nr_released : SHRINK_STOP;
+}
+
+/* sysfs counters under /sys/class/memdev/memdev/pool/, summed over all nodes */
+#define POOL_SUM_SHOW(name, expr)							\
+static ssize_t name##_show(struct device *dev, struct device_attribute *attr,		\
+			   char *buf)							\
+{											\
+	unsigned long sum = 0;								\
+	int node;									\
+											\
+	for_each_node(node) {								\
+		struct memdev_pool *pool = &pools[node];				\
+		sum += (expr);								\
+	}										\
+	return sysfs_emit(buf, "%lu\n", sum);						\
+}											\
+static DEVICE_ATTR_RO(name)
+
+POOL_SUM_SHOW(clean_pages, READ_ONCE(pool->nr_clean));
+POOL_SUM_SHOW(dirty_pages, READ_ONCE(pool->nr_dirty));
+POOL_SUM_SHOW(hits, atomic_long_read(&pool->hits));
+POOL_SUM_SHOW(misses, atomic_long_read(&pool->misses));
+
+static ssize_t hit_rate_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	unsigned long hits = 0, misses = 0;
+	int node;
+
+	for_each_node(node) {
+		hits += atomic_long_read(&pools[node].hits);
+		misses += atomic_long_read(&pools[node].misses);
+	}
+	/* percentage */
+	return sysfs_emit(buf, "%lu\n", hits + misses ? hits * 100 / (hits + misses) : 0);
+}
+static DEVICE_ATTR_RO(hit_rate);
+
+static struct attribute *pool_attrs[] = {
+	&dev_attr_clean_pages.attr,
+	&dev_attr_dirty_pages.attr,
+	&dev_attr_hits.attr,
+	&dev_attr_misses.attr,
+	&dev_attr_hit_rate.attr,
+	NULL,
+};
+
+const struct attribute_group memdev_pool_attr_group = {
+	.name = "pool",
+	.attrs = pool_attrs,
+};
+
+int memdev_pool_init(void)
+{
+	struct memdev_pool *pool;
+	int node;
+
+	pools = kcalloc(nr_node_ids, sizeof(*pools), GFP_KERNEL);
+	if (!pools)
+		return -ENOMEM;
+
+	for_each_node(node) {
+		pool = &pools[node];
+		spin_lock_init(&pool->lock);
+		INIT_LIST_HEAD(&pool->clean);
+		INIT_LIST_HEAD(&pool->dirty);
+		INIT_WORK(&pool->zero_work, pool_zero_work);
+		pool->node = node;
+	}
+
+	pool_shrinker = shrinker_alloc(SHRINKER_NUMA_AWARE, "memdev-pool");
+	if (!pool_shrinker) {
+		kfree(pools);
+		return -ENOMEM;
+	}
+	pool_shrinker->count_objects = pool_shrink_count;
+	pool_shrinker->scan_objects = pool_shrink_scan;
+	shrinker_register(pool_shrinker);
+
+	return 0;
+}
+
+void memdev_pool_exit(void)
+{
+	struct memdev_pool *pool;
+	int node;
+
+	shrinker_free(pool_shrinker);
+	for_each_node(node) {
+		pool = &pools[node];
+		cancel_work_sync(&pool->zero_work);
+		pool_release(pool, ULONG_MAX);
+	}
+	kfree(pools);
+}
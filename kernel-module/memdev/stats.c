@@ -0,0 +1,209 @@
+/*
+ * Per-CPU statistics.
+ *
+ * Event counters live in a static per-CPU structure updated with this_cpu ops, resident bytes per
+ * (node, prot) in a dynamically sized per-CPU array; readers sum over the possible CPUs.
+ *
+ * Scalar counters are exported in /sys/class/memdev/memdev/stats/, the tables (resident bytes,
+ * latency histograms, regions) in /sys/kernel/debug/memdev/.
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include <linux/log2.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/device.h>
+
+#include "memdev.h"
+
+DEFINE_PER_CPU(struct memdev_stats, memdev_stats);
+
+/* [node * NR_PROT_TYPES + prot] */
+static long __percpu *resident_bytes;
+
+static struct dentry *debugfs_dir;
+
+const char * const memdev_prot_names[NR_PROT_TYPES] = {
+	[PROT_CACHEABLE]	= "normal_cacheable",
+	[PROT_WRITECOMBINE]	= "normal_noncacheable",
+	[PROT_UNCACHED]		= "device_noncacheable",
+};
+
+static const char * const hist_names[NR_MEMDEV_HISTS] = {
+	[MEMDEV_HIST_MMAP]	= "mmap",
+	[MEMDEV_HIST_RELEASE]	= "release",
+};
+
+void memdev_stat_hist(enum memdev_hist hist, u64 ns)
+{
+	u64 us = div_u64(ns, NSEC_PER_USEC);
+	unsigned int bucket = us ? min_t(unsigned int, ilog2(us) + 1, MEMDEV_HIST_BUCKETS - 1) : 0;
+
+	this_cpu_inc(memdev_stats.hist[hist][bucket]);
+}
+
+/*
+ * Add (or subtract) the pages of a page array to the resident bytes of their nodes, returns the
+ * number of pages. Compound pages are accounted from their head entry.
+ */
+unsigned long memdev_stat_resident(struct page **pages, unsigned long npages,
+				   enum prot_type prot, bool add)
+{
+	unsigned long i = 0, nr = 0, n;
+	struct page *page;
+
+	while (i < npages) {
+		page = pages[i];
+		if (!page) {
+			i++;
+			continue;
+		}
+		n = PageTail(page) ? 1 : 1UL << compound_order(page);
+		n = min(n, npages - i);
+		this_cpu_add(resident_bytes[page_to_nid(page) * NR_PROT_TYPES + prot],
+			     add ? (long)(n << PAGE_SHIFT) : -(long)(n << PAGE_SHIFT));
+		nr += n;
+		i += n;
+	}
+	return nr;
+}
+
+static unsigned long sum_item(enum memdev_stat_item item)
+{
+	unsigned long sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += per_cpu(memdev_stats.items[item], cpu);
+	return sum;
+}
+
+#define STAT_SHOW(name, item)								\
+static ssize_t name##_show(struct device *dev, struct device_attribute *attr,		\
+			   char *buf)							\
+{											\
+	return sysfs_emit(buf, "%lu\n", sum_item(item));				\
+}											\
+static DEVICE_ATTR_RO(name)
+
+STAT_SHOW(mmaps, MEMDEV_STAT_MMAPS);
+STAT_SHOW(mmap_failures, MEMDEV_STAT_MMAP_FAILURES);
+STAT_SHOW(faults, MEMDEV_STAT_FAULTS);
+STAT_SHOW(fault_around_pages, MEMDEV_STAT_FAULT_AROUND_PAGES);
+STAT_SHOW(huge_faults, MEMDEV_STAT_HUGE_FAULTS);
+STAT_SHOW(huge_fallbacks, MEMDEV_STAT_HUGE_FALLBACKS);
+STAT_SHOW(bulk_allocs, MEMDEV_STAT_BULK_ALLOCS);
+STAT_SHOW(bulk_shortfalls, MEMDEV_STAT_BULK_SHORTFALLS);
+STAT_SHOW(bulk_missing_pages, MEMDEV_STAT_BULK_MISSING_PAGES);
+STAT_SHOW(trimmed_pages, MEMDEV_STAT_TRIMMED_PAGES);
+
+static struct attribute *stats_attrs[] = {
+	&dev_attr_mmaps.attr,
+	&dev_attr_mmap_failures.attr,
+	&dev_attr_faults.attr,
+	&dev_attr_fault_around_pages.attr,
+	&dev_attr_huge_faults.attr,
+	&dev_attr_huge_fallbacks.attr,
+	&dev_attr_bulk_allocs.attr,
+	&dev_attr_bulk_shortfalls.attr,
+	&dev_attr_bulk_missing_pages.attr,
+	&dev_attr_trimmed_pages.attr,
+	NULL,
+};
+
+const struct attribute_group memdev_stats_attr_group = {
+	.name = "stats",
+	.attrs = stats_attrs,
+};
+
+static int resident_show(struct seq_file *m, void *v)
+{
+	long bytes[NR_PROT_TYPES];
+	int node, prot, cpu;
+
+	seq_printf(m, "%-6s", "node");
+	for (prot = 0; prot < NR_PROT_TYPES; prot++)
+		seq_printf(m, " %20s", memdev_prot_names[prot]);
+	seq_putc(m, '\n');
+
+	for_each_node_state(node, N_MEMORY) {
+		memset(bytes, 0, sizeof(bytes));
+		for_each_possible_cpu(cpu) {
+			for (prot = 0; prot < NR_PROT_TYPES; prot++)
+				bytes[prot] += *per_cpu_ptr(&resident_bytes[node * NR_PROT_TYPES + prot],
+							    cpu);
+		}
+		seq_printf(m, "%-6d", node);
+		for (prot = 0; prot < NR_PROT_TYPES; prot++)
+			seq_printf(m, " %20ld", bytes[prot]);
+		seq_putc(m, '\n');
+	}
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(resident);
+
+/* one line per bucket: [lower, upper) bound in microseconds, then the count per histogram */
+static int latency_show(struct seq_file *m, void *v)
+{
+	unsigned long count[NR_MEMDEV_HISTS];
+	unsigned int bucket, hist;
+	int cpu;
+
+	seq_printf(m, "%-10s %-10s", "us_from", "us_to");
+	for (hist = 0; hist < NR_MEMDEV_HISTS; hist++)
+		seq_printf(m, " %12s", hist_names[hist]);
+	seq_putc(m, '\n');
+
+	for (bucket = 0; bucket < MEMDEV_HIST_BUCKETS; bucket++) {
+		memset(count, 0, sizeof(count));
+		for_each_possible_cpu(cpu) {
+			for (hist = 0; hist < NR_MEMDEV_HISTS; hist++)
+				count[hist] += per_cpu(memdev_stats.hist[hist][bucket], cpu);
+		}
+
+		seq_printf(m, "%-10lu ", bucket ? 1UL << (bucket - 1) : 0);
+		if (bucket == MEMDEV_HIST_BUCKETS - 1)
+			seq_printf(m, "%-10s", "inf");
+		else
+			seq_printf(m, "%-10lu", 1UL << bucket);
+		for (hist = 0; hist < NR_MEMDEV_HISTS; hist++)
+			seq_printf(m, " %12lu", count[hist]);
+		seq_putc(m, '\n');
+	}
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(latency);
+
+static int regions_show(struct seq_file *m, void *v)
+{
+	memdev_show_regions(m);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(regions);
+
+int memdev_stats_init(void)
+{
+	resident_bytes = __alloc_percpu(nr_node_ids * NR_PROT_TYPES * sizeof(long),
+					__alignof__(long));
+	if (!resident_bytes)
+		return -ENOMEM;
+
+	/* debugfs is optional, failures are not fatal */
+	debugfs_dir = debugfs_create_dir(KBUILD_MODNAME, NULL);
+	debugfs_create_file("resident", 0444, debugfs_dir, NULL, &resident_fops);
+	debugfs_create_file("latency", 0444, debugfs_dir, NULL, &latency_fops);
+	debugfs_create_file("regions", 0444, debugfs_dir, NULL, &regions_fops);
+	return 0;
+}
+
+void memdev_stats_exit(void)
+{
+	debugfs_remove_recursive(debugfs_dir);
+	free_percpu(resident_bytes);
+}
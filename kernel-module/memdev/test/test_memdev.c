@@ -1,16 +1,491 @@
+/*
+ * Memory bandwidth and latency benchmark for memdev mappings.
+ *
+ * Bandwidth: STREAM kernels (copy, scale, add, triad) run by pinned threads, each on its own
+ * slice of the three arrays. Every kernel exists as plain C and, on x86_64, with SSE2/AVX2/AVX-512
+ * non-temporal stores, selected at runtime according to the CPU features.
+ *
+ * Latency: a dependent pointer chase through a random cyclic permutation of cache lines (Sattolo's
+ * algorithm), so neither the hardware prefetchers nor out-of-order execution can overlap loads.
+ * The working set is swept from 16 KB up to the mapping size.
+ *
+ * Timing uses CLOCK_MONOTONIC_RAW, or the TSC calibrated against it (-T).
+ */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
 #include <sys/mman.h>
-#include <sys/time.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
 #include <errno.h>
 
+#if defined(__x86_64__)
+#include <immintrin.h>
+#include <x86intrin.h>
+#endif
+
+#include "../memdev_uapi.h"
+
 #define DEVICE_PATH     "/dev/memdev"
 #define PARAM_PATH      "/sys/module/memdev/parameters/attr"
 #define PAGE_SIZE       4096
+#define CACHE_LINE      64
+
+#define MAX_THREADS     256
+#define LATENCY_BATCH   4096    /* dependent loads per latency sample */
+#define LATENCY_MIN_WS  (16 * 1024)
+
+/* ---------------------------------------------------------------- timing */
+
+static int use_tsc;
+static double tsc_ns_per_tick;
+
+static inline uint64_t raw_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t now_ticks(void)
+{
+#if defined(__x86_64__)
+    if (use_tsc) {
+        unsigned int aux;
+
+        return __rdtscp(&aux);
+    }
+#endif
+    return raw_ns();
+}
+
+static inline double ticks_to_ns(uint64_t ticks)
+{
+    return use_tsc ? ticks * tsc_ns_per_tick : (double)ticks;
+}
+
+static int calibrate_tsc(void)
+{
+#if defined(__x86_64__)
+    struct timespec delay = { .tv_sec = 0, .tv_nsec = 200 * 1000 * 1000 };
+    unsigned int aux;
+    uint64_t ns0, ns1, tsc0, tsc1;
+
+    ns0 = raw_ns();
+    tsc0 = __rdtscp(&aux);
+    nanosleep(&delay, NULL);
+    ns1 = raw_ns();
+    tsc1 = __rdtscp(&aux);
+
+    tsc_ns_per_tick = (double)(ns1 - ns0) / (tsc1 - tsc0);
+    use_tsc = 1;
+    return 0;
+#else
+    fprintf(stderr, "Error: TSC timing is only available on x86_64\n");
+    return -1;
+#endif
+}
+
+/* ---------------------------------------------------------------- statistics */
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* nearest-rank percentile of a sorted array */
+static double percentile(const double *sorted, size_t n, double pct)
+{
+    size_t rank = (size_t)(pct / 100.0 * n + 0.5);
+
+    if (rank < 1)
+        rank = 1;
+    if (rank > n)
+        rank = n;
+    return sorted[rank - 1];
+}
+
+/* ---------------------------------------------------------------- STREAM kernels */
+
+enum stream_op { OP_COPY, OP_SCALE, OP_ADD, OP_TRIAD, NR_OPS };
+
+static const char *op_names[NR_OPS] = { "copy", "scale", "add", "triad" };
+/* arrays touched per element, STREAM convention (write-allocate traffic not counted) */
+static const int op_arrays[NR_OPS] = { 2, 2, 3, 3 };
+
+typedef void (*stream_fn)(double *a, double *b, double *c, size_t n, double s);
+
+#define SCALAR 3.0
+
+static void copy_c(double *a, double *b, double *c, size_t n, double s)
+{
+    (void)b; (void)s;
+    for (size_t i = 0; i < n; i++)
+        c[i] = a[i];
+}
+
+static void scale_c(double *a, double *b, double *c, size_t n, double s)
+{
+    (void)a;
+    for (size_t i = 0; i < n; i++)
+        b[i] = s * c[i];
+}
+
+static void add_c(double *a, double *b, double *c, size_t n, double s)
+{
+    (void)s;
+    for (size_t i = 0; i < n; i++)
+        c[i] = a[i] + b[i];
+}
+
+static void triad_c(double *a, double *b, double *c, size_t n, double s)
+{
+    for (size_t i = 0; i < n; i++)
+        a[i] = b[i] + s * c[i];
+}
+
+#if defined(__x86_64__)
+/*
+ * Non-temporal variants: results bypass the cache hierarchy, so the store stream does not cause
+ * read-for-ownership traffic. Slices are cache-line aligned and a multiple of 64 bytes long.
+ */
+#define DEFINE_NT_KERNELS(isa, attr, vec, width, load, store, set1, add, mul)              \
+__attribute__((target(attr))) static void copy_##isa(double *a, double *b, double *c,      \
+                                                     size_t n, double s)                   \
+{                                                                                          \
+    (void)b; (void)s;                                                                      \
+    for (size_t i = 0; i < n; i += width)                                                  \
+        store(&c[i], load(&a[i]));                                                         \
+    _mm_sfence();                                                                          \
+}                                                                                          \
+__attribute__((target(attr))) static void scale_##isa(double *a, double *b, double *c,     \
+                                                      size_t n, double s)                  \
+{                                                                                          \
+    vec vs = set1(s);                                                                      \
+    (void)a;                                                                               \
+    for (size_t i = 0; i < n; i += width)                                                  \
+        store(&b[i], mul(vs, load(&c[i])));                                                \
+    _mm_sfence();                                                                          \
+}                                                                                          \
+__attribute__((target(attr))) static void add_##isa(double *a, double *b, double *c,       \
+                                                    size_t n, double s)                    \
+{                                                                                          \
+    (void)s;                                                                               \
+    for (size_t i = 0; i < n; i += width)                                                  \
+        store(&c[i], add(load(&a[i]), load(&b[i])));                                       \
+    _mm_sfence();                                                                          \
+}                                                                                          \
+__attribute__((target(attr))) static void triad_##isa(double *a, double *b, double *c,     \
+                                                      size_t n, double s)                  \
+{                                                                                          \
+    vec vs = set1(s);                                                                      \
+    for (size_t i = 0; i < n; i += width)                                                  \
+        store(&a[i], add(load(&b[i]), mul(vs, load(&c[i]))));                             \
+    _mm_sfence();                                                                          \
+}
+
+DEFINE_NT_KERNELS(sse2, "sse2", __m128d, 2, _mm_load_pd, _mm_stream_pd, _mm_set1_pd,
+                  _mm_add_pd, _mm_mul_pd)
+DEFINE_NT_KERNELS(avx2, "avx2", __m256d, 4, _mm256_load_pd, _mm256_stream_pd, _mm256_set1_pd,
+                  _mm256_add_pd, _mm256_mul_pd)
+DEFINE_NT_KERNELS(avx512, "avx512f", __m512d, 8, _mm512_load_pd, _mm512_stream_pd,
+                  _mm512_set1_pd, _mm512_add_pd, _mm512_mul_pd)
+#endif
+
+struct stream_variant {
+    const char *name;
+    stream_fn fn[NR_OPS];
+    int (*supported)(void);
+};
+
+static int always(void)
+{
+    return 1;
+}
+
+#if defined(__x86_64__)
+static int has_sse2(void)
+{
+    return __builtin_cpu_supports("sse2");
+}
+
+static int has_avx2(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+static int has_avx512(void)
+{
+    return __builtin_cpu_supports("avx512f");
+}
+#endif
+
+static const struct stream_variant variants[] = {
+    { "c", { copy_c, scale_c, add_c, triad_c }, always },
+#if defined(__x86_64__)
+    { "sse2-nt", { copy_sse2, scale_sse2, add_sse2, triad_sse2 }, has_sse2 },
+    { "avx2-nt", { copy_avx2, scale_avx2, add_avx2, triad_avx2 }, has_avx2 },
+    { "avx512-nt", { copy_avx512, scale_avx512, add_avx512, triad_avx512 }, has_avx512 },
+#endif
+};
+#define NR_VARIANTS (sizeof(variants) / sizeof(variants[0]))
+
+/* ---------------------------------------------------------------- threads */
+
+struct bench_config {
+    size_t size;
+    int nthreads;
+    int cpus[MAX_THREADS];
+    int ncpus;
+    int reps;
+    size_t latency_loads;
+    unsigned int variant_mask;
+    int skip_bandwidth;
+    int skip_latency;
+};
+
+struct worker {
+    pthread_t thread;
+    int id;
+    int cpu;
+    double *a, *b, *c;
+    size_t n;
+    /* when the worker began and finished the current run */
+    uint64_t start, end;
+};
+
+static struct {
+    pthread_barrier_t start;
+    pthread_barrier_t done;
+    stream_fn fn;
+    int quit;
+} job;
+
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+
+    if (w->cpu >= 0) {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+            fprintf(stderr, "Warning: failed to pin thread %d to cpu %d\n", w->id, w->cpu);
+    }
+
+    /* first touch from the pinned thread: demand-paged mappings allocate on its node */
+    memset(w->a, 0, w->n * sizeof(double));
+    memset(w->b, 0, w->n * sizeof(double));
+    memset(w->c, 0, w->n * sizeof(double));
+
+    for (;;) {
+        pthread_barrier_wait(&job.start);
+        if (job.quit)
+            break;
+        w->start = now_ticks();
+        job.fn(w->a, w->b, w->c, w->n, SCALAR);
+        w->end = now_ticks();
+        pthread_barrier_wait(&job.done);
+    }
+    return NULL;
+}
+
+/* ---------------------------------------------------------------- bandwidth */
+
+static void run_bandwidth(const struct bench_config *cfg, void *addr)
+{
+    struct worker workers[MAX_THREADS];
+    size_t array_bytes, slice_bytes, v;
+    double *samples, gbps;
+    uint64_t t0, t1;
+    int i, op, rep;
+
+    /* three arrays, each split into cache-line multiple slices, one per thread */
+    array_bytes = cfg->size / 3 / PAGE_SIZE * PAGE_SIZE;
+    slice_bytes = array_bytes / cfg->nthreads / (8 * CACHE_LINE) * (8 * CACHE_LINE);
+    if (slice_bytes == 0) {
+        fprintf(stderr, "Error: size too small for %d threads\n", cfg->nthreads);
+        return;
+    }
+
+    samples = calloc(cfg->reps, sizeof(double));
+    if (!samples) {
+        perror("calloc");
+        return;
+    }
+
+    pthread_barrier_init(&job.start, NULL, cfg->nthreads + 1);
+    pthread_barrier_init(&job.done, NULL, cfg->nthreads + 1);
+    job.quit = 0;
+    for (i = 0; i < cfg->nthreads; i++) {
+        workers[i].id = i;
+        workers[i].cpu = cfg->ncpus ? cfg->cpus[i % cfg->ncpus] : -1;
+        workers[i].a = (double *)((char *)addr + i * slice_bytes);
+        workers[i].b = (double *)((char *)addr + array_bytes + i * slice_bytes);
+        workers[i].c = (double *)((char *)addr + 2 * array_bytes + i * slice_bytes);
+        workers[i].n = slice_bytes / sizeof(double);
+        pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+    }
+
+    printf("Bandwidth: GB/s over %d runs, %d threads, %zu MB per array\n", cfg->reps,
+           cfg->nthreads, slice_bytes * cfg->nthreads >> 20);
+    printf("  %-6s %-10s %9s %9s %9s %9s\n", "kernel", "variant", "min", "p50", "p90", "max");
+
+    for (v = 0; v < NR_VARIANTS; v++) {
+        if (!(cfg->variant_mask & (1U << v)) || !variants[v].supported())
+            continue;
+        for (op = 0; op < NR_OPS; op++) {
+            job.fn = variants[v].fn[op];
+            for (rep = 0; rep < cfg->reps; rep++) {
+                pthread_barrier_wait(&job.start);
+                pthread_barrier_wait(&job.done);
+                /*
+                 * from the first worker to start to the last one to finish: the workers may run
+                 * before the main thread leaves the start barrier
+                 */
+                t0 = workers[0].start;
+                t1 = workers[0].end;
+                for (i = 1; i < cfg->nthreads; i++) {
+                    if (workers[i].start < t0)
+                        t0 = workers[i].start;
+                    if (workers[i].end > t1)
+                        t1 = workers[i].end;
+                }
+                gbps = (double)op_arrays[op] * slice_bytes * cfg->nthreads;
+                samples[rep] = gbps / ticks_to_ns(t1 - t0);
+            }
+            qsort(samples, cfg->reps, sizeof(double), cmp_double);
+            printf("  %-6s %-10s %9.2f %9.2f %9.2f %9.2f\n", op_names[op], variants[v].name,
+                   samples[0], percentile(samples, cfg->reps, 50),
+                   percentile(samples, cfg->reps, 90), samples[cfg->reps - 1]);
+        }
+    }
+
+    job.quit = 1;
+    pthread_barrier_wait(&job.start);
+    for (i = 0; i < cfg->nthreads; i++)
+        pthread_join(workers[i].thread, NULL);
+    pthread_barrier_destroy(&job.start);
+    pthread_barrier_destroy(&job.done);
+    free(samples);
+}
+
+/* ---------------------------------------------------------------- latency */
+
+static uint64_t xorshift64(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+/* link the cache lines of [addr, addr + ws) into a single random cycle, return its start */
+static void **build_chain(void *addr, size_t ws)
+{
+    size_t i, j, nlines = ws / CACHE_LINE;
+    uint64_t seed = 0x9e3779b97f4a7c15ULL;
+    size_t *order;
+    char *base = addr;
+    void **start;
+
+    order = malloc(nlines * sizeof(*order));
+    if (!order) {
+        perror("malloc");
+        return NULL;
+    }
+    for (i = 0; i < nlines; i++)
+        order[i] = i;
+    /* Sattolo's algorithm: a uniformly random permutation consisting of one cycle */
+    for (i = nlines - 1; i > 0; i--) {
+        size_t tmp;
+
+        j = xorshift64(&seed) % i;
+        tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+    for (i = 0; i < nlines; i++)
+        *(void **)(base + order[i] * CACHE_LINE) = base + order[(i + 1) % nlines] * CACHE_LINE;
+
+    start = (void **)(base + order[0] * CACHE_LINE);
+    free(order);
+    return start;
+}
+
+static void run_latency(const struct bench_config *cfg, void *addr)
+{
+    size_t ws, nsamples, s, i;
+    double *samples;
+    void **p;
+    uint64_t t0, t1;
+
+    if (cfg->ncpus) {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(cfg->cpus[0], &set);
+        if (sched_setaffinity(0, sizeof(set), &set))
+            perror("sched_setaffinity");
+    }
+
+    nsamples = cfg->latency_loads / LATENCY_BATCH;
+    if (nsamples == 0)
+        nsamples = 1;
+    samples = calloc(nsamples, sizeof(double));
+    if (!samples) {
+        perror("calloc");
+        return;
+    }
+
+    printf("Latency: ns per dependent load, %zu samples of %d loads\n", nsamples,
+           LATENCY_BATCH);
+    printf("  %10s %9s %9s %9s %9s\n", "working set", "min", "p50", "p90", "p99");
+
+    for (ws = LATENCY_MIN_WS; ws <= cfg->size; ws *= 2) {
+        p = build_chain(addr, ws);
+        if (!p)
+            break;
+
+        /* warm up: one pass over the chain, bounded by the sample budget */
+        for (i = 0; i < ws / CACHE_LINE && i < cfg->latency_loads; i++)
+            p = *p;
+
+        for (s = 0; s < nsamples; s++) {
+            t0 = now_ticks();
+            for (i = 0; i < LATENCY_BATCH; i++)
+                p = *(void * volatile *)p;
+            t1 = now_ticks();
+            samples[s] = ticks_to_ns(t1 - t0) / LATENCY_BATCH;
+        }
+        qsort(samples, nsamples, sizeof(double), cmp_double);
+
+        if (ws >= 1024 * 1024)
+            printf("  %8zu MB", ws >> 20);
+        else
+            printf("  %8zu KB", ws >> 10);
+        printf(" %9.1f %9.1f %9.1f %9.1f\n", samples[0], percentile(samples, nsamples, 50),
+               percentile(samples, nsamples, 90), percentile(samples, nsamples, 99));
+    }
+
+    free(samples);
+}
+
+/* ---------------------------------------------------------------- memdev */
 
 static void read_attr(char *buf, size_t len)
 {
@@ -28,85 +503,430 @@ static void read_attr(char *buf, size_t len)
     close(fd);
 }
 
-static void test_bandwidth(void *addr, size_t size)
+static const char *prot_names[] = {
+    [MEMDEV_PROT_CACHEABLE] = "normal_cacheable",
+    [MEMDEV_PROT_WRITECOMBINE] = "normal_noncacheable",
+    [MEMDEV_PROT_UNCACHED] = "device_noncacheable",
+};
+
+static const char *page_size_names[] = {
+    [MEMDEV_PAGE_BASE] = "base",
+    [MEMDEV_PAGE_PMD] = "pmd",
+    [MEMDEV_PAGE_PUD] = "pud",
+};
+
+static const char *populate_names[] = {
+    [MEMDEV_POPULATE_LAZY] = "lazy",
+    [MEMDEV_POPULATE_EAGER] = "eager",
+    [MEMDEV_POPULATE_CONTIG] = "contig",
+};
+
+static int lookup_name(const char *name, const char **names, int n)
 {
-    struct timeval start, end;
-    double time_us;
-    size_t i, npages = size / PAGE_SIZE;
-    volatile uint8_t *p = addr;
+    int i;
 
-    memset((void *)addr, 0xAA, size);
+    for (i = 0; i < n; i++) {
+        if (strcmp(name, names[i]) == 0)
+            return i;
+    }
+    return -1;
+}
 
-    gettimeofday(&start, NULL);
-    for (i = 0; i < npages; i++)
-        p[i * PAGE_SIZE] = (uint8_t)(i & 0xFF);
-    gettimeofday(&end, NULL);
+static void show_layout(int fd, void *addr)
+{
+    struct memdev_extent extents[8];
+    __u64 node_pages[64] = { 0 };
+    struct memdev_query query = {
+        .va = (uintptr_t)addr,
+        .extents = (uintptr_t)extents,
+        .node_pages = (uintptr_t)node_pages,
+        .max_extents = sizeof(extents) / sizeof(extents[0]),
+        .max_nodes = sizeof(node_pages) / sizeof(node_pages[0]),
+    };
+    unsigned int i;
+
+    if (ioctl(fd, MEMDEV_IOC_QUERY, &query) < 0) {
+        perror("ioctl MEMDEV_IOC_QUERY");
+        return;
+    }
 
-    time_us = (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_usec - start.tv_usec);
-    double bw = size / time_us / 1e6;
-    printf("  write: %.2f MB/s (%.1f us for %zu MB)\n", bw, time_us, size / (1024 * 1024));
+    printf("  attr=%s, page_size=%s, populate=%s\n", prot_names[query.prot],
+           page_size_names[query.page_size], populate_names[query.populate]);
+    if (query.populate == MEMDEV_POPULATE_CONTIG)
+        printf("  contiguous: pa=%#llx-%#llx\n", query.pa, query.pa + query.size - 1);
+    printf("  resident: %llu of %llu MB, %u extents, mempolicy=%u\n", query.resident >> 20,
+           query.size >> 20, query.nr_extents, query.mempolicy);
+    for (i = 0; i < query.max_nodes; i++) {
+        if (node_pages[i])
+            printf("    node %u: %llu MB\n", i, node_pages[i] * PAGE_SIZE >> 20);
+    }
+    for (i = 0; i < query.nr_extents && i < query.max_extents; i++)
+        printf("    offset=%#llx pa=%#llx size=%#llx node=%u order=%u\n",
+               extents[i].offset, extents[i].pa, extents[i].size,
+               extents[i].node, extents[i].order);
+    if (query.nr_extents > query.max_extents)
+        printf("    ...\n");
+}
 
-    volatile uint8_t sum = 0;
-    gettimeofday(&start, NULL);
-    for (i = 0; i < npages; i++)
-        sum += p[i * PAGE_SIZE];
-    gettimeofday(&end, NULL);
+/*
+ * Warm the whole mapping before the benchmark: allocate its pages, install its page tables and
+ * lock it, so the first pass of the benchmark does not pay for page faults.
+ */
+static int prefault(int fd, void *addr, size_t size)
+{
+    struct memdev_prefault pf = {
+        .va = (uintptr_t)addr,
+        .size = size,
+        .flags = MEMDEV_PREFAULT_WRITE | MEMDEV_PREFAULT_LOCK,
+    };
+    int ret = ioctl(fd, MEMDEV_IOC_PREFAULT, &pf);
 
-    time_us = (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_usec - start.tv_usec);
-    bw = size / time_us / 1e6;
-    printf("  read:  %.2f MB/s (%.1f us for %zu MB)\n", bw, time_us, size / (1024 * 1024));
-    (void)sum;
+    if (ret < 0)
+        perror("ioctl MEMDEV_IOC_PREFAULT");
+    printf("Prefault: %llu of %zu MB resident%s in %.3f ms\n\n", pf.resident >> 20, size >> 20,
+           pf.resident == size ? " (complete, locked)" : "", pf.duration_ns / 1e6);
+    return ret;
 }
 
-static void test_latency(void *addr, size_t size)
+/*
+ * Export the mapping as a dma-buf and hand it to a child process over a UNIX socket. The child
+ * maps it, checks what the parent wrote and answers through the shared pages: no copy involved.
+ */
+static int test_export(int fd, void *addr, size_t size)
 {
-    struct timeval start, end;
-    double time_us;
-    size_t i, n = 1000000;
-    uint64_t *offsets = malloc(n * sizeof(uint64_t));
-    volatile uint8_t sum = 0;
-    uint8_t *p = addr;
+    struct memdev_export export = { .va = (uintptr_t)addr, .flags = O_RDWR | O_CLOEXEC };
+    char cbuf[CMSG_SPACE(sizeof(int))] = { 0 };
+    struct iovec iov;
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                          .msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+    struct cmsghdr *cmsg;
+    volatile uint64_t *words = addr;
+    size_t i, nwords = size / sizeof(uint64_t);
+    int sv[2], status, ok = 1;
+    char byte = 0;
+    pid_t pid;
 
-    srand(42);
-    for (i = 0; i < n; i++)
-        offsets[i] = ((size_t)rand() % (size / PAGE_SIZE)) * PAGE_SIZE;
+    for (i = 0; i < nwords; i += PAGE_SIZE / sizeof(uint64_t))
+        words[i] = i;
 
-    gettimeofday(&start, NULL);
-    for (i = 0; i < n; i++)
-        sum += p[offsets[i]];
-    gettimeofday(&end, NULL);
+    if (ioctl(fd, MEMDEV_IOC_EXPORT, &export) < 0) {
+        perror("ioctl MEMDEV_IOC_EXPORT");
+        return -1;
+    }
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        perror("socketpair");
+        close(export.fd);
+        return -1;
+    }
+
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(sv[0]);
+        close(sv[1]);
+        close(export.fd);
+        return -1;
+    }
 
-    time_us = (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_usec - start.tv_usec);
-    printf("  random access: %.0f ns/access (%.1f ms total)\n", time_us * 1000 / n, time_us / 1000);
-    (void)sum;
-    free(offsets);
+    if (pid == 0) {
+        volatile uint64_t *shared;
+        int buf_fd;
+
+        close(sv[0]);
+        iov.iov_base = &byte;
+        iov.iov_len = 1;
+        if (recvmsg(sv[1], &msg, 0) <= 0 || !(cmsg = CMSG_FIRSTHDR(&msg)))
+            _exit(2);
+        memcpy(&buf_fd, CMSG_DATA(cmsg), sizeof(int));
+
+        shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, buf_fd, 0);
+        if (shared == MAP_FAILED)
+            _exit(3);
+        for (i = 0; i < nwords; i += PAGE_SIZE / sizeof(uint64_t)) {
+            if (shared[i] != i)
+                _exit(4);
+            shared[i] = ~i;
+        }
+        _exit(0);
+    }
+
+    close(sv[1]);
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &export.fd, sizeof(int));
+    if (sendmsg(sv[0], &msg, 0) < 0)
+        perror("sendmsg");
+    close(sv[0]);
+    close(export.fd);
+
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+        printf("  child failed (status %#x)\n", status);
+        return -1;
+    }
+    for (i = 0; i < nwords; i += PAGE_SIZE / sizeof(uint64_t))
+        ok &= words[i] == ~i;
+    printf("  dma-buf shared with pid %d: %s\n", pid, ok ? "ok" : "data mismatch");
+    return ok ? 0 : -1;
+}
+
+/*
+ * Double the mapping with mremap(), letting the kernel move it, and check that the pages keep
+ * their contents and the new half is usable; then give the new half back with munmap().
+ */
+static void *test_grow(int fd, void *addr, size_t size)
+{
+    volatile uint64_t *words;
+    size_t i, stride = PAGE_SIZE / sizeof(uint64_t), nwords = size / sizeof(uint64_t);
+    void *grown;
+    int ok = 1;
+
+    for (i = 0; i < nwords; i += stride)
+        ((volatile uint64_t *)addr)[i] = i ^ 0x5a5a5a5aULL;
+
+    grown = mremap(addr, size, 2 * size, MREMAP_MAYMOVE);
+    if (grown == MAP_FAILED) {
+        perror("mremap");
+        return addr;
+    }
+    words = grown;
+    for (i = 0; i < nwords; i += stride)
+        ok &= words[i] == (i ^ 0x5a5a5a5aULL);
+    for (i = nwords; i < 2 * nwords; i += stride)
+        words[i] = i;
+    printf("  grown to %zu MB%s: %s\n", 2 * size >> 20, grown == addr ? " in place" : "",
+           ok ? "ok" : "data mismatch");
+    show_layout(fd, grown);
+
+    munmap((char *)grown + size, size);
+    printf("  shrunk back to %zu MB\n", size >> 20);
+    show_layout(fd, grown);
+    return grown;
+}
+
+/* ---------------------------------------------------------------- options */
+
+static size_t parse_size(const char *arg)
+{
+    char *end;
+    size_t size = strtoul(arg, &end, 10);
+
+    switch (*end) {
+    case 'G':
+        size <<= 10;
+        /* fall through */
+    case 'M':
+        size <<= 10;
+        /* fall through */
+    case 'K':
+        size <<= 10;
+        break;
+    }
+    return size;
+}
+
+/* "0-3,8,10-11" */
+static int parse_cpu_list(const char *arg, int *cpus, int max)
+{
+    const char *p = arg;
+    char *end;
+    int n = 0;
+    long lo, hi;
+
+    while (*p) {
+        lo = strtol(p, &end, 10);
+        if (end == p || lo < 0)
+            return -1;
+        hi = lo;
+        if (*end == '-') {
+            p = end + 1;
+            hi = strtol(p, &end, 10);
+            if (end == p || hi < lo)
+                return -1;
+        }
+        for (; lo <= hi && n < max; lo++)
+            cpus[n++] = lo;
+        if (*end == ',')
+            end++;
+        else if (*end)
+            return -1;
+        p = end;
+    }
+    return n;
+}
+
+/* the first max CPUs this process may run on */
+static int default_cpu_list(int *cpus, int max)
+{
+    cpu_set_t set;
+    int cpu, n = 0;
+
+    if (sched_getaffinity(0, sizeof(set), &set))
+        return 0;
+    for (cpu = 0; cpu < CPU_SETSIZE && n < max; cpu++) {
+        if (CPU_ISSET(cpu, &set))
+            cpus[n++] = cpu;
+    }
+    return n;
 }
 
 static void usage(const char *prog)
 {
+    size_t v;
+
     printf("Usage: %s [options]\n", prog);
     printf("  -s <size>   Size (default: 256M)\n");
+    printf("  -a <attr>   Attribute of this mapping: normal_cacheable, normal_noncacheable,\n");
+    printf("              device_noncacheable (default: module parameter)\n");
+    printf("  -p <size>   Page size: base, pmd, pud (default: module parameter)\n");
+    printf("  -n <node>   Allocate from this node only\n");
+    printf("  -e          Allocate all pages at mmap time\n");
+    printf("  -C          Allocate one physically contiguous range at mmap time\n");
+    printf("  -w          Prefault and lock the whole mapping before the benchmark\n");
+    printf("  -g          Grow the mapping with mremap() and shrink it back\n");
+    printf("  -x          Share the mapping with a child process through a dma-buf\n");
+    printf("  -A          Benchmark anonymous memory instead of %s, as a baseline\n",
+           DEVICE_PATH);
+    printf("  -t <n>      Bandwidth threads (default: 1)\n");
+    printf("  -c <cpus>   Pin threads to this CPU list, e.g. 0-3,8 (default: allowed CPUs)\n");
+    printf("  -r <n>      Runs per bandwidth kernel (default: 10)\n");
+    printf("  -l <n>      Dependent loads per latency working set (default: 4M)\n");
+    printf("  -k <list>   Bandwidth variants, comma separated (default: all supported):");
+    for (v = 0; v < NR_VARIANTS; v++)
+        printf(" %s", variants[v].name);
+    printf("\n");
+    printf("  -B          Skip the bandwidth test\n");
+    printf("  -L          Skip the latency test\n");
+    printf("  -T          Time with the TSC instead of CLOCK_MONOTONIC_RAW\n");
     printf("  -h          Help\n");
 }
 
+static int parse_variants(char *arg, unsigned int *mask)
+{
+    char *name, *save;
+    size_t v;
+
+    *mask = 0;
+    for (name = strtok_r(arg, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+        for (v = 0; v < NR_VARIANTS; v++) {
+            if (strcmp(name, variants[v].name) == 0)
+                break;
+        }
+        if (v == NR_VARIANTS)
+            return -1;
+        *mask |= 1U << v;
+    }
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
-    int opt, fd;
-    size_t size = 256 * 1024 * 1024;
+    int opt, fd = -1, node, anonymous = 0, export = 0, grow = 0, warm = 0, ret = 0;
     char attr[64];
     void *addr;
+    struct memdev_mmap_params params = { 0 };
+    struct bench_config cfg = {
+        .size = 256 * 1024 * 1024,
+        .nthreads = 1,
+        .reps = 10,
+        .latency_loads = 4 * 1024 * 1024,
+        .variant_mask = ~0U,
+    };
 
-    while ((opt = getopt(argc, argv, "s:h")) != -1) {
+    while ((opt = getopt(argc, argv, "s:a:p:n:eCwgxAt:c:r:l:k:BLTh")) != -1) {
         switch (opt) {
         case 's':
-            if (strchr(optarg, 'M')) {
-                size = strtoul(optarg, NULL, 10) * 1024 * 1024;
-            } else if (strchr(optarg, 'G')) {
-                size = strtoul(optarg, NULL, 10) * 1024 * 1024 * 1024;
-            } else {
-                size = strtoul(optarg, NULL, 10);
+            cfg.size = parse_size(optarg);
+            break;
+        case 'a':
+            params.prot = lookup_name(optarg, prot_names, 3);
+            if ((int)params.prot < 0) {
+                fprintf(stderr, "Error: invalid attr '%s'\n", optarg);
+                return 1;
+            }
+            params.valid |= MEMDEV_PARAM_PROT;
+            break;
+        case 'p':
+            params.page_size = lookup_name(optarg, page_size_names, 3);
+            if ((int)params.page_size < 0) {
+                fprintf(stderr, "Error: invalid page size '%s'\n", optarg);
+                return 1;
+            }
+            params.valid |= MEMDEV_PARAM_PAGE_SIZE;
+            break;
+        case 'n':
+            node = atoi(optarg);
+            if (node < 0 || node >= MEMDEV_NODEMASK_WORDS * 64) {
+                fprintf(stderr, "Error: invalid node '%s'\n", optarg);
+                return 1;
+            }
+            params.nodemask[node / 64] |= 1ULL << (node % 64);
+            params.valid |= MEMDEV_PARAM_NODEMASK;
+            break;
+        case 'e':
+            params.populate = MEMDEV_POPULATE_EAGER;
+            params.valid |= MEMDEV_PARAM_POPULATE;
+            break;
+        case 'C':
+            params.populate = MEMDEV_POPULATE_CONTIG;
+            params.valid |= MEMDEV_PARAM_POPULATE;
+            break;
+        case 'w':
+            warm = 1;
+            break;
+        case 'g':
+            grow = 1;
+            break;
+        case 'x':
+            export = 1;
+            break;
+        case 'A':
+            anonymous = 1;
+            break;
+        case 't':
+            cfg.nthreads = atoi(optarg);
+            if (cfg.nthreads < 1 || cfg.nthreads > MAX_THREADS) {
+                fprintf(stderr, "Error: threads must be in [1, %d]\n", MAX_THREADS);
+                return 1;
+            }
+            break;
+        case 'c':
+            cfg.ncpus = parse_cpu_list(optarg, cfg.cpus, MAX_THREADS);
+            if (cfg.ncpus <= 0) {
+                fprintf(stderr, "Error: invalid CPU list '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'r':
+            cfg.reps = atoi(optarg);
+            if (cfg.reps < 1) {
+                fprintf(stderr, "Error: invalid number of runs '%s'\n", optarg);
+                return 1;
             }
             break;
+        case 'l':
+            cfg.latency_loads = parse_size(optarg);
+            break;
+        case 'k':
+            if (parse_variants(optarg, &cfg.variant_mask)) {
+                fprintf(stderr, "Error: invalid variant list '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'B':
+            cfg.skip_bandwidth = 1;
+            break;
+        case 'L':
+            cfg.skip_latency = 1;
+            break;
+        case 'T':
+            if (calibrate_tsc())
+                return 1;
+            break;
         case 'h':
         default:
             usage(argv[0]);
@@ -114,35 +934,80 @@ int main(int argc, char *argv[])
         }
     }
 
-    if (access(DEVICE_PATH, F_OK) != 0) {
-        fprintf(stderr, "Error: %s not found. Is memdev module loaded?\n", DEVICE_PATH);
+    if (!cfg.ncpus)
+        cfg.ncpus = default_cpu_list(cfg.cpus, cfg.nthreads);
+    cfg.size &= ~(size_t)(PAGE_SIZE - 1);
+    if (cfg.size < LATENCY_MIN_WS) {
+        fprintf(stderr, "Error: size must be at least %d KB\n", LATENCY_MIN_WS >> 10);
         return 1;
     }
 
-    read_attr(attr, sizeof(attr));
+    if (anonymous) {
+        snprintf(attr, sizeof(attr), "anonymous");
+        addr = mmap(NULL, cfg.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    } else {
+        if (access(DEVICE_PATH, F_OK) != 0) {
+            fprintf(stderr, "Error: %s not found. Is memdev module loaded?\n", DEVICE_PATH);
+            return 1;
+        }
+
+        read_attr(attr, sizeof(attr));
+        if (params.valid & MEMDEV_PARAM_PROT)
+            snprintf(attr, sizeof(attr), "%s", prot_names[params.prot]);
 
-    printf("memdev test: attr=%s, size=%zu MB\n\n", attr, size / (1024 * 1024));
+        fd = open(DEVICE_PATH, O_RDWR);
+        if (fd < 0) {
+            perror("open");
+            return 1;
+        }
 
-    fd = open(DEVICE_PATH, O_RDWR);
-    if (fd < 0) {
-        perror("open");
-        return 1;
-    }
+        if (params.valid && ioctl(fd, MEMDEV_IOC_SET_MMAP_PARAMS, &params) < 0) {
+            perror("ioctl MEMDEV_IOC_SET_MMAP_PARAMS");
+            close(fd);
+            return 1;
+        }
 
-    addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        addr = mmap(NULL, cfg.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
     if (addr == MAP_FAILED) {
         perror("mmap");
-        close(fd);
+        if (fd >= 0)
+            close(fd);
         return 1;
     }
 
-    printf("Bandwidth test:\n");
-    test_bandwidth(addr, size);
+    printf("memdev test: attr=%s, size=%zu MB, clock=%s\n\n", attr, cfg.size >> 20,
+           use_tsc ? "tsc" : "monotonic_raw");
 
-    printf("\nLatency test:\n");
-    test_latency(addr, size);
+    if (warm && fd >= 0 && prefault(fd, addr, cfg.size) < 0)
+        ret = 1;
 
-    munmap(addr, size);
-    close(fd);
-    return 0;
+    if (!cfg.skip_bandwidth) {
+        run_bandwidth(&cfg, addr);
+        printf("\n");
+    }
+
+    if (!cfg.skip_latency) {
+        run_latency(&cfg, addr);
+        printf("\n");
+    }
+
+    if (fd >= 0) {
+        printf("Layout:\n");
+        show_layout(fd, addr);
+
+        if (grow) {
+            printf("\nRemap:\n");
+            addr = test_grow(fd, addr, cfg.size);
+        }
+
+        if (export) {
+            printf("\nExport:\n");
+            ret = test_export(fd, addr, cfg.size) ? 1 : 0;
+        }
+        close(fd);
+    }
+
+    munmap(addr, cfg.size);
+    return ret;
 }
@@ -0,0 +1,238 @@
+#!/usr/bin/bash
+# Per-phase latency breakdown of memdev from its tracepoints.
+#
+# Either records the memdev events while a command runs, or reads a trace saved earlier from
+# /sys/kernel/tracing/trace (or trace_pipe). Every phase event carries its own duration; the
+# allocations, inserts and frees are attributed to the mmap()/munmap() of the same thread when
+# they fall within its duration, to page faults or the free workqueue otherwise.
+
+TRACING=/sys/kernel/tracing
+EVENTS="memdev_mmap memdev_alloc memdev_insert memdev_vma_close memdev_free"
+
+print_usage() {
+	cat << EOF
+Usage: $0 [-o file] command [args...]
+       $0 -f file
+
+Options:
+
+  -f file
+	analyze a saved trace instead of running a command
+
+  -o file
+	also keep the recorded trace in file
+
+  -h	show usage
+
+Example:
+
+  $0 ./test_memdev -s 64M -t 4
+EOF
+}
+
+# event lines to "phase node prot pages duration_ns" records
+attribute() {
+	awk '
+	function hex(s,    i, n) {
+		if (s !~ /^0x/)
+			return s + 0
+		n = 0
+		for (i = 3; i <= length(s); i++)
+			n = n * 16 + index("0123456789abcdef", tolower(substr(s, i, 1))) - 1
+		return n
+	}
+	function field(name,    i) {
+		for (i = 1; i <= NF; i++) {
+			if (index($i, name "=") == 1)
+				return substr($i, length(name) + 2)
+		}
+		return -1
+	}
+	# keep the phases of a thread until the mmap()/munmap() that may contain them
+	function hold(phase,    n) {
+		n = held[tid]++
+		held_ts[tid, n] = ts
+		held_rec[tid, n] = phase " " field("node") " " field("prot") " " \
+				   field("nr") " " field("duration_ns")
+	}
+	# phases since start belong to the caller, earlier ones to faults or the workqueue
+	function release(outer, start,    i, rec, n) {
+		n = held[tid]
+		for (i = 0; i < n; i++) {
+			rec = held_rec[tid, i]
+			if (held_ts[tid, i] >= start)
+				print outer "/" rec
+			else if (rec ~ /^alloc/)
+				print "fault/" rec
+			else
+				print "other/" rec
+			delete held_rec[tid, i]
+			delete held_ts[tid, i]
+		}
+		held[tid] = 0
+	}
+	/memdev_[a-z_]+:/ {
+		for (i = 1; i <= NF; i++) {
+			if ($i ~ /^memdev_[a-z_]+:$/)
+				break
+		}
+		if (i > NF)
+			next
+		event = substr($i, 8, length($i) - 8)
+		ts = $(i - 1)
+		sub(/:$/, "", ts)
+		# "comm-tid" where comm may itself contain dashes or spaces
+		for (j = 1; j < i; j++) {
+			if ($j ~ /-[0-9]+$/) {
+				tid = $j
+				sub(/.*-/, "", tid)
+				break
+			}
+		}
+		dur = field("duration_ns")
+		# timestamps have a microsecond resolution
+		start = ts - dur / 1e9 - 1e-6
+
+		if (event == "mmap") {
+			print "mmap/total -1 " field("prot") " " \
+			      hex(field("size")) / pagesize " " dur
+			release("mmap", start)
+		} else if (event == "vma_close") {
+			print "munmap/total -1 " field("prot") " " field("nr") " " dur
+			release("munmap", start)
+		} else if (event == "free" && field("async") == 1) {
+			print "workqueue/free " field("node") " " field("prot") " " \
+			      field("nr") " " dur
+		} else if (event == "alloc" || event == "insert" || event == "free") {
+			hold(event)
+		}
+	}
+	END {
+		for (tid in held)
+			release("", 1e30)
+	}' pagesize="$(getconf PAGESIZE)"
+}
+
+# records sorted by phase and duration to one line per phase
+summarize() {
+	sort -k1,1 -k5,5n | awk '
+	function flush(    p50, p99) {
+		if (!count)
+			return
+		p50 = d[int((count - 1) * 0.50) + 1]
+		p99 = d[int((count - 1) * 0.99) + 1]
+		printf "%-18s %8d %12d %12.3f %10.1f %10.1f %10.1f %10.1f\n", phase, count, pages,
+		       total / 1e6, total / count / 1e3, p50 / 1e3, p99 / 1e3, d[count] / 1e3
+		count = pages = total = 0
+	}
+	BEGIN {
+		printf "%-18s %8s %12s %12s %10s %10s %10s %10s\n", "phase", "count", "pages",
+		       "total_ms", "mean_us", "p50_us", "p99_us", "max_us"
+	}
+	$1 != phase {
+		flush()
+		phase = $1
+	}
+	{
+		d[++count] = $5
+		pages += $4
+		total += $5
+	}
+	END {
+		flush()
+	}'
+}
+
+# allocation and free throughput per node and memory attribute
+per_node() {
+	printf "%-10s %6s %6s %12s %12s %10s\n" phase node prot pages total_ms GiB/s
+	awk '
+	$1 ~ /alloc$|free$/ && $2 >= 0 {
+		split($1, p, "/")
+		key = sprintf("%-10s %6d %6d", p[2], $2, $3)
+		pages[key] += $4
+		ns[key] += $5
+	}
+	END {
+		for (key in pages)
+			printf "%s %12d %12.3f %10.2f\n", key, pages[key], ns[key] / 1e6,
+			       ns[key] ? pages[key] * pagesize / ns[key] / 1.073741824 : 0
+	}' pagesize="$(getconf PAGESIZE)" | sort
+}
+
+report() {
+	local records
+
+	records=$(attribute < "$1")
+	if [ -z "$records" ]; then
+		echo "no memdev events in $1" >&2
+		return 1
+	fi
+
+	echo "$records" | summarize
+	echo ""
+	echo "$records" | per_node
+}
+
+set_events() {
+	local event
+
+	for event in $EVENTS; do
+		echo "$1" > $TRACING/events/memdev/$event/enable || return 1
+	done
+}
+
+record() {
+	local out=$1 ret
+
+	shift
+	if [ ! -d $TRACING/events/memdev ]; then
+		echo "memdev events not found in $TRACING (module loaded, tracefs mounted?)" >&2
+		return 1
+	fi
+
+	echo 0 > $TRACING/tracing_on
+	echo > $TRACING/trace
+	set_events 1 || return 1
+	echo 1 > $TRACING/tracing_on
+
+	"$@"
+	ret=$?
+
+	echo 0 > $TRACING/tracing_on
+	set_events 0
+	cat $TRACING/trace > "$out"
+	if grep -q "LOST.*EVENTS" "$out"; then
+		echo "warning: events were lost, enlarge $TRACING/buffer_size_kb" >&2
+	fi
+	return $ret
+}
+
+input=""
+output=""
+while getopts "f:o:h" opt; do
+	case $opt in
+	f) input=$OPTARG ;;
+	o) output=$OPTARG ;;
+	h) print_usage; exit 0 ;;
+	*) print_usage; exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+if [ -n "$input" ]; then
+	report "$input"
+	exit $?
+fi
+
+if [ $# -eq 0 ]; then
+	print_usage
+	exit 1
+fi
+
+trace=${output:-$(mktemp)}
+record "$trace" "$@"
+ret=$?
+report "$trace" || ret=1
+[ -z "$output" ] && rm -f "$trace"
+exit $ret
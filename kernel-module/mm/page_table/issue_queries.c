@@ -1,30 +1,35 @@
 /*
- * issue page table query request to the kernel module.
+ * issue page table query request to the kernel module, through libptwalk.
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <poll.h>
 
-#include "page_table_query.h"
-
-#define DEVICE_PATH	  "/dev/page_table_walker"
+#include "libptwalk.h"
 
 int a_global_variable;
 volatile int sink;
 
+/* the one file of the device used by every query */
+static struct ptwalk *pw;
+/* tables of records printed by the queries */
+static struct ptwalk_writer writer;
+
 static int lookup_pagemap(unsigned long *pa, unsigned long va);
-// TODO the value of query->va
 // TODO show the pa of kernel addr
-// TODO decode page attributes of each architecuture
 static void print_page_table_query(const struct page_table_query *query, const char *desc)
 {
 	unsigned long pagemap_pa;
+	char attrs[256];
 
 	printf("[pid=%u, va=0x%016llx, %s]\n", query->pid, query->va, desc);
 	printf("num_levels=%u\n", query->num_levels);
@@ -39,6 +44,10 @@ static void print_page_table_query(const struct page_table_query *query, const c
 		query->pmd_entry_kla - query->kla_start, query->pmd_entry);
 	printf("pte_entry_kla=0x%016llx (pa=0x%016llx), pte_entry=0x%016llx\n", query->pte_entry_kla,
 		query->pte_entry_kla - query->kla_start, query->pte_entry);
+	if (query->num_levels == 5) {
+		ptwalk_decode_entry(query->pte_entry, 12, attrs, sizeof(attrs));
+		printf("pte_entry attributes: %s\n", attrs);
+	}
 	printf("pa=0x%016llx\n", query->pa);
 
 	/* check against /proc/pid/pagemap */
@@ -48,25 +57,333 @@ static void print_page_table_query(const struct page_table_query *query, const c
 
 static int query_va(void *va, const char *desc)
 {
-	int fd, ret;
-	struct page_table_query query = {};
+	struct page_table_query query;
+	int ret;
+
+	ret = ptwalk_query(pw, 0, (uintptr_t)va, 0, &query);
+	if (ret) {
+		fprintf(stderr, "query failed: %s\n", strerror(-ret));
+		return ret;
+	}
+	print_page_table_query(&query, desc);
+
+	return 0;
+}
+
+/* translate the pages of [start, start + npages * page_size) with a single batch ioctl */
+static int query_range(void *start, unsigned long npages, const char *desc)
+{
+	struct page_table_entry results[npages];
+	unsigned long i, mapped = 0;
+	int ret;
+
+	ret = ptwalk_translate_range(pw, 0, (uintptr_t)start, sysconf(_SC_PAGESIZE), npages, 0,
+				     results);
+	if (ret) {
+		fprintf(stderr, "batch query failed: %s\n", strerror(-ret));
+		return ret;
+	}
+
+	printf("[va=0x%016lx, %lu pages, %s]\n", (unsigned long)(uintptr_t)start, npages, desc);
+	ptwalk_writer_init(&writer, stdout, PTWALK_CSV);
+	for (i = 0; i < npages; i++) {
+		if (results[i].page_shift)
+			mapped++;
+		ptwalk_write_entry(&writer, &results[i]);
+	}
+	ptwalk_writer_finish(&writer);
+	printf("%lu of %lu pages mapped\n\n", mapped, npages);
+
+	return 0;
+}
+
+/* the largest leaf of the runs seen */
+static int max_run_shift(const struct page_table_run *run, void *arg)
+{
+	unsigned int *shift = arg;
+
+	if (run->page_shift > *shift)
+		*shift = run->page_shift;
+	return 0;
+}
+
+/*
+ * Translate a THP-backed buffer with a batch: where the range walk finds a huge leaf, every
+ * address of the batch must report it as well. Nothing is checked if no huge page backs the
+ * buffer (THP disabled, or none available).
+ */
+static int check_thp_batch(void)
+{
+	unsigned long page_size = sysconf(_SC_PAGESIZE), huge = 2UL << 20;
+	unsigned long i, npages = huge / page_size, mismatch = 0;
+	struct page_table_entry *results;
+	unsigned int shift = 0;
+	void *raw, *buf;
+	int ret;
 
-	fd = open(DEVICE_PATH, O_RDWR);
-	if (fd < 0) {
-		perror("open");
+	raw = mmap(NULL, 2 * huge, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (raw == MAP_FAILED) {
+		perror("mmap");
 		return -1;
 	}
+	buf = (void *)(((uintptr_t)raw + huge - 1) & ~(huge - 1));
+	/* not fatal: THP may be disabled altogether */
+	madvise(buf, huge, MADV_HUGEPAGE);
+	memset(buf, 0xFF, huge);
 
-	query.va = (__u64)(uintptr_t)va;
-	ret = ioctl(fd, PAGE_TABLE_QUERY, &query);
-	if (ret < 0) {
-		perror("IOCTL PAGE_TABLE_QUERY failed");
-		close(fd);
+	results = calloc(npages, sizeof(*results));
+	if (!results) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	ret = ptwalk_translate_range(pw, 0, (uintptr_t)buf, page_size, npages, 0, results);
+	if (!ret)
+		ret = ptwalk_for_each_run(pw, 0, (uintptr_t)buf, (uintptr_t)buf + huge, 0,
+					  max_run_shift, &shift);
+	if (ret) {
+		fprintf(stderr, "THP query failed: %s\n", strerror(-ret));
+		goto out;
+	}
+
+	printf("[va=0x%016lx, %lu pages, thp_buffer]\n", (unsigned long)(uintptr_t)buf, npages);
+	if (shift <= (unsigned int)__builtin_ctzl(page_size)) {
+		printf("not backed by a huge page, nothing to check\n\n");
+		goto out;
+	}
+	for (i = 0; i < npages; i++)
+		mismatch += results[i].page_shift != shift;
+	printf("%lu of %lu pages in leaves of shift %u\n\n", npages - mismatch, npages, shift);
+	if (mismatch) {
+		fprintf(stderr, "batch query missed the huge leaf of %lu pages\n", mismatch);
+		ret = -1;
+	}
+
+out:
+	free(results);
+	munmap(raw, 2 * huge);
+	return ret;
+}
+
+static int print_run(const struct page_table_run *run, void *arg)
+{
+	unsigned long *total = arg;
+
+	*total += run->count << run->page_shift;
+	ptwalk_write_run(&writer, run);
+	return 0;
+}
+
+/* describe [start, start + size) as runs of contiguous mappings */
+static int query_runs(void *start, unsigned long size, const char *desc)
+{
+	unsigned long total = 0;
+	int ret;
+
+	printf("[va=0x%016lx, size=0x%lx, %s]\n", (unsigned long)(uintptr_t)start, size, desc);
+	ptwalk_writer_init(&writer, stdout, PTWALK_CSV);
+	ret = ptwalk_for_each_run(pw, 0, (uintptr_t)start, (uintptr_t)start + size,
+				  PAGE_TABLE_RANGE_AD, print_run, &total);
+	ptwalk_writer_finish(&writer);
+	if (ret) {
+		fprintf(stderr, "range query failed: %s\n", strerror(-ret));
 		return ret;
 	}
-	close(fd);
+	printf("0x%lx bytes mapped\n\n", total);
 
-	print_page_table_query(&query, desc);
+	return 0;
+}
+
+static int print_vma(const struct page_table_vma *vma, void *arg)
+{
+	(void)arg;
+	ptwalk_write_vma(&writer, vma);
+	return 0;
+}
+
+/* per-VMA page size and residency of the whole address space of this process */
+static int query_vmas(void)
+{
+	int ret;
+
+	printf("[vmas]\n");
+	ptwalk_writer_init(&writer, stdout, PTWALK_CSV);
+	ret = ptwalk_for_each_vma(pw, 0, 0, UINT64_MAX, print_vma, NULL);
+	ptwalk_writer_finish(&writer);
+	if (ret) {
+		fprintf(stderr, "vmas query failed: %s\n", strerror(-ret));
+		return ret;
+	}
+	printf("\n");
+
+	return 0;
+}
+
+static double ns_per_query(const struct timespec *t0, const struct timespec *t1, int loops)
+{
+	return ((t1->tv_sec - t0->tv_sec) * 1e9 + (t1->tv_nsec - t0->tv_nsec)) / loops;
+}
+
+/* the same query repeated bound to this process, without the mmap lock, then unbound */
+static int query_bound(void *va, int loops)
+{
+	struct page_table_query query;
+	struct timespec t0, t1, t2, t3;
+	int i, ret, lockless = 0;
+
+	ret = ptwalk_bind(pw, getpid());
+	if (ret) {
+		fprintf(stderr, "bind failed: %s\n", strerror(-ret));
+		return ret;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < loops && !ret; i++)
+		ret = ptwalk_query(pw, 0, (uintptr_t)va, 0, &query);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	for (i = 0; i < loops && !ret; i++) {
+		ret = ptwalk_query(pw, 0, (uintptr_t)va, PAGE_TABLE_QUERY_LOCKLESS, &query);
+		lockless += query.lockless;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+	/* no fast GUP on this architecture */
+	if (ret == -EOPNOTSUPP) {
+		lockless = -1;
+		ret = 0;
+	}
+
+	if (!ret)
+		ret = ptwalk_unbind(pw);
+	for (i = 0; i < loops && !ret; i++)
+		ret = ptwalk_query(pw, getpid(), (uintptr_t)va, 0, &query);
+	clock_gettime(CLOCK_MONOTONIC, &t3);
+	if (ret) {
+		fprintf(stderr, "query failed: %s\n", strerror(-ret));
+		return ret;
+	}
+
+	printf("[va=0x%016lx, %d queries]\n", (unsigned long)(uintptr_t)va, loops);
+	printf("bound: %.0f ns/query\n", ns_per_query(&t0, &t1, loops));
+	if (lockless < 0)
+		printf("bound, lockless: not supported\n");
+	else
+		printf("bound, lockless: %.0f ns/query (%d without the mmap lock)\n",
+		       ns_per_query(&t1, &t2, loops), lockless);
+	printf("unbound: %.0f ns/query\n\n", ns_per_query(&t2, &t3, loops));
+
+	return 0;
+}
+
+/* consume the events waiting in a watch ring */
+static void print_events(struct page_table_ring *ring)
+{
+	static const char * const names[] = {
+		[PAGE_TABLE_EVENT_MAPPED] = "mapped",
+		[PAGE_TABLE_EVENT_UNMAPPED] = "unmapped",
+		[PAGE_TABLE_EVENT_MOVED] = "moved",
+		[PAGE_TABLE_EVENT_MIGRATED] = "migrated",
+		[PAGE_TABLE_EVENT_SPLIT] = "split",
+		[PAGE_TABLE_EVENT_COLLAPSED] = "collapsed",
+		[PAGE_TABLE_EVENT_EXIT] = "exit",
+	};
+	struct page_table_event *events = (void *)((char *)ring + ring->events_offset);
+	struct page_table_event *event;
+	__u64 head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	__u64 tail = ring->tail;
+
+	for (; tail != head; tail++) {
+		event = &events[tail % ring->nr_events];
+		printf("%-9s va=0x%016llx pages=%llu pa=0x%016llx->0x%016llx shift=%u->%u node=%d->%d\n",
+			event->type < sizeof(names) / sizeof(names[0]) ? names[event->type] : "?",
+			event->va, event->nr_pages, event->old_pa, event->pa,
+			event->old_page_shift, event->page_shift, event->old_nid, event->nid);
+	}
+	/* the slots are free once read */
+	__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+}
+
+/* watch a buffer while pages are written, then released, printing the changes seen */
+static int watch_buffer(unsigned long npages)
+{
+	unsigned long page_size = sysconf(_SC_PAGESIZE), i;
+	size_t ring_size = 16 * page_size;
+	struct page_table_watch watch = {};
+	struct page_table_ring *ring;
+	struct pollfd pfd;
+	unsigned char *buffer;
+	int fd = ptwalk_fd(pw), ret = -1;
+
+	ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ring == MAP_FAILED) {
+		perror("mmap ring");
+		return -1;
+	}
+	buffer = mmap(NULL, npages * page_size, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buffer == MAP_FAILED) {
+		perror("mmap");
+		goto out_unmap_ring;
+	}
+
+	watch.start = (__u64)(uintptr_t)buffer;
+	watch.end = watch.start + npages * page_size;
+	watch.interval_ms = 10;
+	if (ioctl(fd, PAGE_TABLE_WATCH, &watch) < 0) {
+		perror("IOCTL PAGE_TABLE_WATCH failed");
+		goto out_unmap;
+	}
+
+	printf("[watch va=0x%016llx, %lu pages, %u events in the ring]\n", watch.start, npages,
+		ring->nr_events);
+	/* after the baseline scan: every page mapped, then the second half released */
+	while (__atomic_load_n(&ring->scans, __ATOMIC_RELAXED) < 1)
+		usleep(1000);
+	for (i = 0; i < npages; i++)
+		buffer[i * page_size] = 0xFF;
+	usleep(50 * 1000);
+	madvise(buffer + npages / 2 * page_size, (npages - npages / 2) * page_size, MADV_DONTNEED);
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (poll(&pfd, 1, 100) > 0)
+		print_events(ring);
+	printf("%llu scans, %llu events lost\n\n", ring->scans, ring->lost);
+
+	watch.flags = PAGE_TABLE_WATCH_STOP;
+	ret = ioctl(fd, PAGE_TABLE_WATCH, &watch);
+	if (ret < 0)
+		perror("IOCTL PAGE_TABLE_WATCH failed");
+out_unmap:
+	munmap(buffer, npages * page_size);
+out_unmap_ring:
+	munmap(ring, ring_size);
+	return ret;
+}
+
+/* how the kernel ranges are mapped, needs root */
+static int query_kernel(void)
+{
+	struct page_table_kernel kernel;
+	unsigned int i;
+	int ret;
+
+	ret = ptwalk_kernel(pw, &kernel);
+	if (ret) {
+		/* not an error of the module: another architecture, or not root */
+		if (ret == -EOPNOTSUPP || ret == -EPERM) {
+			printf("[kernel] %s\n\n", strerror(-ret));
+			return 0;
+		}
+		fprintf(stderr, "kernel query failed: %s\n", strerror(-ret));
+		return ret;
+	}
+
+	printf("[kernel]\n");
+	ptwalk_writer_init(&writer, stdout, PTWALK_CSV);
+	for (i = 0; i < kernel.nr_ranges; i++)
+		ptwalk_write_kernel_range(&writer, &kernel.ranges[i]);
+	ptwalk_writer_finish(&writer);
+	printf("\n");
 
 	return 0;
 }
@@ -84,6 +401,12 @@ int main(int argc __attribute__((unused)), char **argv __attribute__((unused)))
 	}
 	ch = (unsigned char *)buffer;
 
+	pw = ptwalk_open();
+	if (!pw) {
+		perror("open " PTWALK_DEVICE_PATH);
+		return -1;
+	}
+
 	ret = query_va(NULL, "null");
 	if (ret)
 		return ret;
@@ -115,6 +438,43 @@ int main(int argc __attribute__((unused)), char **argv __attribute__((unused)))
 		return -1;
 	}
 
+	/* every other page written: half of the range is mapped */
+	buffer = mmap(NULL, 16 * sysconf(_SC_PAGESIZE), PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buffer == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	for (int i = 0; i < 16; i += 2)
+		((unsigned char *)buffer)[i * sysconf(_SC_PAGESIZE)] = 0xFF;
+	ret = query_range(buffer, 16, "every_other_page_written");
+	if (!ret)
+		ret = query_runs(buffer, 16 * sysconf(_SC_PAGESIZE), "every_other_page_written");
+	munmap(buffer, 16 * sysconf(_SC_PAGESIZE));
+	if (ret)
+		return ret;
+
+	ret = check_thp_batch();
+	if (ret)
+		return ret;
+
+	ret = query_vmas();
+	if (ret)
+		return ret;
+
+	ret = query_bound(&a_global_variable, 10000);
+	if (ret)
+		return ret;
+
+	ret = watch_buffer(64);
+	if (ret)
+		return ret;
+
+	ret = query_kernel();
+	if (ret)
+		return ret;
+
+	ptwalk_close(pw);
 	printf("Queries completed without error.\n");
 	return 0;
 }
@@ -0,0 +1,497 @@
+/*
+ * libptwalk - user space interface of the page_table_walker module.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "libptwalk.h"
+
+#define ARRAY_SIZE(a)		(sizeof(a) / sizeof((a)[0]))
+#define BIT_ULL(nr)		(1ULL << (nr))
+
+/* records fetched per ioctl by the iterators */
+#define RUNS_PER_CALL		256
+#define VMAS_PER_CALL		64
+
+struct ptwalk {
+	int fd;
+};
+
+struct ptwalk *ptwalk_open(void)
+{
+	struct ptwalk *pw;
+	int err;
+
+	pw = malloc(sizeof(*pw));
+	if (!pw)
+		return NULL;
+
+	pw->fd = open(PTWALK_DEVICE_PATH, O_RDWR | O_CLOEXEC);
+	if (pw->fd < 0) {
+		err = errno;
+		free(pw);
+		errno = err;
+		return NULL;
+	}
+	return pw;
+}
+
+void ptwalk_close(struct ptwalk *pw)
+{
+	if (!pw)
+		return;
+	close(pw->fd);
+	free(pw);
+}
+
+int ptwalk_fd(const struct ptwalk *pw)
+{
+	return pw->fd;
+}
+
+static int pw_ioctl(struct ptwalk *pw, unsigned long request, void *arg)
+{
+	return ioctl(pw->fd, request, arg) < 0 ? -errno : 0;
+}
+
+int ptwalk_bind(struct ptwalk *pw, pid_t pid)
+{
+	struct page_table_bind bind = { .pid = pid };
+
+	return pw_ioctl(pw, PAGE_TABLE_BIND, &bind);
+}
+
+int ptwalk_unbind(struct ptwalk *pw)
+{
+	struct page_table_bind bind = { .flags = PAGE_TABLE_UNBIND };
+
+	return pw_ioctl(pw, PAGE_TABLE_BIND, &bind);
+}
+
+int ptwalk_query(struct ptwalk *pw, pid_t pid, uint64_t va, unsigned int flags,
+		 struct page_table_query *query)
+{
+	memset(query, 0, sizeof(*query));
+	query->pid = pid;
+	query->flags = flags;
+	query->va = va;
+	return pw_ioctl(pw, PAGE_TABLE_QUERY, query);
+}
+
+static int translate(struct ptwalk *pw, struct page_table_batch *batch)
+{
+	int ret;
+
+	ret = pw_ioctl(pw, PAGE_TABLE_QUERY_BATCH, batch);
+	/* a fatal signal may interrupt a long batch, the results written are still valid */
+	if (!ret && batch->done != batch->count)
+		ret = -EINTR;
+	return ret;
+}
+
+int ptwalk_translate(struct ptwalk *pw, pid_t pid, const uint64_t *vas, size_t count,
+		     unsigned int flags, struct page_table_entry *results)
+{
+	struct page_table_batch batch = {
+		.pid = pid,
+		.flags = flags,
+		.vas = (uintptr_t)vas,
+		.count = count,
+		.results = (uintptr_t)results,
+	};
+
+	return translate(pw, &batch);
+}
+
+int ptwalk_translate_range(struct ptwalk *pw, pid_t pid, uint64_t start, uint64_t stride,
+			   size_t count, unsigned int flags, struct page_table_entry *results)
+{
+	struct page_table_batch batch = {
+		.pid = pid,
+		.flags = flags | PAGE_TABLE_BATCH_RANGE,
+		.start = start,
+		.stride = stride,
+		.count = count,
+		.results = (uintptr_t)results,
+	};
+
+	return translate(pw, &batch);
+}
+
+int ptwalk_for_each_run(struct ptwalk *pw, pid_t pid, uint64_t start, uint64_t end,
+			unsigned int flags, ptwalk_run_fn fn, void *arg)
+{
+	struct page_table_run runs[RUNS_PER_CALL];
+	struct page_table_range range = {
+		.pid = pid,
+		.flags = flags,
+		.start = start,
+		.end = end,
+		.runs = (uintptr_t)runs,
+		.max_runs = ARRAY_SIZE(runs),
+	};
+	uint64_t i;
+	int ret;
+
+	while (range.start < range.end) {
+		ret = pw_ioctl(pw, PAGE_TABLE_QUERY_RANGE, &range);
+		if (ret)
+			return ret;
+		for (i = 0; i < range.nr_runs; i++) {
+			ret = fn(&runs[i], arg);
+			if (ret)
+				return ret;
+		}
+		range.start = range.next;
+	}
+	return 0;
+}
+
+int ptwalk_for_each_vma(struct ptwalk *pw, pid_t pid, uint64_t start, uint64_t end,
+			ptwalk_vma_fn fn, void *arg)
+{
+	struct page_table_vma vmas[VMAS_PER_CALL];
+	struct page_table_vmas query = {
+		.pid = pid,
+		.start = start,
+		.end = end,
+		.vmas = (uintptr_t)vmas,
+		.max_vmas = ARRAY_SIZE(vmas),
+	};
+	uint64_t i;
+	int ret;
+
+	while (query.start < query.end) {
+		ret = pw_ioctl(pw, PAGE_TABLE_QUERY_VMAS, &query);
+		if (ret)
+			return ret;
+		for (i = 0; i < query.nr_vmas; i++) {
+			ret = fn(&vmas[i], arg);
+			if (ret)
+				return ret;
+		}
+		query.start = query.next;
+	}
+	return 0;
+}
+
+int ptwalk_kernel(struct ptwalk *pw, struct page_table_kernel *kernel)
+{
+	memset(kernel, 0, sizeof(*kernel));
+	return pw_ioctl(pw, PAGE_TABLE_QUERY_KERNEL, kernel);
+}
+
+/* decoding: names appended to buf, '|' separated, snprintf() style truncation */
+struct decoder {
+	char *buf;
+	size_t size;
+	size_t len;
+};
+
+static void add_name(struct decoder *d, const char *name, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static void add_name(struct decoder *d, const char *name, ...)
+{
+	va_list ap;
+
+	if (d->len)
+		d->len += snprintf(d->len < d->size ? d->buf + d->len : NULL,
+				   d->len < d->size ? d->size - d->len : 0, "|");
+	va_start(ap, name);
+	d->len += vsnprintf(d->len < d->size ? d->buf + d->len : NULL,
+			    d->len < d->size ? d->size - d->len : 0, name, ap);
+	va_end(ap);
+}
+
+struct bit_name {
+	unsigned int bit;
+	const char *name;
+};
+
+static void add_bits(struct decoder *d, uint64_t entry, const struct bit_name *bits, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		if (entry & BIT_ULL(bits[i].bit))
+			add_name(d, "%s", bits[i].name);
+	}
+}
+
+#if defined(__x86_64__)
+/* arch/x86/include/asm/pgtable_types.h */
+static void decode_entry(struct decoder *d, uint64_t entry, unsigned int page_shift)
+{
+	static const struct bit_name bits[] = {
+		{ 0, "P" }, { 1, "RW" }, { 2, "US" }, { 3, "PWT" }, { 4, "PCD" }, { 5, "A" },
+	};
+	static const struct bit_name leaf_bits[] = {
+		{ 6, "D" }, { 8, "G" },
+	};
+	unsigned int pkey;
+
+	add_bits(d, entry, bits, ARRAY_SIZE(bits));
+	if (page_shift) {
+		add_bits(d, entry, leaf_bits, ARRAY_SIZE(leaf_bits));
+		/* bit 7 is PAT in a PTE, PSE (and bit 12 PAT) in a huge leaf */
+		if (page_shift == 12) {
+			if (entry & BIT_ULL(7))
+				add_name(d, "PAT");
+		} else {
+			if (entry & BIT_ULL(7))
+				add_name(d, "PSE");
+			if (entry & BIT_ULL(12))
+				add_name(d, "PAT");
+		}
+		pkey = (entry >> 59) & 0xf;
+		if (pkey)
+			add_name(d, "PKEY=%u", pkey);
+	}
+	if (entry & BIT_ULL(63))
+		add_name(d, "NX");
+}
+#elif defined(__aarch64__)
+/* arch/arm64/include/asm/pgtable-hwdef.h, 4K granule */
+static void decode_entry(struct decoder *d, uint64_t entry, unsigned int page_shift)
+{
+	static const struct bit_name leaf_bits[] = {
+		{ 5, "NS" }, { 6, "USER" }, { 7, "RDONLY" }, { 10, "AF" }, { 11, "NG" },
+		{ 51, "DBM" }, { 52, "CONT" }, { 53, "PXN" }, { 54, "UXN" },
+		/* software bits of Linux */
+		{ 55, "SW_DIRTY" }, { 56, "SW_SPECIAL" },
+	};
+	static const struct bit_name table_bits[] = {
+		{ 59, "PXNTABLE" }, { 60, "UXNTABLE" }, { 63, "NSTABLE" },
+	};
+
+	if (entry & BIT_ULL(0))
+		add_name(d, "V");
+	if (!page_shift) {
+		add_name(d, "TABLE");
+		add_bits(d, entry, table_bits, ARRAY_SIZE(table_bits));
+		if ((entry >> 61) & 0x3)
+			add_name(d, "APTABLE=%u", (unsigned int)((entry >> 61) & 0x3));
+		return;
+	}
+
+	add_name(d, page_shift == 12 ? "PAGE" : "BLOCK");
+	add_name(d, "ATTRINDX=%u", (unsigned int)((entry >> 2) & 0x7));
+	add_name(d, "SH=%u", (unsigned int)((entry >> 8) & 0x3));
+	add_bits(d, entry, leaf_bits, ARRAY_SIZE(leaf_bits));
+}
+#else
+static void decode_entry(struct decoder *d, uint64_t entry, unsigned int page_shift)
+{
+	(void)page_shift;
+	add_name(d, "0x%" PRIx64, entry);
+}
+#endif
+
+size_t ptwalk_decode_entry(uint64_t entry, unsigned int page_shift, char *buf, size_t size)
+{
+	struct decoder d = { .buf = buf, .size = size };
+
+	if (size)
+		buf[0] = '\0';
+	decode_entry(&d, entry, page_shift);
+	return d.len;
+}
+
+size_t ptwalk_decode_run_flags(uint32_t flags, char *buf, size_t size)
+{
+	static const struct bit_name bits[] = {
+		{ 0, "WRITE" }, { 1, "DIRTY" }, { 2, "YOUNG" }, { 3, "SPECIAL" },
+	};
+	struct decoder d = { .buf = buf, .size = size };
+
+	if (size)
+		buf[0] = '\0';
+	add_bits(&d, flags, bits, ARRAY_SIZE(bits));
+	return d.len;
+}
+
+/* output */
+enum field_type {
+	FIELD_HEX,
+	FIELD_UINT,
+	FIELD_INT,
+	FIELD_STR,
+};
+
+struct field {
+	const char *name;
+	enum field_type type;
+	union {
+		uint64_t u;
+		int64_t i;
+		const char *s;
+	};
+};
+
+#define HEX(n, v)	{ .name = n, .type = FIELD_HEX, .u = (v) }
+#define UINT(n, v)	{ .name = n, .type = FIELD_UINT, .u = (v) }
+#define INT(n, v)	{ .name = n, .type = FIELD_INT, .i = (v) }
+#define STR(n, v)	{ .name = n, .type = FIELD_STR, .s = (v) }
+
+void ptwalk_writer_init(struct ptwalk_writer *w, FILE *out, enum ptwalk_format format)
+{
+	w->out = out;
+	w->format = format;
+	w->records = 0;
+}
+
+static void write_json_string(FILE *out, const char *s)
+{
+	fputc('"', out);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fputc('\\', out);
+		fputc(*s, out);
+	}
+	fputc('"', out);
+}
+
+static void write_value(struct ptwalk_writer *w, const struct field *f)
+{
+	switch (f->type) {
+	case FIELD_HEX:
+		fprintf(w->out, w->format == PTWALK_JSON ? "\"0x%" PRIx64 "\"" : "0x%" PRIx64, f->u);
+		break;
+	case FIELD_UINT:
+		fprintf(w->out, "%" PRIu64, f->u);
+		break;
+	case FIELD_INT:
+		fprintf(w->out, "%" PRId64, f->i);
+		break;
+	case FIELD_STR:
+		if (w->format == PTWALK_JSON)
+			write_json_string(w->out, f->s);
+		else
+			fputs(f->s, w->out);
+		break;
+	}
+}
+
+/* CSV: a header line before the first record; JSON: one object per record */
+static void write_record(struct ptwalk_writer *w, const struct field *fields, size_t n)
+{
+	size_t i;
+
+	if (w->format == PTWALK_CSV) {
+		if (!w->records) {
+			for (i = 0; i < n; i++)
+				fprintf(w->out, "%s%s", i ? "," : "", fields[i].name);
+			fputc('\n', w->out);
+		}
+		for (i = 0; i < n; i++) {
+			if (i)
+				fputc(',', w->out);
+			write_value(w, &fields[i]);
+		}
+		fputc('\n', w->out);
+	} else {
+		fputs(w->records ? ",\n  {" : "[\n  {", w->out);
+		for (i = 0; i < n; i++) {
+			fprintf(w->out, "%s\"%s\": ", i ? ", " : "", fields[i].name);
+			write_value(w, &fields[i]);
+		}
+		fputc('}', w->out);
+	}
+	w->records++;
+}
+
+void ptwalk_writer_finish(struct ptwalk_writer *w)
+{
+	if (w->format == PTWALK_JSON)
+		fputs(w->records ? "\n]\n" : "[]\n", w->out);
+	fflush(w->out);
+}
+
+void ptwalk_write_query(struct ptwalk_writer *w, const struct page_table_query *q)
+{
+	char attrs[256];
+	/* the leaf is the last entry walked through if the address is mapped */
+	uint64_t leaf = q->pa ? (q->num_levels >= 5 ? q->pte_entry : q->num_levels == 4 ?
+				 q->pmd_entry : q->pud_entry) : 0;
+	unsigned int page_shift = !q->pa ? 0 : q->num_levels >= 5 ? 12 :
+				  q->num_levels == 4 ? 21 : 30;
+	struct field fields[] = {
+		UINT("pid", q->pid), HEX("va", q->va), HEX("pa", q->pa),
+		UINT("num_levels", q->num_levels), UINT("lockless", q->lockless),
+		HEX("pgd_entry", q->pgd_entry), HEX("p4d_entry", q->p4d_entry),
+		HEX("pud_entry", q->pud_entry), HEX("pmd_entry", q->pmd_entry),
+		HEX("pte_entry", q->pte_entry), HEX("pte_entry_kla", q->pte_entry_kla),
+		STR("attrs", attrs),
+	};
+
+	ptwalk_decode_entry(leaf, page_shift, attrs, sizeof(attrs));
+	write_record(w, fields, ARRAY_SIZE(fields));
+}
+
+void ptwalk_write_entry(struct ptwalk_writer *w, const struct page_table_entry *e)
+{
+	char attrs[256];
+	struct field fields[] = {
+		HEX("va", e->va), HEX("pa", e->pa), HEX("entry", e->entry),
+		UINT("num_levels", e->num_levels), UINT("page_shift", e->page_shift),
+		STR("attrs", attrs),
+	};
+
+	/* an unmapped address stops at a table entry, or at a non-present leaf */
+	if (e->page_shift)
+		ptwalk_decode_entry(e->entry, e->page_shift, attrs, sizeof(attrs));
+	else
+		attrs[0] = '\0';
+	write_record(w, fields, ARRAY_SIZE(fields));
+}
+
+void ptwalk_write_run(struct ptwalk_writer *w, const struct page_table_run *run)
+{
+	char flags[64];
+	struct field fields[] = {
+		HEX("va", run->va), HEX("pa", run->pa), UINT("count", run->count),
+		UINT("page_shift", run->page_shift), UINT("bytes", run->count << run->page_shift),
+		STR("flags", flags),
+	};
+
+	ptwalk_decode_run_flags(run->flags, flags, sizeof(flags));
+	write_record(w, fields, ARRAY_SIZE(fields));
+}
+
+void ptwalk_write_vma(struct ptwalk_writer *w, const struct page_table_vma *vma)
+{
+	struct field fields[] = {
+		HEX("start", vma->start), HEX("end", vma->end), HEX("vm_flags", vma->vm_flags),
+		UINT("pud_mapped", vma->pud_mapped), UINT("pmd_mapped", vma->pmd_mapped),
+		UINT("pte_mapped", vma->pte_mapped), UINT("swapped", vma->swapped),
+		UINT("none", vma->none),
+	};
+
+	write_record(w, fields, ARRAY_SIZE(fields));
+}
+
+void ptwalk_write_kernel_range(struct ptwalk_writer *w, const struct page_table_kernel_range *r)
+{
+	static const char * const names[PAGE_TABLE_KERNEL_NR_RANGES] = {
+		[PAGE_TABLE_KERNEL_LINEAR] = "linear",
+		[PAGE_TABLE_KERNEL_VMALLOC] = "vmalloc",
+		[PAGE_TABLE_KERNEL_MODULES] = "modules",
+	};
+	struct field fields[] = {
+		STR("range", r->id < PAGE_TABLE_KERNEL_NR_RANGES ? names[r->id] : "?"),
+		HEX("start", r->start), HEX("end", r->end),
+		UINT("pud_mapped", r->pud_mapped), UINT("pmd_mapped", r->pmd_mapped),
+		UINT("pte_mapped", r->pte_mapped), UINT("pmd_tables", r->pmd_tables),
+		UINT("pte_tables", r->pte_tables),
+	};
+
+	write_record(w, fields, ARRAY_SIZE(fields));
+}
@@ -0,0 +1,88 @@
+/*
+ * libptwalk - user space interface of the page_table_walker module.
+ *
+ * A struct ptwalk keeps one file of the device open for all the queries made through it, which
+ * may also be bound to a process (ptwalk_bind()). Functions return 0 or a negative errno; a pid of
+ * 0 means the caller, or the bound process.
+ */
+
+#ifndef LIBPTWALK_H
+#define LIBPTWALK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "page_table_query.h"
+
+#define PTWALK_DEVICE_PATH	"/dev/page_table_walker"
+
+struct ptwalk;
+
+struct ptwalk *ptwalk_open(void);
+void ptwalk_close(struct ptwalk *pw);
+int ptwalk_fd(const struct ptwalk *pw);
+
+int ptwalk_bind(struct ptwalk *pw, pid_t pid);
+int ptwalk_unbind(struct ptwalk *pw);
+
+/* every entry walked through for one address, flags: PAGE_TABLE_QUERY_* */
+int ptwalk_query(struct ptwalk *pw, pid_t pid, uint64_t va, unsigned int flags,
+		 struct page_table_query *query);
+
+/*
+ * Translate count addresses, from an array or start, start + stride, ... (ptwalk_translate_range),
+ * flags: PAGE_TABLE_BATCH_LOCKLESS.
+ */
+int ptwalk_translate(struct ptwalk *pw, pid_t pid, const uint64_t *vas, size_t count,
+		     unsigned int flags, struct page_table_entry *results);
+int ptwalk_translate_range(struct ptwalk *pw, pid_t pid, uint64_t start, uint64_t stride,
+			   size_t count, unsigned int flags, struct page_table_entry *results);
+
+/*
+ * Call fn for every run of [start, end), or every VMA, as many ioctls as needed; a non-zero value
+ * returned by fn stops the iteration and is returned. flags: PAGE_TABLE_RANGE_*.
+ */
+typedef int (*ptwalk_run_fn)(const struct page_table_run *run, void *arg);
+typedef int (*ptwalk_vma_fn)(const struct page_table_vma *vma, void *arg);
+
+int ptwalk_for_each_run(struct ptwalk *pw, pid_t pid, uint64_t start, uint64_t end,
+			unsigned int flags, ptwalk_run_fn fn, void *arg);
+int ptwalk_for_each_vma(struct ptwalk *pw, pid_t pid, uint64_t start, uint64_t end,
+			ptwalk_vma_fn fn, void *arg);
+
+int ptwalk_kernel(struct ptwalk *pw, struct page_table_kernel *kernel);
+
+/*
+ * Names of the attribute bits set in an entry, '|' separated, for the architecture the library is
+ * built for: x86_64 and arm64 (4K granule), the raw value otherwise. page_shift tells a leaf
+ * (and its size) from a table entry (0), some bits depend on it. Returns the length of the
+ * string, truncated to size.
+ */
+size_t ptwalk_decode_entry(uint64_t entry, unsigned int page_shift, char *buf, size_t size);
+/* the same for the PAGE_TABLE_RUN_* flags of a run */
+size_t ptwalk_decode_run_flags(uint32_t flags, char *buf, size_t size);
+
+/* one output stream of records of the same kind, as CSV (with a header line) or a JSON array */
+enum ptwalk_format {
+	PTWALK_CSV,
+	PTWALK_JSON,
+};
+
+struct ptwalk_writer {
+	FILE *out;
+	enum ptwalk_format format;
+	unsigned long records;
+};
+
+void ptwalk_writer_init(struct ptwalk_writer *w, FILE *out, enum ptwalk_format format);
+void ptwalk_write_query(struct ptwalk_writer *w, const struct page_table_query *query);
+void ptwalk_write_entry(struct ptwalk_writer *w, const struct page_table_entry *entry);
+void ptwalk_write_run(struct ptwalk_writer *w, const struct page_table_run *run);
+void ptwalk_write_vma(struct ptwalk_writer *w, const struct page_table_vma *vma);
+void ptwalk_write_kernel_range(struct ptwalk_writer *w, const struct page_table_kernel_range *range);
+/* closes the JSON array */
+void ptwalk_writer_finish(struct ptwalk_writer *w);
+
+#endif
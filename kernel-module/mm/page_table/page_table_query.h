@@ -4,14 +4,23 @@
 #include <linux/types.h>
 #include <linux/ioctl.h>
 
+/*
+ * page_table_query.flags: walk without the mmap lock, unless the walk races with a change or the
+ * kernel cannot walk another process safely that way (see README.md)
+ */
+#define PAGE_TABLE_QUERY_LOCKLESS	(1U << 0)
+
 struct page_table_query {
 	/* filled by user */
 	__u32 pid;
+	__u32 flags;
 	__u64 va;
 
 	/* filled by kernel module */
 	/* the number of translation levels walked through */
 	__u32 num_levels;
+	/* 1 if answered without taking the mmap lock */
+	__u32 lockless;
 	/* kernel linear addresses */
 	__u64 pgd_table_kla;
 	__u64 pgd_entry_kla;
@@ -31,6 +40,246 @@ struct page_table_query {
 	__u64 kla_start;
 } __attribute__((aligned(8)));
 
-#define PAGE_TABLE_QUERY	_IOWR('x', 0, struct page_table_query)
+/* the translation of one address of a batch */
+struct page_table_entry {
+	__u64 va;
+	/* physical address, 0 if not mapped */
+	__u64 pa;
+	/* the last entry walked through: the leaf (pte, pmd or pud) if the address is mapped */
+	__u64 entry;
+	__u32 num_levels;
+	/* size of the leaf mapping (e.g. 12, 21, 30 on x86_64), 0 if not mapped */
+	__u32 page_shift;
+} __attribute__((aligned(8)));
+
+/* page_table_batch.flags: translate start, start + stride, ... instead of a list of addresses */
+#define PAGE_TABLE_BATCH_RANGE		(1U << 0)
+/* as PAGE_TABLE_QUERY_LOCKLESS, the mmap lock is only taken for addresses whose walk raced */
+#define PAGE_TABLE_BATCH_LOCKLESS	(1U << 1)
+
+/*
+ * Translate count addresses of one process in a single call. The results array holds count
+ * entries. On failure (e.g. a fatal signal), done tells how many results were written.
+ */
+struct page_table_batch {
+	/* filled by user */
+	__u32 pid;
+	__u32 flags;
+	/* user pointer to an array of count __u64 addresses, without PAGE_TABLE_BATCH_RANGE */
+	__u64 vas;
+	/* with PAGE_TABLE_BATCH_RANGE */
+	__u64 start;
+	__u64 stride;
+	__u64 count;
+	/* user pointer to an array of count struct page_table_entry */
+	__u64 results;
+
+	/* filled by kernel module */
+	__u64 done;
+} __attribute__((aligned(8)));
+
+/* page_table_run.flags */
+#define PAGE_TABLE_RUN_WRITE	(1U << 0)
+#define PAGE_TABLE_RUN_DIRTY	(1U << 1)
+#define PAGE_TABLE_RUN_YOUNG	(1U << 2)
+/* mapped by the PFN only (VM_PFNMAP, zero page), without a struct page reference */
+#define PAGE_TABLE_RUN_SPECIAL	(1U << 3)
+
+/*
+ * count leaf entries of the same size and flags, mapping va onwards to pa onwards: both virtually
+ * and physically contiguous
+ */
+struct page_table_run {
+	__u64 va;
+	__u64 pa;
+	__u64 count;
+	__u32 page_shift;
+	__u32 flags;
+} __attribute__((aligned(8)));
+
+/* page_table_range.flags: tell runs apart by their accessed and dirty bits as well */
+#define PAGE_TABLE_RANGE_AD	(1U << 0)
+
+/*
+ * Describe the mappings of [start, end) of one process as runs of leaf entries, unmapped holes
+ * left out. Huge leaves are reported whole, even if start or end falls inside them. If the runs
+ * array is too small, the call stops early: next tells where to start the following call, end if
+ * the range was walked entirely.
+ */
+struct page_table_range {
+	/* filled by user */
+	__u32 pid;
+	__u32 flags;
+	__u64 start;
+	__u64 end;
+	/* user pointer to an array of max_runs struct page_table_run */
+	__u64 runs;
+	__u64 max_runs;
+
+	/* filled by kernel module */
+	__u64 nr_runs;
+	__u64 next;
+	/* bytes mapped by the runs */
+	__u64 mapped;
+} __attribute__((aligned(8)));
+
+/* the mappings of one VMA (clipped to the queried range), in bytes */
+struct page_table_vma {
+	__u64 start;
+	__u64 end;
+	/* the raw kernel vm_flags: VM_READ, VM_WRITE, VM_EXEC, VM_SHARED, VM_HUGEPAGE, ... */
+	__u64 vm_flags;
+	/* present, by size of the leaf entry mapping them */
+	__u64 pud_mapped;
+	__u64 pmd_mapped;
+	__u64 pte_mapped;
+	/* not present: swap or migration entries, and no entry at all */
+	__u64 swapped;
+	__u64 none;
+} __attribute__((aligned(8)));
+
+/*
+ * Summarize the page size and residency of every VMA of [start, end) of one process. As for
+ * page_table_range, next tells where to start the following call when the vmas array is too small.
+ */
+struct page_table_vmas {
+	/* filled by user */
+	__u32 pid;
+	/* none defined yet, must be 0 */
+	__u32 flags;
+	__u64 start;
+	__u64 end;
+	/* user pointer to an array of max_vmas struct page_table_vma */
+	__u64 vmas;
+	__u64 max_vmas;
+
+	/* filled by kernel module */
+	__u64 nr_vmas;
+	__u64 next;
+} __attribute__((aligned(8)));
+
+/* page_table_bind.flags: drop the binding instead */
+#define PAGE_TABLE_UNBIND	(1U << 0)
+
+/*
+ * Bind the open file to the address space of pid (0: the caller). Queries on the file with pid 0
+ * or the bound pid then use it without looking the process up again, and fail with ESRCH once the
+ * process has exited or exec'd; other pids are looked up as usual. Binding again replaces it.
+ */
+struct page_table_bind {
+	__u32 pid;
+	__u32 flags;
+} __attribute__((aligned(8)));
+
+/* page_table_event.type */
+#define PAGE_TABLE_EVENT_MAPPED		1
+#define PAGE_TABLE_EVENT_UNMAPPED	2
+/* another physical page, on the same node (e.g. copy-on-write, compaction) */
+#define PAGE_TABLE_EVENT_MOVED		3
+/* another physical page, on another node */
+#define PAGE_TABLE_EVENT_MIGRATED	4
+/* now mapped by a smaller leaf (the physical page may have changed as well) */
+#define PAGE_TABLE_EVENT_SPLIT		5
+/* now mapped by a larger leaf */
+#define PAGE_TABLE_EVENT_COLLAPSED	6
+/* the watched process exited or exec'd, the watch is over */
+#define PAGE_TABLE_EVENT_EXIT		7
+
+/*
+ * A change seen by a watch between two scans, for nr_pages consecutive base pages whose old and
+ * new physical addresses are contiguous as well. Unmapped sides have a 0 address and page shift,
+ * and a -1 node.
+ */
+struct page_table_event {
+	/* CLOCK_MONOTONIC start of the scan that saw the change */
+	__u64 time_ns;
+	__u64 va;
+	__u64 nr_pages;
+	__u64 old_pa;
+	__u64 pa;
+	__u32 type;
+	__u32 old_page_shift;
+	__u32 page_shift;
+	__s32 old_nid;
+	__s32 nid;
+	__u32 pad;
+} __attribute__((aligned(8)));
+
+/*
+ * The header of the ring mapped from the device: mmap() of at least two pages at offset 0 sets it
+ * up, events_offset bytes in come nr_events (a power of 2) events. The kernel module pushes event
+ * head % nr_events then advances head; user space consumes up to head then advances tail. Events
+ * pushed while the ring is full are counted in lost instead.
+ */
+struct page_table_ring {
+	__u32 nr_events;
+	__u32 event_size;
+	__u64 events_offset;
+	__u64 head;
+	__u64 tail;
+	__u64 lost;
+	/* scans done by the watch, the first one being the baseline */
+	__u64 scans;
+} __attribute__((aligned(8)));
+
+/* page_table_watch.flags: stop the watch instead */
+#define PAGE_TABLE_WATCH_STOP	(1U << 0)
+
+/*
+ * Walk [start, end) of pid (0: the caller, or the process bound) every interval_ms and push the
+ * changes to the ring of the file, which must be mapped first. Watching again replaces the watch.
+ * poll() on the file tells when events are waiting.
+ */
+struct page_table_watch {
+	__u32 pid;
+	__u32 flags;
+	__u64 start;
+	__u64 end;
+	__u32 interval_ms;
+	__u32 pad;
+} __attribute__((aligned(8)));
+
+/* page_table_kernel_range.id */
+#define PAGE_TABLE_KERNEL_LINEAR	0
+#define PAGE_TABLE_KERNEL_VMALLOC	1
+#define PAGE_TABLE_KERNEL_MODULES	2
+#define PAGE_TABLE_KERNEL_NR_RANGES	3
+
+/* how a range of the kernel address space is mapped, empty if the range does not exist */
+struct page_table_kernel_range {
+	__u32 id;
+	__u32 pad;
+	__u64 start;
+	__u64 end;
+	/* bytes mapped by leaves of each size: 1G, 2M and 4K on x86_64 */
+	__u64 pud_mapped;
+	__u64 pmd_mapped;
+	__u64 pte_mapped;
+	/* 1G and 2M regions with mappings of a smaller size: a split direct map shows here */
+	__u64 pmd_tables;
+	__u64 pte_tables;
+} __attribute__((aligned(8)));
+
+/* the kernel address space, as seen from the page table of the caller (x86 only, root only) */
+struct page_table_kernel {
+	/* none defined yet, must be 0 */
+	__u32 flags;
+	/* filled by kernel module */
+	__u32 nr_ranges;
+	struct page_table_kernel_range ranges[PAGE_TABLE_KERNEL_NR_RANGES];
+} __attribute__((aligned(8)));
+
+/*
+ * flags and lockless of page_table_query were padding before: the former number is still
+ * answered, without looking at flags
+ */
+#define PAGE_TABLE_QUERY_V0	_IOWR('x', 0, struct page_table_query)
+#define PAGE_TABLE_QUERY	_IOWR('x', 7, struct page_table_query)
+#define PAGE_TABLE_QUERY_BATCH	_IOWR('x', 1, struct page_table_batch)
+#define PAGE_TABLE_QUERY_RANGE	_IOWR('x', 2, struct page_table_range)
+#define PAGE_TABLE_QUERY_VMAS	_IOWR('x', 3, struct page_table_vmas)
+#define PAGE_TABLE_BIND		_IOW('x', 4, struct page_table_bind)
+#define PAGE_TABLE_WATCH	_IOW('x', 5, struct page_table_watch)
+#define PAGE_TABLE_QUERY_KERNEL	_IOWR('x', 6, struct page_table_kernel)
 
 #endif
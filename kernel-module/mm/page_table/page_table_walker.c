@@ -3,10 +3,10 @@
  * page_table_walker.c – a demo to walk page table.
  *
  * The code work under a presumption: no device mapping is used.
- * TODO kernel page table walk
  * TODO huge zero page
  * TODO Documentation/mm/split_page_table_lock.rst
- * TODO the exported walk_page_table
+ * walk_page_range() is not exported to modules: the range walk below follows its structure
+ * (VMA by VMA, then pXd_addr_end() steps down to the leaves) by hand.
  */
 
 #include <linux/module.h>
@@ -18,11 +18,32 @@
 #include <linux/mm.h>
 #include <linux/pid.h>
 #include <linux/sched.h>
+#include <linux/sched/signal.h>
+#include <linux/slab.h>
+#include <linux/minmax.h>
+#include <linux/mmap_lock.h>
+#include <linux/rcupdate.h>
+#include <linux/spinlock.h>
+#include <linux/sched/mm.h>
+#include <linux/mutex.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/pfn.h>
+#include <linux/capability.h>
 
 #include "page_table_query.h"
 
 #define DEVICE_NAME	"page_table_walker"
 
+/* addresses translated per mmap lock hold in a batch */
+#define BATCH_CHUNK	256
+/* runs buffered in the kernel by a range walk before being copied out */
+#define RANGE_CHUNK	256
+
 #ifdef pr_fmt
 #undef pr_fmt
 #endif
@@ -57,117 +78,1470 @@ static struct mm_struct *get_mm_by_pid(pid_t pid)
 	return mm;
 }
 
-static int query_page_table(struct page_table_query *query)
-{
-	// TODO is READ_ONCE really necessary?
-	// TODO why sometimes none is used, and some times none and !present are both checked?
-	// TODO make sure when !present and !none, the PFN is still in place
-	struct mm_struct *mm;
+/* the entries met while walking the page table of one virtual address */
+struct pt_walk {
 	/* Pointers and values of a translation descriptor are so heavily used that usually we need
 	 * variables for both of them. To distinguish them the kernel has such naming conventions:
 	 *  a. pointer: ptep,   entry value: pte
 	 *  b. pointer: pte,    entry value: ptent
 	 * here we choose the former
 	 */
-	pgd_t *pgdp = NULL, pgd = {};
-	p4d_t *p4dp = NULL, p4d = {};
-	pud_t *pudp = NULL, pud = {};
-	pmd_t *pmdp = NULL, pmd = {};
-	pte_t *ptep = NULL, pte = {};
-	unsigned long vaddr, paddr = 0;
-
-	if (query->pid)
-		mm = get_mm_by_pid((pid_t)query->pid);
+	pgd_t *pgdp, pgd;
+	p4d_t *p4dp, p4d;
+	pud_t *pudp, pud;
+	pmd_t *pmdp, pmd;
+	pte_t *ptep, pte;
+	/* the number of translation levels walked through */
+	unsigned int num_levels;
+	/* size of the leaf mapping, 0 if the address is not mapped */
+	unsigned int page_shift;
+	unsigned long pa;
+};
+
+/* the caller holds the mmap lock of mm */
+static void walk_va(struct mm_struct *mm, unsigned long vaddr, struct pt_walk *walk)
+{
+	// TODO is READ_ONCE really necessary?
+	// TODO why sometimes none is used, and some times none and !present are both checked?
+	memset(walk, 0, sizeof(*walk));
+
+	walk->num_levels += 1;
+	walk->pgdp = pgd_offset(mm, vaddr);
+	walk->pgd = pgdp_get(walk->pgdp);
+	if (pgd_none(walk->pgd) || unlikely(pgd_bad(walk->pgd)))
+		return;
+
+	walk->num_levels += 1;
+	walk->p4dp = p4d_offset(walk->pgdp, vaddr);
+	walk->p4d = p4dp_get(walk->p4dp);
+	if (p4d_none(walk->p4d) || unlikely(p4d_bad(walk->p4d)))
+		return;
+
+	walk->num_levels += 1;
+	walk->pudp = pud_offset(walk->p4dp, vaddr);
+	walk->pud = pudp_get(walk->pudp);
+	if (pud_none(walk->pud) || !pud_present(walk->pud))
+		return;
+	/* a leaf before *_bad(): on x86, the PSE bit of a leaf makes the entry look bad */
+	if (pud_leaf(walk->pud)) {
+		walk->pa = (pud_pfn(walk->pud) << PAGE_SHIFT) + (vaddr & ~PUD_MASK);
+		walk->page_shift = PUD_SHIFT;
+		return;
+	}
+	if (unlikely(pud_bad(walk->pud)))
+		return;
+
+	walk->num_levels += 1;
+	walk->pmdp = pmd_offset(walk->pudp, vaddr);
+	walk->pmd = pmdp_get(walk->pmdp);
+	/* a THP being migrated (or swapped out whole) */
+	if (pmd_none(walk->pmd) || !pmd_present(walk->pmd))
+		return;
+	if (pmd_leaf(walk->pmd)) {
+		walk->pa = (pmd_pfn(walk->pmd) << PAGE_SHIFT) + (vaddr & ~PMD_MASK);
+		walk->page_shift = PMD_SHIFT;
+		return;
+	}
+	if (unlikely(pmd_bad(walk->pmd)))
+		return;
+
+	walk->num_levels += 1;
+	/* An alternative to pte_offset_kernel() (but not exported): pte_offset_map_lock. The table is
+	 * found from the pmd value checked above, not from a second read that may see another one.
+	 * The mmap lock does not keep it allocated: a khugepaged collapse frees it after an RCU grace
+	 * period, so it is read inside an RCU read-side section. */
+	rcu_read_lock();
+	walk->ptep = pte_offset_kernel(&walk->pmd, vaddr);
+	walk->pte = ptep_get(walk->ptep);
+	rcu_read_unlock();
+	/* swap and migration entries are not none either, but hold no PFN */
+	if (!pte_present(walk->pte))
+		return;
+	walk->pa = (pte_pfn(walk->pte) << PAGE_SHIFT) + (vaddr & ~PAGE_MASK);
+	walk->page_shift = PAGE_SHIFT;
+}
+
+/* lockless walks rely on what fast GUP relies on, CONFIG_HAVE_FAST_GUP was renamed in 6.9 */
+#if defined(CONFIG_HAVE_FAST_GUP) || defined(CONFIG_HAVE_GUP_FAST)
+#define HAVE_LOCKLESS_WALK	true
+#else
+#define HAVE_LOCKLESS_WALK	false
+#endif
+
+/*
+ * Walk without the mmap lock, as get_user_pages_fast() does. With interrupts disabled, page tables
+ * unlinked by munmap() or a THP collapse cannot be freed under the walk, provided they go away
+ * after something that waits for us:
+ * - an RCU grace period, with CONFIG_MMU_GATHER_RCU_TABLE_FREE, whatever the mm
+ * - otherwise a TLB shootdown IPI, which only reaches the CPUs in mm_cpumask(): as for fast GUP,
+ *   that covers us only when walking our own mm
+ * Other walks are done under the mmap lock. Entries may still change, so a walk that went through
+ * a PTE table checks afterwards that the pmd still points to it. Returns false if the walk was
+ * not done or raced with a change: the caller then walks again under the mmap lock.
+ */
+static bool walk_va_lockless(struct mm_struct *mm, unsigned long vaddr, struct pt_walk *walk)
+{
+	unsigned long flags;
+	bool ret = true;
+
+	if (!HAVE_LOCKLESS_WALK)
+		return false;
+	if (mm != current->mm && !IS_ENABLED(CONFIG_MMU_GATHER_RCU_TABLE_FREE))
+		return false;
+
+	local_irq_save(flags);
+	walk_va(mm, vaddr, walk);
+	if (walk->ptep && !pmd_same(walk->pmd, pmdp_get(walk->pmdp)))
+		ret = false;
+	local_irq_restore(flags);
+	return ret;
+}
+
+struct pt_watch;
+
+/*
+ * An open file of the device, optionally bound to the mm of a process so that queries skip the
+ * pid -> task -> mm lookup. The session holds an mmgrab() reference only: the mm_struct stays
+ * allocated, but the address space is torn down as usual when the process exits (or execs), after
+ * which queries fail with -ESRCH.
+ */
+struct walker_session {
+	spinlock_t lock;
+	/* the bound mm, NULL if unbound */
+	struct mm_struct *mm;
+	pid_t pid;
+
+	/* serializes the setup of the ring and of the watch */
+	struct mutex mutex;
+	/* the ring mapped by user space, and its producer side, only written by the watch */
+	struct page_table_ring *ring;
+	u64 ring_size;
+	u64 ring_head;
+	struct pt_watch *watch;
+	/* woken up after every scan of the watch */
+	wait_queue_head_t wait;
+};
+
+/* bind the session to the mm of pid (0: the caller), or unbind it if bind->flags says so */
+static int bind_session(struct walker_session *session, struct page_table_bind *bind)
+{
+	struct mm_struct *mm = NULL, *old;
+	pid_t pid = 0;
+
+	if (bind->flags & ~PAGE_TABLE_UNBIND)
+		return -EINVAL;
+
+	if (!(bind->flags & PAGE_TABLE_UNBIND)) {
+		pid = bind->pid ? (pid_t)bind->pid : task_tgid_vnr(current);
+		mm = bind->pid ? get_mm_by_pid(pid) : get_task_mm(current);
+		if (!mm)
+			return -ESRCH;
+		/* pin the structure, not the address space */
+		mmgrab(mm);
+		mmput(mm);
+	}
+
+	spin_lock(&session->lock);
+	old = session->mm;
+	session->mm = mm;
+	session->pid = pid;
+	spin_unlock(&session->lock);
+
+	if (old)
+		mmdrop(old);
+	return 0;
+}
+
+/*
+ * The mm a query is about: the bound one if pid is 0 or the bound pid, the one of pid, or the
+ * caller's if pid is 0 and the session is not bound. Release it with mmput().
+ */
+static struct mm_struct *get_query_mm(struct walker_session *session, __u32 pid)
+{
+	struct mm_struct *mm = NULL;
+	bool bound = false;
+
+	spin_lock(&session->lock);
+	if (session->mm && (!pid || (pid_t)pid == session->pid)) {
+		bound = true;
+		pid = session->pid;
+		/* the address space is gone once its users are */
+		if (mmget_not_zero(session->mm))
+			mm = session->mm;
+	}
+	spin_unlock(&session->lock);
+	if (bound) {
+		if (!mm)
+			pr_err_ratelimited("the process bound (pid=%u) exited.\n", pid);
+		return mm;
+	}
+
+	if (pid)
+		mm = get_mm_by_pid((pid_t)pid);
 	else
 		mm = get_task_mm(current);
-	if (!mm) {
-		pr_err("failed to get mm_struct by pid=%u.\n", query->pid);
+	if (!mm)
+		pr_err("failed to get mm_struct by pid=%u.\n", pid);
+	return mm;
+}
+
+static int query_page_table(struct walker_session *session, struct page_table_query *query)
+{
+	struct mm_struct *mm;
+	struct pt_walk walk;
+
+	if (query->flags & ~PAGE_TABLE_QUERY_LOCKLESS)
+		return -EINVAL;
+	if ((query->flags & PAGE_TABLE_QUERY_LOCKLESS) && !HAVE_LOCKLESS_WALK)
+		return -EOPNOTSUPP;
+
+	mm = get_query_mm(session, query->pid);
+	if (!mm)
 		return -ESRCH;
+
+	query->lockless = (query->flags & PAGE_TABLE_QUERY_LOCKLESS) &&
+			  walk_va_lockless(mm, query->va, &walk);
+	if (!query->lockless) {
+		mmap_read_lock(mm);
+		walk_va(mm, query->va, &walk);
+		mmap_read_unlock(mm);
 	}
+	query->pgd_table_kla = (uintptr_t)mm->pgd;
 
-	vaddr = query->va;
+	mmput(mm);
 
-	query->num_levels = 0;
-	mmap_read_lock(mm);
+	query->num_levels = walk.num_levels;
+	query->pgd_entry_kla = (uintptr_t)walk.pgdp;
+	query->p4d_entry_kla = (uintptr_t)walk.p4dp;
+	query->pud_entry_kla = (uintptr_t)walk.pudp;
+	query->pmd_entry_kla = (uintptr_t)walk.pmdp;
+	query->pte_entry_kla = (uintptr_t)walk.ptep;
+	query->pgd_entry = pgd_val(walk.pgd);
+	query->p4d_entry = p4d_val(walk.p4d);
+	query->pud_entry = pud_val(walk.pud);
+	query->pmd_entry = pmd_val(walk.pmd);
+	query->pte_entry = pte_val(walk.pte);
+	query->pa = walk.pa;
+	query->kla_start = PAGE_OFFSET;
 
-	query->num_levels += 1;
-	pgdp = pgd_offset(mm, vaddr);
-	pgd = pgdp_get(pgdp);
-	if (pgd_none(pgd) || unlikely(pgd_bad(pgd)))
-		goto out;
+	return 0;
+}
 
-	query->num_levels += 1;
-	p4dp = p4d_offset(pgdp, vaddr);
-	p4d = p4dp_get(p4dp);
-	if (p4d_none(p4d) || unlikely(p4d_bad(p4d)))
-		goto out;
+/* the last entry read by a walk: the leaf if the address is mapped */
+static __u64 last_entry(const struct pt_walk *walk)
+{
+	switch (walk->num_levels) {
+	case 1:
+		return pgd_val(walk->pgd);
+	case 2:
+		return p4d_val(walk->p4d);
+	case 3:
+		return pud_val(walk->pud);
+	case 4:
+		return pmd_val(walk->pmd);
+	default:
+		return pte_val(walk->pte);
+	}
+}
 
-	query->num_levels += 1;
-	pudp = pud_offset(p4dp, vaddr);
-	pud = pudp_get(pudp);
-	if (pud_none(pud) || unlikely(pud_bad(pud)))
-		goto out;
-	if (pud_leaf(pud)) {
-		paddr = (pud_pfn(pud) << PAGE_SHIFT) + (vaddr & ~PUD_MASK);
-		goto out;
+/*
+ * Translate n addresses. Lockless walks are tried first if asked to, the mmap lock is only taken
+ * (once for the chunk) for those that raced with a change of the page table.
+ */
+static int translate_chunk(struct mm_struct *mm, const __u64 *vas,
+			   struct page_table_entry *results, u64 n, bool lockless)
+{
+	bool locked = false;
+	struct pt_walk walk;
+	u64 i;
+
+	for (i = 0; i < n; i++) {
+		if (locked || !lockless || !walk_va_lockless(mm, vas[i], &walk)) {
+			if (!locked && mmap_read_lock_killable(mm))
+				return -EINTR;
+			locked = true;
+			walk_va(mm, vas[i], &walk);
+		}
+		results[i].va = vas[i];
+		results[i].pa = walk.pa;
+		results[i].entry = last_entry(&walk);
+		results[i].num_levels = walk.num_levels;
+		results[i].page_shift = walk.page_shift;
 	}
+	if (locked)
+		mmap_read_unlock(mm);
+	return 0;
+}
 
-	query->num_levels += 1;
-	pmdp = pmd_offset(pudp, vaddr);
-	pmd = pmdp_get(pmdp);
-	if (pmd_none(pmd) || unlikely(pmd_bad(pmd)))
-		goto out;
-	if (pmd_leaf(pmd)) {
-		paddr = (pmd_pfn(pmd) << PAGE_SHIFT) + (vaddr & ~PMD_MASK);
-		goto out;
+/*
+ * Translate count addresses under a single mm reference. Addresses are copied in and results out
+ * BATCH_CHUNK at a time with the mmap lock released: user memory must not be touched under the
+ * lock (faulting on it would take the lock again), and the lock is never held for more than a
+ * chunk of walks, so writers (mmap, page faults) of the target are not starved by long batches.
+ */
+static int query_page_table_batch(struct walker_session *session, struct page_table_batch *batch)
+{
+	__u64 __user *uvas = u64_to_user_ptr(batch->vas);
+	struct page_table_entry __user *uresults = u64_to_user_ptr(batch->results);
+	struct page_table_entry *results;
+	struct mm_struct *mm;
+	__u64 *vas;
+	u64 i, n, done;
+	int ret = 0;
+
+	batch->done = 0;
+	if (batch->flags & ~(PAGE_TABLE_BATCH_RANGE | PAGE_TABLE_BATCH_LOCKLESS))
+		return -EINVAL;
+	if ((batch->flags & PAGE_TABLE_BATCH_RANGE) && !batch->stride)
+		return -EINVAL;
+	if ((batch->flags & PAGE_TABLE_BATCH_LOCKLESS) && !HAVE_LOCKLESS_WALK)
+		return -EOPNOTSUPP;
+
+	vas = kmalloc_array(BATCH_CHUNK, sizeof(*vas), GFP_KERNEL);
+	results = kmalloc_array(BATCH_CHUNK, sizeof(*results), GFP_KERNEL);
+	if (!vas || !results) {
+		ret = -ENOMEM;
+		goto out_free;
 	}
 
-	query->num_levels += 1;
-	/* An alternative to pte_offset_kernel() (but not exported): pte_offset_map_lock. I suppose
-	 * it is safe to call pte_offset_kernel here since we held mmap_read_lock.*/
-	ptep = pte_offset_kernel(pmdp, vaddr);
-	pte = ptep_get(ptep);
-	if (pte_none(pte))
+	mm = get_query_mm(session, batch->pid);
+	if (!mm) {
+		ret = -ESRCH;
+		goto out_free;
+	}
+
+	for (done = 0; done < batch->count; done += n) {
+		n = min_t(u64, batch->count - done, BATCH_CHUNK);
+
+		if (batch->flags & PAGE_TABLE_BATCH_RANGE) {
+			for (i = 0; i < n; i++)
+				vas[i] = batch->start + (done + i) * batch->stride;
+		} else if (copy_from_user(vas, uvas + done, n * sizeof(*vas))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		ret = translate_chunk(mm, vas, results, n, batch->flags & PAGE_TABLE_BATCH_LOCKLESS);
+		if (ret)
+			break;
+
+		if (copy_to_user(uresults + done, results, n * sizeof(*results))) {
+			ret = -EFAULT;
+			break;
+		}
+		batch->done = done + n;
+
+		if (fatal_signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+		cond_resched();
+	}
+
+	mmput(mm);
+out_free:
+	kfree(results);
+	kfree(vas);
+	return ret;
+}
+
+struct range_walk;
+
+/*
+ * What a range walk does with the entries it finds, in the spirit of struct mm_walk_ops. A
+ * callback returning false stops the walk with walk->next set to the address to resume from: the
+ * mmap lock is released, results are flushed, and the walk resumes there unless walk->stop is set.
+ */
+struct range_walk_ops {
+	/* entering [addr, end) of a VMA, or resuming inside it (optional) */
+	bool (*vma)(struct range_walk *walk, struct vm_area_struct *vma, unsigned long addr,
+		    unsigned long end);
+	/* a present leaf entry, reported whole even if the range starts or ends inside it */
+	bool (*leaf)(struct range_walk *walk, unsigned long va, unsigned long pa,
+		     unsigned int page_shift, __u32 flags);
+	/* [addr, end) is not present: swapped out or migrating, or not populated (optional) */
+	void (*hole)(struct range_walk *walk, unsigned long addr, unsigned long end, bool swapped);
+	/* called with the mmap lock released, done once the range has been walked */
+	int (*flush)(struct range_walk *walk, bool done);
+};
+
+/* state of a range walk, kept across mmap lock releases */
+struct range_walk {
+	struct mm_struct *mm;
+	const struct range_walk_ops *ops;
+	void *private;
+	/* where to resume when a walk stops early */
+	unsigned long next;
+	/* not to be resumed, e.g. the user buffer is full */
+	bool stop;
+	/* give way after every PTE table, not only when someone waits: interrupts are disabled */
+	bool table_at_a_time;
+};
+
+/* PAGE_TABLE_RUN_* flags of a leaf; dirty and young are reported, run_leaf() may mask them */
+static __u32 pte_run_flags(pte_t pte)
+{
+	__u32 flags = 0;
+
+	if (pte_write(pte))
+		flags |= PAGE_TABLE_RUN_WRITE;
+	if (pte_special(pte))
+		flags |= PAGE_TABLE_RUN_SPECIAL;
+	if (pte_dirty(pte))
+		flags |= PAGE_TABLE_RUN_DIRTY;
+	if (pte_young(pte))
+		flags |= PAGE_TABLE_RUN_YOUNG;
+	return flags;
+}
+
+static __u32 pmd_run_flags(pmd_t pmd)
+{
+	__u32 flags = 0;
+
+	if (pmd_write(pmd))
+		flags |= PAGE_TABLE_RUN_WRITE;
+	if (pmd_dirty(pmd))
+		flags |= PAGE_TABLE_RUN_DIRTY;
+	if (pmd_young(pmd))
+		flags |= PAGE_TABLE_RUN_YOUNG;
+	return flags;
+}
+
+static __u32 pud_run_flags(pud_t pud)
+{
+	__u32 flags = 0;
+
+	if (pud_write(pud))
+		flags |= PAGE_TABLE_RUN_WRITE;
+	if (pud_dirty(pud))
+		flags |= PAGE_TABLE_RUN_DIRTY;
+	if (pud_young(pud))
+		flags |= PAGE_TABLE_RUN_YOUNG;
+	return flags;
+}
+
+static void walk_hole(struct range_walk *walk, unsigned long addr, unsigned long end,
+		      bool swapped)
+{
+	if (walk->ops->hole)
+		walk->ops->hole(walk, addr, end, swapped);
+}
+
+/*
+ * PTE tables may be freed under the mmap read lock (khugepaged collapses), but only after an RCU
+ * grace period: the table is read inside an RCU read-side section. As in __pte_offset_map(), the
+ * pmd is read again inside it and the table found from that snapshot; if the pmd no longer
+ * points to a PTE table, *again asks the caller to look at the entry again.
+ */
+static bool walk_pte_range(struct range_walk *walk, pmd_t *pmdp, unsigned long addr,
+			   unsigned long end, bool *again)
+{
+	bool ret = true;
+	pte_t *ptep;
+	pmd_t pmd;
+	pte_t pte;
+
+	rcu_read_lock();
+	pmd = pmdp_get_lockless(pmdp);
+	*again = !pmd_present(pmd) || pmd_leaf(pmd) || pmd_trans_huge(pmd) ||
+		 unlikely(pmd_bad(pmd));
+	if (*again)
 		goto out;
-	paddr = (pte_pfn(pte) << PAGE_SHIFT) + (vaddr & ~PAGE_MASK);
 
+	ptep = pte_offset_kernel(&pmd, addr);
+	for (; addr < end; addr += PAGE_SIZE, ptep++) {
+		pte = ptep_get(ptep);
+		if (!pte_present(pte)) {
+			/* swap and migration entries are not none */
+			walk_hole(walk, addr, addr + PAGE_SIZE, !pte_none(pte));
+			continue;
+		}
+		if (!walk->ops->leaf(walk, addr, pte_pfn(pte) << PAGE_SHIFT, PAGE_SHIFT,
+				     pte_run_flags(pte))) {
+			ret = false;
+			break;
+		}
+	}
 out:
-	query->pgd_table_kla = (uintptr_t)mm->pgd;
+	rcu_read_unlock();
+	return ret;
+}
 
-	mmap_read_unlock(mm);
+static bool walk_pmd_range(struct range_walk *walk, pud_t *pudp, unsigned long addr,
+			   unsigned long end)
+{
+	pmd_t *pmdp = pmd_offset(pudp, addr);
+	unsigned long next;
+	bool again;
+	pmd_t pmd;
 
-	mmput(mm);
+	do {
+		next = pmd_addr_end(addr, end);
+retry:
+		pmd = pmdp_get(pmdp);
+		if (pmd_none(pmd) || !pmd_present(pmd)) {
+			/* a THP being migrated (or swapped out whole) */
+			walk_hole(walk, addr, next, !pmd_none(pmd));
+			continue;
+		}
+		if (pmd_leaf(pmd)) {
+			if (!walk->ops->leaf(walk, addr & PMD_MASK, pmd_pfn(pmd) << PAGE_SHIFT,
+					     PMD_SHIFT, pmd_run_flags(pmd)))
+				return false;
+			continue;
+		}
+		if (unlikely(pmd_bad(pmd)))
+			continue;
+		if (!walk_pte_range(walk, pmdp, addr, next, &again))
+			return false;
+		if (again)
+			goto retry;
 
-	query->pgd_entry_kla = (uintptr_t)pgdp;
-	query->p4d_entry_kla = (uintptr_t)p4dp;
-	query->pud_entry_kla = (uintptr_t)pudp;
-	query->pmd_entry_kla = (uintptr_t)pmdp;
-	query->pte_entry_kla = (uintptr_t)ptep;
-	query->pgd_entry = pgd_val(pgd);
-	query->p4d_entry = p4d_val(p4d);
-	query->pud_entry = pud_val(pud);
-	query->pmd_entry = pmd_val(pmd);
-	query->pte_entry = pte_val(pte);
-	query->pa = paddr;
-	query->kla_start = PAGE_OFFSET;
+		/* bound the lock hold time: give way after a page table if anyone waits */
+		if (next != end && (walk->table_at_a_time || need_resched() ||
+				    mmap_lock_is_contended(walk->mm))) {
+			walk->next = next;
+			return false;
+		}
+	} while (pmdp++, addr = next, addr != end);
+	return true;
+}
 
+static bool walk_pud_range(struct range_walk *walk, p4d_t *p4dp, unsigned long addr,
+			   unsigned long end)
+{
+	pud_t *pudp = pud_offset(p4dp, addr);
+	unsigned long next;
+	pud_t pud;
+
+	do {
+		next = pud_addr_end(addr, end);
+		pud = pudp_get(pudp);
+		if (pud_none(pud) || !pud_present(pud)) {
+			walk_hole(walk, addr, next, !pud_none(pud));
+			continue;
+		}
+		if (pud_leaf(pud)) {
+			if (!walk->ops->leaf(walk, addr & PUD_MASK, pud_pfn(pud) << PAGE_SHIFT,
+					     PUD_SHIFT, pud_run_flags(pud)))
+				return false;
+			continue;
+		}
+		if (unlikely(pud_bad(pud)))
+			continue;
+		if (!walk_pmd_range(walk, pudp, addr, next))
+			return false;
+	} while (pudp++, addr = next, addr != end);
+	return true;
+}
+
+static bool walk_p4d_range(struct range_walk *walk, pgd_t *pgdp, unsigned long addr,
+			   unsigned long end)
+{
+	p4d_t *p4dp = p4d_offset(pgdp, addr);
+	unsigned long next;
+	p4d_t p4d;
+
+	do {
+		next = p4d_addr_end(addr, end);
+		p4d = p4dp_get(p4dp);
+		if (p4d_none(p4d)) {
+			walk_hole(walk, addr, next, false);
+			continue;
+		}
+		if (unlikely(p4d_bad(p4d)))
+			continue;
+		if (!walk_pud_range(walk, p4dp, addr, next))
+			return false;
+	} while (p4dp++, addr = next, addr != end);
+	return true;
+}
+
+static bool walk_pgd_range(struct range_walk *walk, unsigned long addr, unsigned long end)
+{
+	pgd_t *pgdp = pgd_offset(walk->mm, addr);
+	unsigned long next;
+	pgd_t pgd;
+
+	do {
+		next = pgd_addr_end(addr, end);
+		pgd = pgdp_get(pgdp);
+		if (pgd_none(pgd)) {
+			walk_hole(walk, addr, next, false);
+			continue;
+		}
+		if (unlikely(pgd_bad(pgd)))
+			continue;
+		if (!walk_p4d_range(walk, pgdp, addr, next))
+			return false;
+	} while (pgdp++, addr = next, addr != end);
+	return true;
+}
+
+/* walk the VMAs of [start, end) under the mmap lock, until done or told to stop */
+static void walk_vmas(struct range_walk *walk, unsigned long start, unsigned long end)
+{
+	struct vm_area_struct *vma;
+	unsigned long addr, vma_end;
+	VMA_ITERATOR(vmi, walk->mm, start);
+
+	for_each_vma_range(vmi, vma, end) {
+		addr = max(start, vma->vm_start);
+		vma_end = min(end, vma->vm_end);
+		if (walk->ops->vma && !walk->ops->vma(walk, vma, addr, vma_end))
+			return;
+		if (!walk_pgd_range(walk, addr, vma_end))
+			return;
+	}
+	walk->next = end;
+}
+
+/*
+ * Walk [addr, end) of walk->mm. The mmap lock is released whenever the walk stops: every time a
+ * page table has been walked while someone waits for the lock, and whenever a callback asks for it
+ * (e.g. to copy its results out). The walk then resumes from where it stopped.
+ */
+static int walk_range(struct range_walk *walk, unsigned long addr, unsigned long end)
+{
+	int ret;
+
+	while (addr < end) {
+		if (mmap_read_lock_killable(walk->mm))
+			return -EINTR;
+		walk_vmas(walk, addr, end);
+		mmap_read_unlock(walk->mm);
+		addr = walk->next;
+
+		ret = walk->ops->flush(walk, addr >= end || walk->stop);
+		if (ret)
+			return ret;
+		if (walk->stop)
+			break;
+		if (fatal_signal_pending(current))
+			return -EINTR;
+		cond_resched();
+	}
+	return 0;
+}
+
+/* a range query: runs being merged, and the completed ones waiting to be copied out */
+struct run_walk {
+	struct page_table_range *range;
+	struct page_table_run __user *uruns;
+	u64 copied;
+	/* runs completed since the last copy to user space */
+	struct page_table_run *runs;
+	unsigned int nr_runs;
+	/* runs the user buffer can still take, the pending run included */
+	u64 room;
+	/* the run being extended, not counted in runs yet */
+	struct page_table_run cur;
+	bool has_cur;
+	u64 mapped;
+};
+
+/*
+ * Add a leaf mapping to the current run, or start a new run. Stops the walk at va if there is no
+ * room for a new run: the leaf is to be reported again once there is.
+ */
+static bool run_leaf(struct range_walk *walk, unsigned long va, unsigned long pa,
+		     unsigned int page_shift, __u32 flags)
+{
+	struct run_walk *rw = walk->private;
+	struct page_table_run *cur = &rw->cur;
+	unsigned long size = 1UL << page_shift;
+
+	if (!(rw->range->flags & PAGE_TABLE_RANGE_AD))
+		flags &= ~(PAGE_TABLE_RUN_DIRTY | PAGE_TABLE_RUN_YOUNG);
+
+	if (rw->has_cur && cur->page_shift == page_shift && cur->flags == flags &&
+	    cur->va + (cur->count << page_shift) == va &&
+	    cur->pa + (cur->count << page_shift) == pa) {
+		cur->count++;
+		rw->mapped += size;
+		return true;
+	}
+
+	/* the pending run and the new one both need a slot of the user buffer */
+	if (rw->room < 1 + rw->has_cur) {
+		walk->stop = true;
+		walk->next = va;
+		return false;
+	}
+	if (rw->has_cur) {
+		if (rw->nr_runs == RANGE_CHUNK) {
+			walk->next = va;
+			return false;
+		}
+		rw->runs[rw->nr_runs++] = *cur;
+		rw->room--;
+	}
+
+	cur->va = va;
+	cur->pa = pa;
+	cur->count = 1;
+	cur->page_shift = page_shift;
+	cur->flags = flags;
+	rw->has_cur = true;
+	rw->mapped += size;
+	return true;
+}
+
+static int run_flush(struct range_walk *walk, bool done)
+{
+	struct run_walk *rw = walk->private;
+	struct page_table_range *range = rw->range;
+
+	/* the last run goes out with the others once the walk is over */
+	if (done && rw->has_cur) {
+		rw->runs[rw->nr_runs++] = rw->cur;
+		rw->has_cur = false;
+	}
+	if (copy_to_user(rw->uruns + rw->copied, rw->runs, rw->nr_runs * sizeof(*rw->runs)))
+		return -EFAULT;
+	rw->copied += rw->nr_runs;
+	rw->nr_runs = 0;
+
+	range->nr_runs = rw->copied;
+	range->next = walk->next >= range->end ? range->end : walk->next;
+	range->mapped = rw->mapped;
+	/* a pending run is walked again from range->next by the next call if this one stops here */
+	if (rw->has_cur) {
+		range->next = rw->cur.va;
+		range->mapped -= rw->cur.count << rw->cur.page_shift;
+	}
+	return 0;
+}
+
+static const struct range_walk_ops run_walk_ops = {
+	.leaf	= run_leaf,
+	.flush	= run_flush,
+};
+
+/*
+ * Describe the mappings of [start, end) as runs of leaf entries with contiguous virtual and
+ * physical addresses, the same size and the same flags.
+ */
+static int query_page_table_range(struct walker_session *session, struct page_table_range *range)
+{
+	struct run_walk rw = {
+		.range = range,
+		.uruns = u64_to_user_ptr(range->runs),
+		.room = range->max_runs,
+	};
+	struct range_walk walk = {
+		.ops = &run_walk_ops,
+		.private = &rw,
+	};
+	unsigned long addr, end;
+	int ret;
+
+	range->nr_runs = 0;
+	range->mapped = 0;
+	range->next = range->start;
+	if (range->flags & ~PAGE_TABLE_RANGE_AD)
+		return -EINVAL;
+	if (range->start >= range->end || !range->max_runs)
+		return -EINVAL;
+	addr = ALIGN_DOWN(range->start, PAGE_SIZE);
+	end = PAGE_ALIGN(min_t(u64, range->end, TASK_SIZE));
+	/* nothing mapped above the user address space */
+	if (addr >= end) {
+		range->next = range->end;
+		return 0;
+	}
+
+	/* one more slot for the pending run, flushed when the walk ends */
+	rw.runs = kmalloc_array(RANGE_CHUNK + 1, sizeof(*rw.runs), GFP_KERNEL);
+	if (!rw.runs)
+		return -ENOMEM;
+
+	walk.mm = get_query_mm(session, range->pid);
+	if (!walk.mm) {
+		ret = -ESRCH;
+		goto out_free;
+	}
+	ret = walk_range(&walk, addr, end);
+	mmput(walk.mm);
+out_free:
+	kfree(rw.runs);
+	return ret;
+}
+
+/* a VMA histogram query: like a range query, with one record per VMA instead of per run */
+struct vma_walk {
+	struct page_table_vmas *query;
+	struct page_table_vma __user *uvmas;
+	u64 copied;
+	struct page_table_vma *vmas;
+	unsigned int nr_vmas;
+	u64 room;
+	/* the VMA being walked */
+	struct page_table_vma cur;
+	bool has_cur;
+};
+
+/* start a record when entering a VMA, keep adding to it when resuming inside one */
+static bool vma_enter(struct range_walk *walk, struct vm_area_struct *vma, unsigned long addr,
+		      unsigned long end)
+{
+	struct vma_walk *vw = walk->private;
+	struct page_table_vma *cur = &vw->cur;
+
+	/* the VMA may have grown or shrunk while the lock was released */
+	if (vw->has_cur && addr >= cur->start && addr < cur->end) {
+		cur->end = end;
+		return true;
+	}
+
+	if (vw->room < 1 + vw->has_cur) {
+		walk->stop = true;
+		walk->next = addr;
+		return false;
+	}
+	if (vw->has_cur) {
+		if (vw->nr_vmas == RANGE_CHUNK) {
+			walk->next = addr;
+			return false;
+		}
+		vw->vmas[vw->nr_vmas++] = *cur;
+		vw->room--;
+	}
+
+	memset(cur, 0, sizeof(*cur));
+	cur->start = addr;
+	cur->end = end;
+	cur->vm_flags = vma->vm_flags;
+	vw->has_cur = true;
+	return true;
+}
+
+/* huge leaves may start before the walked range, only the part inside it is counted */
+static bool vma_leaf(struct range_walk *walk, unsigned long va, unsigned long pa,
+		     unsigned int page_shift, __u32 flags)
+{
+	struct vma_walk *vw = walk->private;
+	struct page_table_vma *cur = &vw->cur;
+	u64 start = max_t(u64, va, cur->start);
+	u64 end = min_t(u64, va + (1UL << page_shift), cur->end);
+	u64 size;
+
+	if (end <= start)
+		return true;
+	size = end - start;
+	if (page_shift == PUD_SHIFT)
+		cur->pud_mapped += size;
+	else if (page_shift == PMD_SHIFT)
+		cur->pmd_mapped += size;
+	else
+		cur->pte_mapped += size;
+	return true;
+}
+
+static void vma_hole(struct range_walk *walk, unsigned long addr, unsigned long end, bool swapped)
+{
+	struct vma_walk *vw = walk->private;
+
+	if (swapped)
+		vw->cur.swapped += end - addr;
+	else
+		vw->cur.none += end - addr;
+}
+
+static int vma_flush(struct range_walk *walk, bool done)
+{
+	struct vma_walk *vw = walk->private;
+	struct page_table_vmas *query = vw->query;
+
+	if (done && vw->has_cur) {
+		vw->vmas[vw->nr_vmas++] = vw->cur;
+		vw->has_cur = false;
+	}
+	if (copy_to_user(vw->uvmas + vw->copied, vw->vmas, vw->nr_vmas * sizeof(*vw->vmas)))
+		return -EFAULT;
+	vw->copied += vw->nr_vmas;
+	vw->nr_vmas = 0;
+
+	query->nr_vmas = vw->copied;
+	query->next = walk->next >= query->end ? query->end : walk->next;
+	/* a VMA is reported once walked entirely, from its start if this call stops here */
+	if (vw->has_cur)
+		query->next = vw->cur.start;
+	return 0;
+}
+
+static const struct range_walk_ops vma_walk_ops = {
+	.vma	= vma_enter,
+	.leaf	= vma_leaf,
+	.hole	= vma_hole,
+	.flush	= vma_flush,
+};
+
+/* for each VMA of [start, end), the bytes mapped by each leaf size and those not present */
+static int query_page_table_vmas(struct walker_session *session, struct page_table_vmas *query)
+{
+	struct vma_walk vw = {
+		.query = query,
+		.uvmas = u64_to_user_ptr(query->vmas),
+		.room = query->max_vmas,
+	};
+	struct range_walk walk = {
+		.ops = &vma_walk_ops,
+		.private = &vw,
+	};
+	unsigned long addr, end;
+	int ret;
+
+	query->nr_vmas = 0;
+	query->next = query->start;
+	if (query->flags)
+		return -EINVAL;
+	if (query->start >= query->end || !query->max_vmas)
+		return -EINVAL;
+	addr = ALIGN_DOWN(query->start, PAGE_SIZE);
+	end = PAGE_ALIGN(min_t(u64, query->end, TASK_SIZE));
+	if (addr >= end) {
+		query->next = query->end;
+		return 0;
+	}
+
+	vw.vmas = kmalloc_array(RANGE_CHUNK + 1, sizeof(*vw.vmas), GFP_KERNEL);
+	if (!vw.vmas)
+		return -ENOMEM;
+
+	walk.mm = get_query_mm(session, query->pid);
+	if (!walk.mm) {
+		ret = -ESRCH;
+		goto out_free;
+	}
+	ret = walk_range(&walk, addr, end);
+	mmput(walk.mm);
+out_free:
+	kfree(vw.vmas);
+	return ret;
+}
+
+/*
+ * Kernel ranges. init_mm is not exported to modules, but on x86 every pgd carries the kernel half
+ * of the address space: the one of the caller is walked. Kernel page tables are freed (huge
+ * vmap/ioremap) only after a TLB flush IPI to every CPU: each PUD is walked with interrupts
+ * disabled, which keeps its tables in place.
+ */
+struct kernel_walk {
+	struct page_table_kernel_range *range;
+	/* the 1G and 2M regions last seen split into smaller leaves */
+	unsigned long split_pud, split_pmd;
+};
+
+static bool kernel_leaf(struct range_walk *walk, unsigned long va, unsigned long pa,
+			unsigned int page_shift, __u32 flags)
+{
+	struct kernel_walk *kw = walk->private;
+	struct page_table_kernel_range *range = kw->range;
+	u64 start = max_t(u64, va, range->start);
+	u64 end = min_t(u64, va + (1UL << page_shift), range->end);
+
+	if (end <= start)
+		return true;
+	if (page_shift == PUD_SHIFT) {
+		range->pud_mapped += end - start;
+		return true;
+	}
+
+	if ((va & PUD_MASK) != kw->split_pud) {
+		kw->split_pud = va & PUD_MASK;
+		range->pmd_tables++;
+	}
+	if (page_shift == PMD_SHIFT) {
+		range->pmd_mapped += end - start;
+		return true;
+	}
+
+	if ((va & PMD_MASK) != kw->split_pmd) {
+		kw->split_pmd = va & PMD_MASK;
+		range->pte_tables++;
+	}
+	range->pte_mapped += end - start;
+	return true;
+}
+
+static const struct range_walk_ops kernel_walk_ops = {
+	.leaf	= kernel_leaf,
+};
+
+static void walk_kernel_range(struct page_table_kernel_range *range)
+{
+	struct kernel_walk kw = {
+		.range = range,
+		.split_pud = -1UL,
+		.split_pmd = -1UL,
+	};
+	struct range_walk walk = {
+		.mm = current->mm,
+		.ops = &kernel_walk_ops,
+		.private = &kw,
+		/* a PUD of PTE-mapped vmalloc space is 262144 entries, too many with interrupts off */
+		.table_at_a_time = true,
+	};
+	unsigned long addr = range->start, end = range->end, next, flags;
+
+	while (addr < end) {
+		next = pud_addr_end(addr, end);
+		local_irq_save(flags);
+		/*
+		 * Interrupts are off for at most one PTE table: the walk stops after each, and empty
+		 * or leaf-mapped upper levels are stepped over within the same section
+		 */
+		if (!walk_pgd_range(&walk, addr, next))
+			next = walk.next;
+		local_irq_restore(flags);
+		addr = next;
+		cond_resched();
+	}
+}
+
+/* how the linear map, vmalloc and modules ranges are mapped, in bytes per leaf size */
+static int query_page_table_kernel(struct page_table_kernel *query)
+{
+	struct page_table_kernel_range *range;
+	unsigned int i;
+
+	if (query->flags)
+		return -EINVAL;
+	if (!IS_ENABLED(CONFIG_X86) || !current->mm)
+		return -EOPNOTSUPP;
+	/* the layout of the kernel is no business of unprivileged users (KASLR) */
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	memset(query->ranges, 0, sizeof(query->ranges));
+	query->ranges[PAGE_TABLE_KERNEL_LINEAR].start = PAGE_OFFSET;
+	query->ranges[PAGE_TABLE_KERNEL_LINEAR].end = (unsigned long)high_memory;
+	query->ranges[PAGE_TABLE_KERNEL_VMALLOC].start = VMALLOC_START;
+	query->ranges[PAGE_TABLE_KERNEL_VMALLOC].end = VMALLOC_END;
+#ifdef MODULES_VADDR
+	query->ranges[PAGE_TABLE_KERNEL_MODULES].start = MODULES_VADDR;
+	query->ranges[PAGE_TABLE_KERNEL_MODULES].end = MODULES_END;
+#endif
+	query->nr_ranges = PAGE_TABLE_KERNEL_NR_RANGES;
+
+	for (i = 0; i < PAGE_TABLE_KERNEL_NR_RANGES; i++) {
+		range = &query->ranges[i];
+		range->id = i;
+		if (range->start < range->end)
+			walk_kernel_range(range);
+		if (fatal_signal_pending(current))
+			return -EINTR;
+	}
+	return 0;
+}
+
+/*
+ * Continuous sampling: a worker walks the watched range of a session periodically and compares
+ * each page with the previous scan, pushing what changed to the ring shared with user space.
+ * Every page of the range is summarized as (pfn << WATCH_SHIFT_BITS) | page_shift, 0 if unmapped.
+ */
+#define WATCH_SHIFT_BITS	8
+/* 8 MiB of snapshots per scan: a 4 GiB range with 4 KiB pages */
+#define WATCH_MAX_PAGES		(1UL << 20)
+
+/*
+ * Scans of large ranges take a while: they run on a workqueue of their own, not bound to a CPU,
+ * rather than hold a worker of system_wq the per-CPU work items of the rest of the kernel wait for
+ */
+static struct workqueue_struct *watch_wq;
+
+struct pt_watch {
+	struct walker_session *session;
+	/* pinned with mmgrab(), the address space is taken for each scan */
+	struct mm_struct *mm;
+	unsigned long start, end;
+	unsigned long interval;
+	unsigned long npages;
+	/* the scan in progress and the previous one, swapped after each scan */
+	u64 *cur, *prev;
+	u64 scans;
+	struct delayed_work work;
+};
+
+static inline u64 watch_entry(unsigned long pfn, unsigned int page_shift)
+{
+	return ((u64)pfn << WATCH_SHIFT_BITS) | page_shift;
+}
+
+static inline unsigned long watch_pfn(u64 entry)
+{
+	return entry >> WATCH_SHIFT_BITS;
+}
+
+static inline unsigned int watch_shift(u64 entry)
+{
+	return entry & ((1U << WATCH_SHIFT_BITS) - 1);
+}
+
+/* the ring is full when the consumer is a whole ring behind: the event is counted as lost */
+static void ring_push(struct walker_session *session, const struct page_table_event *event)
+{
+	struct page_table_ring *ring = session->ring;
+	/* not ring->events_offset: the header is writable by user space */
+	struct page_table_event *events = (void *)ring + PAGE_SIZE;
+	/* the consumer releases a slot by storing tail after reading it */
+	u64 tail = smp_load_acquire(&ring->tail);
+
+	if (session->ring_head - tail >= session->ring_size) {
+		WRITE_ONCE(ring->lost, ring->lost + 1);
+		return;
+	}
+	events[session->ring_head & (session->ring_size - 1)] = *event;
+	/* the event is written before it is published */
+	smp_store_release(&ring->head, ++session->ring_head);
+}
+
+static bool watch_leaf(struct range_walk *walk, unsigned long va, unsigned long pa,
+		       unsigned int page_shift, __u32 flags)
+{
+	struct pt_watch *watch = walk->private;
+	unsigned long start = max(va, watch->start);
+	unsigned long end = min(va + (1UL << page_shift), watch->end);
+	unsigned long pfn = PHYS_PFN(pa) + ((start - va) >> PAGE_SHIFT);
+	unsigned long i = (start - watch->start) >> PAGE_SHIFT;
+
+	for (; start < end; start += PAGE_SIZE, i++, pfn++)
+		watch->cur[i] = watch_entry(pfn, page_shift);
+	return true;
+}
+
+static int watch_flush(struct range_walk *walk, bool done)
+{
+	return 0;
+}
+
+static const struct range_walk_ops watch_walk_ops = {
+	.leaf	= watch_leaf,
+	.flush	= watch_flush,
+};
+
+static int pfn_nid(unsigned long pfn)
+{
+	return pfn_valid(pfn) ? page_to_nid(pfn_to_page(pfn)) : NUMA_NO_NODE;
+}
+
+/* what happened to a page between two scans, 0 if nothing */
+static __u32 watch_event_type(u64 old, u64 new)
+{
+	if (old == new)
+		return 0;
+	if (!old)
+		return PAGE_TABLE_EVENT_MAPPED;
+	if (!new)
+		return PAGE_TABLE_EVENT_UNMAPPED;
+	if (watch_shift(new) > watch_shift(old))
+		return PAGE_TABLE_EVENT_COLLAPSED;
+	if (watch_shift(new) < watch_shift(old))
+		return PAGE_TABLE_EVENT_SPLIT;
+	if (pfn_nid(watch_pfn(old)) != pfn_nid(watch_pfn(new)))
+		return PAGE_TABLE_EVENT_MIGRATED;
+	return PAGE_TABLE_EVENT_MOVED;
+}
+
+/* the addresses of two consecutive pages follow each other, or are both unmapped */
+static bool pa_follows(__u64 pa, __u64 nr_pages, __u64 next)
+{
+	return pa ? pa + (nr_pages << PAGE_SHIFT) == next : !next;
+}
+
+/*
+ * Push the changes since the previous scan, consecutive pages changed the same way merged into
+ * one event: a huge page split or migrated is reported once.
+ */
+static void watch_compare(struct pt_watch *watch, u64 time_ns)
+{
+	struct page_table_event event = {}, next = { .time_ns = time_ns, .nr_pages = 1 };
+	unsigned long i;
+	u64 old, new;
+
+	for (i = 0; i < watch->npages; i++) {
+		if (i % 4096 == 0)
+			cond_resched();
+
+		old = watch->prev[i];
+		new = watch->cur[i];
+		next.type = watch_event_type(old, new);
+		if (!next.type)
+			continue;
+
+		next.va = watch->start + (i << PAGE_SHIFT);
+		next.old_pa = old ? PFN_PHYS(watch_pfn(old)) : 0;
+		next.pa = new ? PFN_PHYS(watch_pfn(new)) : 0;
+		next.old_page_shift = watch_shift(old);
+		next.page_shift = watch_shift(new);
+		if (event.type == next.type && event.old_page_shift == next.old_page_shift &&
+		    event.page_shift == next.page_shift &&
+		    event.va + (event.nr_pages << PAGE_SHIFT) == next.va &&
+		    pa_follows(event.old_pa, event.nr_pages, next.old_pa) &&
+		    pa_follows(event.pa, event.nr_pages, next.pa)) {
+			event.nr_pages++;
+			continue;
+		}
+
+		if (event.type)
+			ring_push(watch->session, &event);
+		event = next;
+		event.old_nid = old ? pfn_nid(watch_pfn(old)) : NUMA_NO_NODE;
+		event.nid = new ? pfn_nid(watch_pfn(new)) : NUMA_NO_NODE;
+	}
+	if (event.type)
+		ring_push(watch->session, &event);
+}
+
+static void watch_scan(struct work_struct *work)
+{
+	struct pt_watch *watch = container_of(to_delayed_work(work), struct pt_watch, work);
+	struct walker_session *session = watch->session;
+	struct range_walk walk = {
+		.mm = watch->mm,
+		.ops = &watch_walk_ops,
+		.private = watch,
+	};
+	u64 now = ktime_get_ns();
+
+	/* the target exited or exec'd, the watch ends here */
+	if (!mmget_not_zero(watch->mm)) {
+		struct page_table_event event = {
+			.time_ns = now,
+			.type = PAGE_TABLE_EVENT_EXIT,
+			.old_nid = NUMA_NO_NODE,
+			.nid = NUMA_NO_NODE,
+		};
+
+		ring_push(session, &event);
+		wake_up_interruptible(&session->wait);
+		return;
+	}
+
+	memset(watch->cur, 0, watch->npages * sizeof(*watch->cur));
+	walk_range(&walk, watch->start, watch->end);
+	mmput(watch->mm);
+
+	/* the first scan is the baseline */
+	if (watch->scans++)
+		watch_compare(watch, now);
+	swap(watch->cur, watch->prev);
+	WRITE_ONCE(session->ring->scans, watch->scans);
+	wake_up_interruptible(&session->wait);
+
+	queue_delayed_work(watch_wq, &watch->work, watch->interval);
+}
+
+/* the work must not be queued again: the watch is no longer reachable from its session */
+static void free_watch(struct pt_watch *watch)
+{
+	cancel_delayed_work_sync(&watch->work);
+	if (watch->mm)
+		mmdrop(watch->mm);
+	kvfree(watch->cur);
+	kvfree(watch->prev);
+	kfree(watch);
+}
+
+/* start watching a range of pid (0: the caller, or the bound process), replacing any watch */
+static int watch_session(struct walker_session *session, struct page_table_watch *param)
+{
+	struct pt_watch *watch = NULL;
+	struct mm_struct *mm;
+	unsigned long start, end;
+	int ret;
+
+	if (param->flags & ~PAGE_TABLE_WATCH_STOP)
+		return -EINVAL;
+
+	if (!(param->flags & PAGE_TABLE_WATCH_STOP)) {
+		start = ALIGN_DOWN(param->start, PAGE_SIZE);
+		end = PAGE_ALIGN(min_t(u64, param->end, TASK_SIZE));
+		if (start >= end || !param->interval_ms)
+			return -EINVAL;
+		if ((end - start) >> PAGE_SHIFT > WATCH_MAX_PAGES)
+			return -E2BIG;
+
+		watch = kzalloc(sizeof(*watch), GFP_KERNEL);
+		if (!watch)
+			return -ENOMEM;
+		INIT_DELAYED_WORK(&watch->work, watch_scan);
+		watch->session = session;
+		watch->start = start;
+		watch->end = end;
+		watch->npages = (end - start) >> PAGE_SHIFT;
+		watch->interval = max(msecs_to_jiffies(param->interval_ms), 1UL);
+		watch->cur = kvcalloc(watch->npages, sizeof(*watch->cur), GFP_KERNEL);
+		watch->prev = kvcalloc(watch->npages, sizeof(*watch->prev), GFP_KERNEL);
+		if (!watch->cur || !watch->prev) {
+			ret = -ENOMEM;
+			goto err_free;
+		}
+
+		mm = get_query_mm(session, param->pid);
+		if (!mm) {
+			ret = -ESRCH;
+			goto err_free;
+		}
+		mmgrab(mm);
+		mmput(mm);
+		watch->mm = mm;
+	}
+
+	/* one producer at a time: the old worker is stopped before the new one starts */
+	mutex_lock(&session->mutex);
+	if (watch && !session->ring) {
+		mutex_unlock(&session->mutex);
+		pr_err("mmap the ring before watching.\n");
+		ret = -EINVAL;
+		goto err_free;
+	}
+	if (session->watch)
+		free_watch(session->watch);
+	session->watch = watch;
+	if (watch)
+		queue_delayed_work(watch_wq, &watch->work, 0);
+	mutex_unlock(&session->mutex);
+	return 0;
+
+err_free:
+	free_watch(watch);
+	return ret;
+}
+
+/* the ring: a header page, then as many events as fit in the rest of the mapping (power of 2) */
+static int walker_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct walker_session *session = file->private_data;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	struct page_table_ring *ring;
+	unsigned long nr;
+	int ret;
+
+	BUILD_BUG_ON(sizeof(*ring) > PAGE_SIZE);
+	if (vma->vm_pgoff || size < 2 * PAGE_SIZE)
+		return -EINVAL;
+	nr = rounddown_pow_of_two((size - PAGE_SIZE) / sizeof(struct page_table_event));
+	if (!nr)
+		return -EINVAL;
+
+	mutex_lock(&session->mutex);
+	if (session->ring) {
+		ret = -EBUSY;
+		goto out_unlock;
+	}
+	ring = vmalloc_user(size);
+	if (!ring) {
+		ret = -ENOMEM;
+		goto out_unlock;
+	}
+	ret = remap_vmalloc_range(vma, ring, 0);
+	if (ret) {
+		vfree(ring);
+		goto out_unlock;
+	}
+	ring->nr_events = nr;
+	ring->event_size = sizeof(struct page_table_event);
+	ring->events_offset = PAGE_SIZE;
+	session->ring_size = nr;
+	session->ring_head = 0;
+	/* published to walker_poll() once set up */
+	smp_store_release(&session->ring, ring);
+
+out_unlock:
+	mutex_unlock(&session->mutex);
+	return ret;
+}
+
+/* readable while events are waiting in the ring */
+static __poll_t walker_poll(struct file *file, struct poll_table_struct *wait)
+{
+	struct walker_session *session = file->private_data;
+	struct page_table_ring *ring;
+
+	poll_wait(file, &session->wait, wait);
+	ring = smp_load_acquire(&session->ring);
+	if (ring && smp_load_acquire(&ring->head) != READ_ONCE(ring->tail))
+		return EPOLLIN | EPOLLRDNORM;
+	return 0;
+}
+
+static int walker_open(struct inode *inode, struct file *file)
+{
+	struct walker_session *session;
+
+	session = kzalloc(sizeof(*session), GFP_KERNEL);
+	if (!session)
+		return -ENOMEM;
+	spin_lock_init(&session->lock);
+	mutex_init(&session->mutex);
+	init_waitqueue_head(&session->wait);
+	file->private_data = session;
+	return 0;
+}
+
+/* the ring is unmapped by now: the mapping holds a reference to the file */
+static int walker_release(struct inode *inode, struct file *file)
+{
+	struct walker_session *session = file->private_data;
+
+	if (session->watch)
+		free_watch(session->watch);
+	vfree(session->ring);
+	if (session->mm)
+		mmdrop(session->mm);
+	kfree(session);
 	return 0;
 }
 
 static long walker_ioctl_unlocked(struct file *file, unsigned int cmd, unsigned long arg)
 {
+	struct walker_session *session = file->private_data;
 	int ret;
 	union {
+		struct page_table_bind bind;
+		struct page_table_watch watch;
+		struct page_table_kernel kernel;
 		struct page_table_query query;
+		struct page_table_batch batch;
+		struct page_table_range range;
+		struct page_table_vmas vmas;
 	} param;
 
 	switch (cmd) {
+	case PAGE_TABLE_BIND:
+		if (copy_from_user(&param.bind, (void __user *)arg, sizeof(param.bind))) {
+			pr_err("failed to copy bind param.\n");
+			return -EFAULT;
+		}
+		ret = bind_session(session, &param.bind);
+		if (ret) {
+			pr_err("bind failed.\n");
+			return ret;
+		}
+		break;
+	case PAGE_TABLE_WATCH:
+		if (copy_from_user(&param.watch, (void __user *)arg, sizeof(param.watch))) {
+			pr_err("failed to copy watch param.\n");
+			return -EFAULT;
+		}
+		ret = watch_session(session, &param.watch);
+		if (ret) {
+			pr_err("watch failed.\n");
+			return ret;
+		}
+		break;
+	case PAGE_TABLE_QUERY_V0:
 	case PAGE_TABLE_QUERY:
 		if (copy_from_user(&param.query, (void __user *)arg, sizeof(param.query))) {
 			pr_err("failed to copy query param.\n");
 			return -EFAULT;
 		}
-		ret = query_page_table(&param.query);
+		/* flags lies in what used to be padding, left uninitialized by old binaries */
+		if (cmd == PAGE_TABLE_QUERY_V0)
+			param.query.flags = 0;
+		ret = query_page_table(session, &param.query);
 		if (ret) {
 			pr_err("query failed.\n");
 			return ret;
@@ -177,6 +1551,67 @@ static long walker_ioctl_unlocked(struct file *file, unsigned int cmd, unsigned
 			return -EFAULT;
 		}
 		break;
+	case PAGE_TABLE_QUERY_BATCH:
+		if (copy_from_user(&param.batch, (void __user *)arg, sizeof(param.batch))) {
+			pr_err("failed to copy batch param.\n");
+			return -EFAULT;
+		}
+		ret = query_page_table_batch(session, &param.batch);
+		/* the results written so far are reported on failure as well */
+		if (copy_to_user((void __user *)arg, &param.batch, sizeof(param.batch))) {
+			pr_err("failed to copy batch param.\n");
+			return -EFAULT;
+		}
+		if (ret) {
+			pr_err("batch query failed.\n");
+			return ret;
+		}
+		break;
+	case PAGE_TABLE_QUERY_RANGE:
+		if (copy_from_user(&param.range, (void __user *)arg, sizeof(param.range))) {
+			pr_err("failed to copy range param.\n");
+			return -EFAULT;
+		}
+		ret = query_page_table_range(session, &param.range);
+		if (copy_to_user((void __user *)arg, &param.range, sizeof(param.range))) {
+			pr_err("failed to copy range param.\n");
+			return -EFAULT;
+		}
+		if (ret) {
+			pr_err("range query failed.\n");
+			return ret;
+		}
+		break;
+	case PAGE_TABLE_QUERY_VMAS:
+		if (copy_from_user(&param.vmas, (void __user *)arg, sizeof(param.vmas))) {
+			pr_err("failed to copy vmas param.\n");
+			return -EFAULT;
+		}
+		ret = query_page_table_vmas(session, &param.vmas);
+		if (copy_to_user((void __user *)arg, &param.vmas, sizeof(param.vmas))) {
+			pr_err("failed to copy vmas param.\n");
+			return -EFAULT;
+		}
+		if (ret) {
+			pr_err("vmas query failed.\n");
+			return ret;
+		}
+		break;
+	case PAGE_TABLE_QUERY_KERNEL:
+		if (copy_from_user(&param.kernel, (void __user *)arg, sizeof(param.kernel))) {
+			pr_err("failed to copy kernel param.\n");
+			return -EFAULT;
+		}
+		ret = query_page_table_kernel(&param.kernel);
+		if (ret) {
+			pr_err("kernel query failed.\n");
+			return ret;
+		}
+		if (copy_to_user((void __user *)arg, &param.kernel, sizeof(param.kernel))) {
+			pr_err("failed to copy kernel param.\n");
+			return -EFAULT;
+		}
+		break;
 	default:
 		return -ENOTTY;
 	}
@@ -186,6 +1621,10 @@ static long walker_ioctl_unlocked(struct file *file, unsigned int cmd, unsigned
 
 static const struct file_operations walker_fops = {
 	.owner = THIS_MODULE,
+	.open = walker_open,
+	.release = walker_release,
+	.mmap = walker_mmap,
+	.poll = walker_poll,
 	.unlocked_ioctl = walker_ioctl_unlocked,
 };
 
@@ -199,9 +1638,14 @@ static int __init walker_init(void)
 {
 	int ret;
 
+	watch_wq = alloc_workqueue("ptwalk_watch", WQ_UNBOUND, 0);
+	if (!watch_wq)
+		return -ENOMEM;
+
 	ret = misc_register(&walker_misc_device);
 	if (ret) {
 		pr_err("misc_register failed (%d)\n", ret);
+		destroy_workqueue(watch_wq);
 		return ret;
 	}
 
@@ -217,6 +1661,8 @@ static int __init walker_init(void)
 static void __exit walker_exit(void)
 {
 	misc_deregister(&walker_misc_device);
+	/* every file is closed, and its watch stopped, by now */
+	destroy_workqueue(watch_wq);
 	pr_info("mist device deregistered\n");
 }
 
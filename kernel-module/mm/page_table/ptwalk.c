@@ -0,0 +1,252 @@
+/*
+ * ptwalk - query the page_table_walker module from the command line, as CSV or JSON.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libptwalk.h"
+
+static void print_usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-p pid] [-o csv|json] [-l] [-a] command [args...]\n"
+		"\n"
+		"Commands:\n"
+		"  query va...                 every entry walked through for each address\n"
+		"  translate va[:count[:stride]]...\n"
+		"                              translate addresses (stride: the page size)\n"
+		"  runs start end              contiguous runs of leaf entries mapping [start, end)\n"
+		"  vmas [start end]            page sizes and residency per VMA\n"
+		"  kernel                      page sizes of the kernel ranges (root, x86)\n"
+		"\n"
+		"Options:\n"
+		"  -p pid     target process, default: ptwalk itself, which is of little use\n"
+		"  -o format  csv (default) or json\n"
+		"  -l         walk without the mmap lock when possible (query, translate)\n"
+		"  -a         tell runs apart by their accessed and dirty bits as well (runs)\n"
+		"  -h         show usage\n"
+		"\n"
+		"Example:\n"
+		"  %s -p 1234 -o json translate 0x7f0000000000:16\n", prog, prog);
+}
+
+static int parse_u64(const char *s, uint64_t *val)
+{
+	char *end;
+
+	errno = 0;
+	*val = strtoull(s, &end, 0);
+	if (errno || end == s || *end) {
+		fprintf(stderr, "invalid number: %s\n", s);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+struct options {
+	pid_t pid;
+	unsigned int flags;
+	struct ptwalk_writer writer;
+};
+
+static int cmd_query(struct ptwalk *pw, struct options *opts, int argc, char **argv)
+{
+	struct page_table_query query;
+	uint64_t va;
+	int i, ret;
+
+	for (i = 0; i < argc; i++) {
+		ret = parse_u64(argv[i], &va);
+		if (ret)
+			return ret;
+		ret = ptwalk_query(pw, opts->pid, va,
+				   opts->flags & PAGE_TABLE_BATCH_LOCKLESS ? PAGE_TABLE_QUERY_LOCKLESS : 0,
+				   &query);
+		if (ret)
+			return ret;
+		ptwalk_write_query(&opts->writer, &query);
+	}
+	return 0;
+}
+
+/* va[:count[:stride]] */
+static int cmd_translate(struct ptwalk *pw, struct options *opts, int argc, char **argv)
+{
+	struct page_table_entry *results;
+	uint64_t start, count, stride, i;
+	char *count_str, *stride_str;
+	int arg, ret;
+
+	for (arg = 0; arg < argc; arg++) {
+		count = 1;
+		stride = sysconf(_SC_PAGESIZE);
+		count_str = strchr(argv[arg], ':');
+		if (count_str) {
+			*count_str++ = '\0';
+			stride_str = strchr(count_str, ':');
+			if (stride_str) {
+				*stride_str++ = '\0';
+				ret = parse_u64(stride_str, &stride);
+				if (ret)
+					return ret;
+			}
+			ret = parse_u64(count_str, &count);
+			if (ret)
+				return ret;
+		}
+		ret = parse_u64(argv[arg], &start);
+		if (ret)
+			return ret;
+
+		results = calloc(count, sizeof(*results));
+		if (!results)
+			return -ENOMEM;
+		ret = ptwalk_translate_range(pw, opts->pid, start, stride, count,
+					     opts->flags & PAGE_TABLE_BATCH_LOCKLESS, results);
+		if (!ret) {
+			for (i = 0; i < count; i++)
+				ptwalk_write_entry(&opts->writer, &results[i]);
+		}
+		free(results);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static int write_run(const struct page_table_run *run, void *arg)
+{
+	ptwalk_write_run(arg, run);
+	return 0;
+}
+
+static int write_vma(const struct page_table_vma *vma, void *arg)
+{
+	ptwalk_write_vma(arg, vma);
+	return 0;
+}
+
+static int cmd_runs(struct ptwalk *pw, struct options *opts, int argc, char **argv)
+{
+	uint64_t start, end;
+
+	if (argc != 2 || parse_u64(argv[0], &start) || parse_u64(argv[1], &end))
+		return -EINVAL;
+	return ptwalk_for_each_run(pw, opts->pid, start, end, opts->flags & PAGE_TABLE_RANGE_AD,
+				   write_run, &opts->writer);
+}
+
+static int cmd_vmas(struct ptwalk *pw, struct options *opts, int argc, char **argv)
+{
+	uint64_t start = 0, end = UINT64_MAX;
+
+	if (argc != 0 && (argc != 2 || parse_u64(argv[0], &start) || parse_u64(argv[1], &end)))
+		return -EINVAL;
+	return ptwalk_for_each_vma(pw, opts->pid, start, end, write_vma, &opts->writer);
+}
+
+static int cmd_kernel(struct ptwalk *pw, struct options *opts, int argc, char **argv)
+{
+	struct page_table_kernel kernel;
+	unsigned int i;
+	int ret;
+
+	(void)argv;
+	if (argc)
+		return -EINVAL;
+	ret = ptwalk_kernel(pw, &kernel);
+	if (ret)
+		return ret;
+	for (i = 0; i < kernel.nr_ranges; i++)
+		ptwalk_write_kernel_range(&opts->writer, &kernel.ranges[i]);
+	return 0;
+}
+
+static const struct {
+	const char *name;
+	int (*run)(struct ptwalk *pw, struct options *opts, int argc, char **argv);
+} commands[] = {
+	{ "query", cmd_query },
+	{ "translate", cmd_translate },
+	{ "runs", cmd_runs },
+	{ "vmas", cmd_vmas },
+	{ "kernel", cmd_kernel },
+};
+
+int main(int argc, char **argv)
+{
+	struct options opts = {};
+	enum ptwalk_format format = PTWALK_CSV;
+	struct ptwalk *pw;
+	uint64_t pid;
+	unsigned int i;
+	int opt, ret;
+
+	while ((opt = getopt(argc, argv, "p:o:lah")) != -1) {
+		switch (opt) {
+		case 'p':
+			if (parse_u64(optarg, &pid))
+				return 1;
+			opts.pid = pid;
+			break;
+		case 'o':
+			if (!strcmp(optarg, "csv")) {
+				format = PTWALK_CSV;
+			} else if (!strcmp(optarg, "json")) {
+				format = PTWALK_JSON;
+			} else {
+				print_usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'l':
+			opts.flags |= PAGE_TABLE_BATCH_LOCKLESS;
+			break;
+		case 'a':
+			opts.flags |= PAGE_TABLE_RANGE_AD;
+			break;
+		case 'h':
+			print_usage(argv[0]);
+			return 0;
+		default:
+			print_usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind >= argc) {
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	for (i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+		if (!strcmp(argv[optind], commands[i].name))
+			break;
+	}
+	if (i == sizeof(commands) / sizeof(commands[0])) {
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	pw = ptwalk_open();
+	if (!pw) {
+		perror("open " PTWALK_DEVICE_PATH);
+		return 1;
+	}
+
+	ptwalk_writer_init(&opts.writer, stdout, format);
+	ret = commands[i].run(pw, &opts, argc - optind - 1, argv + optind + 1);
+	ptwalk_writer_finish(&opts.writer);
+	ptwalk_close(pw);
+	if (ret) {
+		if (ret == -EINVAL)
+			print_usage(argv[0]);
+		else
+			fprintf(stderr, "%s: %s\n", argv[optind], strerror(-ret));
+		return 1;
+	}
+	return 0;
+}
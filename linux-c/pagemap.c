@@ -0,0 +1,253 @@
+/*
+ * Bulk address translation through /proc/$PID/pagemap, see pagemap.h.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pagemap.h"
+
+struct pagemap *pagemap_open(pid_t pid)
+{
+	char path[64];
+	struct pagemap *pm;
+	int err;
+
+	pm = malloc(sizeof(*pm));
+	if (!pm)
+		return NULL;
+
+	if (pid)
+		snprintf(path, sizeof(path), "/proc/%d/pagemap", pid);
+	else
+		snprintf(path, sizeof(path), "/proc/self/pagemap");
+	pm->fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (pm->fd == -1) {
+		err = errno;
+		free(pm);
+		errno = err;
+		return NULL;
+	}
+	pm->pid = pid ? pid : getpid();
+	pm->page_size = sysconf(_SC_PAGESIZE);
+	pm->reads = 0;
+	return pm;
+}
+
+void pagemap_close(struct pagemap *pm)
+{
+	if (!pm)
+		return;
+	close(pm->fd);
+	free(pm);
+}
+
+/* nr 64-bit entries from the index-th one of a /proc file, fewer only at its end */
+static ssize_t pread_entries(int fd, uint64_t index, size_t nr, uint64_t *entries,
+			     unsigned long *reads)
+{
+	off_t offset = index * sizeof(uint64_t);
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < nr) {
+		ret = pread(fd, entries + done, (nr - done) * sizeof(uint64_t),
+			    offset + done * sizeof(uint64_t));
+		(*reads)++;
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (ret == 0)
+			break;
+		/* the kernel only copies whole entries */
+		done += ret / sizeof(uint64_t);
+	}
+	return done;
+}
+
+ssize_t pagemap_read(struct pagemap *pm, uint64_t va, size_t nr_pages, uint64_t *entries)
+{
+	/* each page corresponds to a 64-bit entry, none past the end of the address space */
+	return pread_entries(pm->fd, va / pm->page_size, nr_pages, entries, &pm->reads);
+}
+
+void pagemap_decode(const struct pagemap *pm, uint64_t va, uint64_t raw,
+		    struct pagemap_entry *entry)
+{
+	entry->va = va;
+	entry->flags = raw & ~PM_PFRAME_MASK;
+	entry->pfn = 0;
+	entry->pa = 0;
+	entry->swap_type = 0;
+	entry->swap_offset = 0;
+	entry->kpageflags = 0;
+	entry->kpagecount = 0;
+
+	/*
+	 * swap: 50 bits for offset, 5 bits for swap type
+	 * mapped page: 55 bits for PFN
+	 */
+	if (raw & PM_SWAP) {
+		entry->swap_type = raw & ((1ULL << PM_SWAP_TYPE_BITS) - 1);
+		entry->swap_offset = (raw >> PM_SWAP_TYPE_BITS) &
+				     ((1ULL << PM_SWAP_OFFSET_BITS) - 1);
+	} else if (raw & PM_PRESENT) {
+		entry->pfn = raw & PM_PFRAME_MASK;
+		if (entry->pfn)
+			entry->pa = entry->pfn * pm->page_size;
+	}
+}
+
+ssize_t pagemap_translate_range(struct pagemap *pm, uint64_t va, size_t nr_pages,
+				struct pagemap_entry *entries)
+{
+	size_t done = 0, chunk, i;
+	ssize_t ret;
+
+	va -= va % pm->page_size;
+	while (done < nr_pages) {
+		chunk = nr_pages - done < PAGEMAP_BATCH ? nr_pages - done : PAGEMAP_BATCH;
+		ret = pagemap_read(pm, va, chunk, pm->buf);
+		if (ret < 0)
+			return ret;
+		for (i = 0; i < (size_t)ret; i++, va += pm->page_size)
+			pagemap_decode(pm, va, pm->buf[i], &entries[done + i]);
+		done += ret;
+		if ((size_t)ret < chunk)
+			break;
+	}
+	return done;
+}
+
+int pagemap_translate(struct pagemap *pm, uint64_t va, uint64_t *pa)
+{
+	struct pagemap_entry entry;
+	ssize_t ret;
+
+	ret = pagemap_translate_range(pm, va, 1, &entry);
+	if (ret < 0)
+		return ret;
+	if (ret == 0 || !entry.pa)
+		return -ENOENT;
+	*pa = entry.pa + va % pm->page_size;
+	return 0;
+}
+
+struct kpage *kpage_open(void)
+{
+	struct kpage *kp;
+	int err;
+
+	kp = malloc(sizeof(*kp));
+	if (!kp)
+		return NULL;
+
+	kp->flags_fd = open("/proc/kpageflags", O_RDONLY | O_CLOEXEC);
+	if (kp->flags_fd == -1)
+		goto err_free;
+	kp->count_fd = open("/proc/kpagecount", O_RDONLY | O_CLOEXEC);
+	if (kp->count_fd == -1)
+		goto err_close;
+	kp->reads = 0;
+	return kp;
+
+err_close:
+	err = errno;
+	close(kp->flags_fd);
+	errno = err;
+err_free:
+	err = errno;
+	free(kp);
+	errno = err;
+	return NULL;
+}
+
+void kpage_close(struct kpage *kp)
+{
+	if (!kp)
+		return;
+	close(kp->count_fd);
+	close(kp->flags_fd);
+	free(kp);
+}
+
+/* physically contiguous entries from first, at most PAGEMAP_BATCH */
+static size_t pfn_run(const struct pagemap_entry *entries, size_t first, size_t nr)
+{
+	size_t i;
+
+	for (i = first + 1; i < nr && i - first < PAGEMAP_BATCH; i++) {
+		if (entries[i].pfn != entries[i - 1].pfn + 1)
+			break;
+	}
+	return i - first;
+}
+
+int kpage_enrich(struct kpage *kp, struct pagemap_entry *entries, size_t nr)
+{
+	size_t i = 0, run, j;
+	ssize_t ret;
+
+	while (i < nr) {
+		if (!entries[i].pfn) {
+			i++;
+			continue;
+		}
+		/* the same page mapped again, typically the zero page */
+		if (i && entries[i].pfn == entries[i - 1].pfn) {
+			entries[i].kpageflags = entries[i - 1].kpageflags;
+			entries[i].kpagecount = entries[i - 1].kpagecount;
+			i++;
+			continue;
+		}
+
+		run = pfn_run(entries, i, nr);
+		ret = pread_entries(kp->flags_fd, entries[i].pfn, run, kp->buf, &kp->reads);
+		if (ret < 0)
+			return ret;
+		for (j = 0; j < (size_t)ret; j++)
+			entries[i + j].kpageflags = kp->buf[j];
+		ret = pread_entries(kp->count_fd, entries[i].pfn, run, kp->buf, &kp->reads);
+		if (ret < 0)
+			return ret;
+		for (j = 0; j < (size_t)ret; j++)
+			entries[i + j].kpagecount = kp->buf[j];
+		i += run;
+	}
+	return 0;
+}
+
+#define KPF(entry, name)	(!!((entry)->kpageflags & (1ULL << KPF_##name)))
+
+void kpage_summarize(const struct pagemap_entry *entries, size_t nr, struct kpage_summary *sum)
+{
+	const struct pagemap_entry *entry;
+	size_t i;
+
+	memset(sum, 0, sizeof(*sum));
+	sum->pages = nr;
+	for (i = 0; i < nr; i++) {
+		entry = &entries[i];
+		sum->swapped += !!(entry->flags & PM_SWAP);
+		if (!(entry->flags & PM_PRESENT))
+			continue;
+		sum->present++;
+		/* no PFN, no page flags */
+		if (!entry->pfn)
+			continue;
+		sum->thp += KPF(entry, THP);
+		sum->hugetlb += KPF(entry, HUGE);
+		sum->zero += KPF(entry, ZERO_PAGE);
+		sum->anon += KPF(entry, ANON);
+		sum->lru += KPF(entry, LRU);
+		sum->active += KPF(entry, ACTIVE);
+		sum->mlocked += KPF(entry, MLOCKED);
+		sum->ksm += KPF(entry, KSM);
+		sum->shared += entry->kpagecount > 1;
+	}
+}
@@ -0,0 +1,122 @@
+/*
+ * Bulk address translation through /proc/$PID/pagemap.
+ *
+ * A struct pagemap keeps the pagemap file of one process open, so translating a range costs one
+ * pread() per PAGEMAP_BATCH pages instead of an open/lseek/read/close per page. Open one per
+ * target process to audit several of them. Functions return 0 (or a count) or a negative errno.
+ *
+ * A struct kpage joins the PFNs found that way with /proc/kpageflags and /proc/kpagecount, which
+ * need CAP_SYS_ADMIN, to tell what kind of physical page backs a range.
+ *
+ * Reference: kernel doc admin-guide/mm/pagemap.rst
+ */
+#ifndef PAGEMAP_H
+#define PAGEMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <linux/kernel-page-flags.h>
+
+/* adapted from kernel source: fs/proc/task_mmu.c or vm/pagemap.rst */
+#define PM_PFRAME_BITS		55
+#define PM_PFRAME_MASK		((1ULL << PM_PFRAME_BITS) - 1)
+#define PM_SWAP_TYPE_BITS	5
+#define PM_SWAP_OFFSET_BITS	50
+#define PM_SOFT_DIRTY		(1ULL << 55)
+#define PM_MMAP_EXCLUSIVE	(1ULL << 56)
+#define PM_UFFD_WP		(1ULL << 57)
+#define PM_FILE			(1ULL << 61)
+#define PM_SWAP			(1ULL << 62)
+#define PM_PRESENT		(1ULL << 63)
+
+/* not in the uapi header, adapted from kernel source: include/linux/kernel-page-flags.h */
+#ifndef KPF_MLOCKED
+#define KPF_MLOCKED		33
+#endif
+
+/* entries read by one pread(), the kernel walks 512 of them (a PMD) per step anyway */
+#define PAGEMAP_BATCH		4096
+
+struct pagemap {
+	pid_t pid;
+	int fd;
+	unsigned long page_size;
+	/* pread() calls made so far */
+	unsigned long reads;
+	uint64_t buf[PAGEMAP_BATCH];
+};
+
+/* one decoded entry */
+struct pagemap_entry {
+	uint64_t va;
+	/* 0 if the page is not present, or the PFN is hidden (needs CAP_SYS_ADMIN) */
+	uint64_t pa;
+	uint64_t pfn;
+	/* PM_* flag bits of the raw entry */
+	uint64_t flags;
+	/* valid if flags has PM_SWAP */
+	unsigned int swap_type;
+	uint64_t swap_offset;
+	/* of the page at pfn, filled by kpage_enrich(): 1 << KPF_* bits, and its map count */
+	uint64_t kpageflags;
+	uint64_t kpagecount;
+};
+
+/* pid 0: the caller */
+struct pagemap *pagemap_open(pid_t pid);
+void pagemap_close(struct pagemap *pm);
+
+/*
+ * Raw entries of nr_pages pages from the page containing va. Returns the number of entries read,
+ * less than nr_pages only past the end of the user address space.
+ */
+ssize_t pagemap_read(struct pagemap *pm, uint64_t va, size_t nr_pages, uint64_t *entries);
+
+/* the same, decoded; entries[i] describes the page at va + i * page_size */
+ssize_t pagemap_translate_range(struct pagemap *pm, uint64_t va, size_t nr_pages,
+				struct pagemap_entry *entries);
+
+/* a single address, pa includes the offset in the page; -ENOENT if the page is not present */
+int pagemap_translate(struct pagemap *pm, uint64_t va, uint64_t *pa);
+
+void pagemap_decode(const struct pagemap *pm, uint64_t va, uint64_t raw,
+		    struct pagemap_entry *entry);
+
+struct kpage {
+	int flags_fd;
+	int count_fd;
+	/* pread() calls made so far */
+	unsigned long reads;
+	uint64_t buf[PAGEMAP_BATCH];
+};
+
+/* pages of a range, by kind; present pages with a PFN only for the KPF_* based counters */
+struct kpage_summary {
+	size_t pages;
+	size_t present;
+	size_t swapped;
+	size_t thp;
+	size_t hugetlb;
+	size_t zero;
+	size_t anon;
+	size_t lru;
+	size_t active;
+	size_t mlocked;
+	size_t ksm;
+	/* mapped more than once */
+	size_t shared;
+};
+
+struct kpage *kpage_open(void);
+void kpage_close(struct kpage *kp);
+
+/*
+ * Fill kpageflags and kpagecount of the entries with a PFN, a pair of pread() per run of
+ * physically contiguous pages.
+ */
+int kpage_enrich(struct kpage *kp, struct pagemap_entry *entries, size_t nr);
+
+void kpage_summarize(const struct pagemap_entry *entries, size_t nr, struct kpage_summary *sum);
+
+#endif
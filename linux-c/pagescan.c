@@ -0,0 +1,375 @@
+/*
+ * Whole process scan with a pool of pagemap readers, see pagescan.h.
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pagemap.h"
+#include "pagescan.h"
+
+/* PFN to node, through the memory blocks (memory hotplug sections) of each node */
+struct node_map {
+	uint64_t block_pages;
+	/* node of each memory block, -1 if none */
+	int *block_node;
+	size_t nr_blocks;
+	int nr_nodes;
+};
+
+static int node_map_add(struct node_map *map, size_t block, int node)
+{
+	size_t nr;
+	int *p;
+
+	if (block >= map->nr_blocks) {
+		nr = map->nr_blocks ? map->nr_blocks : 64;
+		while (nr <= block)
+			nr *= 2;
+		p = realloc(map->block_node, nr * sizeof(*p));
+		if (!p)
+			return -ENOMEM;
+		while (map->nr_blocks < nr)
+			p[map->nr_blocks++] = -1;
+		map->block_node = p;
+	}
+	map->block_node[block] = node;
+	return 0;
+}
+
+static int node_map_load(struct node_map *map, unsigned long page_size)
+{
+	struct dirent *node_ent, *ent;
+	char path[sizeof("/sys/devices/system/node/") + sizeof(node_ent->d_name)];
+	DIR *nodes, *dir;
+	unsigned long block;
+	FILE *f;
+	int node, ret = 0;
+
+	memset(map, 0, sizeof(*map));
+	map->nr_nodes = 1;
+
+	/* no memory blocks without CONFIG_MEMORY_HOTPLUG, then only a single node can be told */
+	f = fopen("/sys/devices/system/memory/block_size_bytes", "r");
+	if (f) {
+		if (fscanf(f, "%lx", &block) == 1)
+			map->block_pages = block / page_size;
+		fclose(f);
+	}
+
+	/* no node directory without CONFIG_NUMA: a single node */
+	nodes = opendir("/sys/devices/system/node");
+	if (!nodes)
+		return 0;
+	while ((node_ent = readdir(nodes))) {
+		if (sscanf(node_ent->d_name, "node%d", &node) != 1)
+			continue;
+		if (node >= map->nr_nodes)
+			map->nr_nodes = node + 1;
+		if (!map->block_pages)
+			continue;
+
+		snprintf(path, sizeof(path), "/sys/devices/system/node/%s", node_ent->d_name);
+		dir = opendir(path);
+		if (!dir)
+			continue;
+		while ((ent = readdir(dir))) {
+			if (sscanf(ent->d_name, "memory%lu", &block) != 1)
+				continue;
+			ret = node_map_add(map, block, node);
+			if (ret)
+				break;
+		}
+		closedir(dir);
+		if (ret)
+			break;
+	}
+	closedir(nodes);
+	return ret;
+}
+
+static int node_of(const struct node_map *map, uint64_t pfn)
+{
+	uint64_t block;
+
+	if (!map->block_pages)
+		return map->nr_nodes == 1 ? 0 : -1;
+	block = pfn / map->block_pages;
+	return block < map->nr_blocks ? map->block_node[block] : -1;
+}
+
+static int parse_maps(pid_t pid, struct pagescan *scan)
+{
+	char path[64], perms[5], *line = NULL;
+	unsigned long start, end;
+	struct pagescan_vma *vmas;
+	size_t len = 0, nr = 0;
+	FILE *f;
+	int pos, ret = 0;
+
+	if (pid)
+		snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+	else
+		snprintf(path, sizeof(path), "/proc/self/maps");
+	f = fopen(path, "r");
+	if (!f)
+		return -errno;
+
+	/* start-end perms offset dev inode [path] */
+	while (getline(&line, &len, f) != -1) {
+		if (sscanf(line, "%lx-%lx %4s %*s %*s %*s %n", &start, &end, perms, &pos) != 3)
+			continue;
+		if (scan->nr_vmas == nr) {
+			nr = nr ? nr * 2 : 64;
+			vmas = realloc(scan->vmas, nr * sizeof(*vmas));
+			if (!vmas) {
+				ret = -ENOMEM;
+				break;
+			}
+			scan->vmas = vmas;
+		}
+		line[strcspn(line, "\n")] = '\0';
+		vmas = &scan->vmas[scan->nr_vmas];
+		memset(vmas, 0, sizeof(*vmas));
+		vmas->start = start;
+		vmas->end = end;
+		memcpy(vmas->perms, perms, sizeof(perms));
+		vmas->name = strdup(line + pos);
+		if (!vmas->name) {
+			ret = -ENOMEM;
+			break;
+		}
+		scan->nr_vmas++;
+	}
+	free(line);
+	fclose(f);
+	return ret;
+}
+
+struct chunk {
+	size_t vma;
+	uint64_t start;
+	size_t nr_pages;
+};
+
+struct scan_ctx {
+	struct pagescan *scan;
+	struct node_map nodes;
+	unsigned long page_size;
+	struct chunk *chunks;
+	/* the next chunk to take */
+	size_t next;
+};
+
+struct worker {
+	pthread_t thread;
+	struct scan_ctx *ctx;
+	struct pagemap *pm;
+	/* resident pages per node of the current chunk */
+	uint64_t *node_pages;
+	int err;
+};
+
+static int scan_chunk(struct worker *w, const struct chunk *chunk)
+{
+	struct scan_ctx *ctx = w->ctx;
+	struct pagescan_vma *vma = &ctx->scan->vmas[chunk->vma];
+	uint64_t va = chunk->start, raw, pfn, resident = 0, swapped = 0, unknown = 0;
+	size_t done = 0, nr, i;
+	ssize_t ret;
+	int node;
+
+	memset(w->node_pages, 0, ctx->nodes.nr_nodes * sizeof(*w->node_pages));
+	while (done < chunk->nr_pages) {
+		nr = chunk->nr_pages - done < PAGEMAP_BATCH ? chunk->nr_pages - done : PAGEMAP_BATCH;
+		ret = pagemap_read(w->pm, va, nr, w->pm->buf);
+		if (ret < 0)
+			return ret;
+		for (i = 0; i < (size_t)ret; i++) {
+			raw = w->pm->buf[i];
+			if (raw & PM_SWAP) {
+				swapped++;
+				continue;
+			}
+			if (!(raw & PM_PRESENT))
+				continue;
+			resident++;
+			/* a hidden PFN reads as 0 */
+			pfn = raw & PM_PFRAME_MASK;
+			node = pfn ? node_of(&ctx->nodes, pfn) : -1;
+			if (node < 0)
+				unknown++;
+			else
+				w->node_pages[node]++;
+		}
+		/* past the end of the user address space, [vsyscall] */
+		if ((size_t)ret < nr)
+			break;
+		done += ret;
+		va += ret * ctx->page_size;
+	}
+
+	/* chunks of a VMA may be scanned by several threads at once */
+	__atomic_fetch_add(&vma->resident, resident * ctx->page_size, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&vma->swapped, swapped * ctx->page_size, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&vma->unknown_node, unknown * ctx->page_size, __ATOMIC_RELAXED);
+	for (node = 0; node < ctx->nodes.nr_nodes; node++) {
+		if (w->node_pages[node])
+			__atomic_fetch_add(&vma->node_resident[node],
+					   w->node_pages[node] * ctx->page_size, __ATOMIC_RELAXED);
+	}
+	return 0;
+}
+
+static void *worker_fn(void *arg)
+{
+	struct worker *w = arg;
+	struct scan_ctx *ctx = w->ctx;
+	size_t i;
+
+	for (;;) {
+		i = __atomic_fetch_add(&ctx->next, 1, __ATOMIC_RELAXED);
+		if (i >= ctx->scan->nr_chunks)
+			break;
+		w->err = scan_chunk(w, &ctx->chunks[i]);
+		if (w->err)
+			break;
+	}
+	return NULL;
+}
+
+/* every VMA cut into chunks of at most PAGESCAN_CHUNK pages */
+static int split_vmas(struct scan_ctx *ctx)
+{
+	struct pagescan *scan = ctx->scan;
+	uint64_t start, pages;
+	size_t i, n = 0;
+
+	for (i = 0; i < scan->nr_vmas; i++) {
+		pages = (scan->vmas[i].end - scan->vmas[i].start) / ctx->page_size;
+		scan->nr_chunks += (pages + PAGESCAN_CHUNK - 1) / PAGESCAN_CHUNK;
+	}
+	if (!scan->nr_chunks)
+		return 0;
+	ctx->chunks = calloc(scan->nr_chunks, sizeof(*ctx->chunks));
+	if (!ctx->chunks)
+		return -ENOMEM;
+
+	for (i = 0; i < scan->nr_vmas; i++) {
+		for (start = scan->vmas[i].start; start < scan->vmas[i].end; n++) {
+			pages = (scan->vmas[i].end - start) / ctx->page_size;
+			ctx->chunks[n].vma = i;
+			ctx->chunks[n].start = start;
+			ctx->chunks[n].nr_pages = pages < PAGESCAN_CHUNK ? pages : PAGESCAN_CHUNK;
+			start += ctx->chunks[n].nr_pages * ctx->page_size;
+		}
+	}
+	return 0;
+}
+
+int pagescan_run(pid_t pid, unsigned int nr_threads, struct pagescan *scan)
+{
+	struct scan_ctx ctx = { .scan = scan };
+	struct worker *workers = NULL, *w;
+	uint64_t *node_resident;
+	unsigned int i, started = 0;
+	size_t v;
+	int ret;
+
+	memset(scan, 0, sizeof(*scan));
+	scan->pid = pid ? pid : getpid();
+	ctx.page_size = sysconf(_SC_PAGESIZE);
+
+	ret = parse_maps(pid, scan);
+	if (ret)
+		return ret;
+	ret = node_map_load(&ctx.nodes, ctx.page_size);
+	if (ret)
+		goto out;
+	scan->nr_nodes = ctx.nodes.nr_nodes;
+
+	/* one allocation for all the VMAs, released with the first one */
+	node_resident = calloc(scan->nr_vmas * scan->nr_nodes + 1, sizeof(*node_resident));
+	if (!node_resident) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (v = 0; v < scan->nr_vmas; v++)
+		scan->vmas[v].node_resident = node_resident + v * scan->nr_nodes;
+	if (!scan->nr_vmas)
+		free(node_resident);
+
+	ret = split_vmas(&ctx);
+	if (ret)
+		goto out;
+
+	if (!nr_threads)
+		nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr_threads > scan->nr_chunks)
+		nr_threads = scan->nr_chunks;
+	if (!nr_threads)
+		goto out;
+	workers = calloc(nr_threads, sizeof(*workers));
+	if (!workers) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < nr_threads; i++) {
+		w = &workers[i];
+		w->ctx = &ctx;
+		w->pm = pagemap_open(pid);
+		if (!w->pm) {
+			ret = -errno;
+			break;
+		}
+		w->node_pages = calloc(scan->nr_nodes, sizeof(*w->node_pages));
+		if (!w->node_pages) {
+			ret = -ENOMEM;
+			break;
+		}
+		ret = -pthread_create(&w->thread, NULL, worker_fn, w);
+		if (ret)
+			break;
+		started++;
+	}
+	/* the threads started so far take all the chunks anyway */
+	if (started)
+		ret = 0;
+	scan->nr_threads = started;
+
+	for (i = 0; i < nr_threads; i++) {
+		w = &workers[i];
+		if (i < started) {
+			pthread_join(w->thread, NULL);
+			if (!ret)
+				ret = w->err;
+		}
+		if (w->pm)
+			scan->reads += w->pm->reads;
+		pagemap_close(w->pm);
+		free(w->node_pages);
+	}
+
+out:
+	free(workers);
+	free(ctx.chunks);
+	free(ctx.nodes.block_node);
+	return ret;
+}
+
+void pagescan_free(struct pagescan *scan)
+{
+	size_t v;
+
+	if (scan->nr_vmas)
+		free(scan->vmas[0].node_resident);
+	for (v = 0; v < scan->nr_vmas; v++)
+		free(scan->vmas[v].name);
+	free(scan->vmas);
+	memset(scan, 0, sizeof(*scan));
+}
@@ -0,0 +1,53 @@
+/*
+ * Whole process scan on top of pagemap.h: the VMAs of /proc/$PID/maps are split into chunks,
+ * which a pool of threads, each with its own pagemap reader, translates in parallel. The
+ * statistics of the chunks are merged per VMA: resident and swapped bytes, and where the resident
+ * bytes are, per NUMA node.
+ *
+ * The node of a page comes from its PFN and the memory blocks listed under
+ * /sys/devices/system/node/node$N/, PFNs are only visible to CAP_SYS_ADMIN though: without it,
+ * resident bytes are accounted to no node (unknown).
+ */
+#ifndef PAGESCAN_H
+#define PAGESCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* pages per chunk, the unit of work of a thread */
+#define PAGESCAN_CHUNK		(16 * 4096)
+
+struct pagescan_vma {
+	uint64_t start;
+	uint64_t end;
+	/* as in /proc/$PID/maps: "rwxp" and the path or [name], "" if anonymous */
+	char perms[5];
+	char *name;
+	uint64_t resident;
+	uint64_t swapped;
+	/* resident bytes per node, nr_nodes of them, and those of no known node */
+	uint64_t *node_resident;
+	uint64_t unknown_node;
+};
+
+struct pagescan {
+	pid_t pid;
+	unsigned int nr_threads;
+	size_t nr_vmas;
+	struct pagescan_vma *vmas;
+	int nr_nodes;
+	/* pread() calls, and chunks, of all the threads */
+	unsigned long reads;
+	size_t nr_chunks;
+};
+
+/*
+ * Scan every VMA of pid (0: the caller) with nr_threads threads (0: one per online CPU). scan is
+ * filled, even on failure, and must be released with pagescan_free(). Returns 0 or a negative
+ * errno.
+ */
+int pagescan_run(pid_t pid, unsigned int nr_threads, struct pagescan *scan);
+void pagescan_free(struct pagescan *scan);
+
+#endif
@@ -3,16 +3,23 @@
  *
  * Reference: kernel doc vm/pagemap.txt
  *
- * Check /proc/$PID/maps as a cross validation
+ * Check /proc/$PID/maps as a cross validation. The translation itself lives in pagemap.c, which
+ * keeps the pagemap file of a process open and reads entries in bulk, then classifies the
+ * physical pages with /proc/kpageflags and /proc/kpagecount. pagescan.c scans whole processes with
+ * a pool of threads: run "va-to-pa PID [THREADS]".
  */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <signal.h>
-#include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include "pagemap.h"
+#include "pagescan.h"
 
 #define MOD_NAME		"addr-translator"
 #define pr_info(fmt, ...)	fprintf(stdout, "[INFO]  " MOD_NAME ": " fmt "\n", ##__VA_ARGS__)
@@ -21,83 +28,246 @@
 unsigned long g_page_size;
 pid_t g_pid;
 
-/* adapted from kernel source: fs/proc/task_mmu.c or vm/pagemap.rst */
-#define BIT_UL(nr)		(1UL << nr)
+static void print_entry(const struct pagemap_entry *entry)
+{
+	/* flags: bit 55 to bit 63, 9 bits in total (some is reserved) */
+	pr_info("VA=0x%llx, present=%d, swapped=%d, file-page|shared-anon=%d, "
+		"userfaultfd-writeprotect=%d exclusive-map=%d, soft-dirty=%d.",
+		(unsigned long long)entry->va, !!(entry->flags & PM_PRESENT),
+		!!(entry->flags & PM_SWAP), !!(entry->flags & PM_FILE),
+		!!(entry->flags & PM_UFFD_WP), !!(entry->flags & PM_MMAP_EXCLUSIVE),
+		!!(entry->flags & PM_SOFT_DIRTY));
+	if (entry->flags & PM_SWAP)
+		pr_info("\tswap-type=%u, swap-offset=0x%llx.", entry->swap_type,
+			(unsigned long long)entry->swap_offset);
+	else
+		pr_info("\tpfn=0x%llx.", (unsigned long long)entry->pfn);
+}
+
+static int translate_address(struct pagemap *pm, unsigned long *pa, unsigned long va)
+{
+	struct pagemap_entry entry;
+	ssize_t ret = pagemap_translate_range(pm, va, 1, &entry);
+	if (ret < 0) {
+		pr_err("failed to read pagemap of process %d, errmsg=%s.", pm->pid, strerror(-ret));
+		return -ret;
+	}
+	if (ret == 0) {
+		pr_err("VA=0x%lx is beyond the user address space.", va);
+		return EINVAL;
+	}
+
+	print_entry(&entry);
+	if (!entry.pa) {
+		*pa = 0;
+		return ENOMEM;
+	}
+	*pa = entry.pa + va % g_page_size;
+	return 0;
+}
+
+/* what backs the translated pages, from /proc/kpageflags and /proc/kpagecount */
+static void summarize_pages(struct pagemap_entry *entries, size_t nr)
+{
+	struct kpage *kp = kpage_open();
+	if (!kp) {
+		/* both files are root only */
+		pr_info("no page classification: failed to open /proc/kpageflags or "
+			"/proc/kpagecount, errmsg=%s.", strerror(errno));
+		return;
+	}
 
-#define PM_PFRAME_BITS		55
-#define PM_SOFT_DIRTY		BIT_UL(55)
-#define PM_MMAP_EXCLUSIVE	BIT_UL(56)
-#define PM_UFFD_WP		BIT_UL(57)
-#define PM_FILE			BIT_UL(61)
-#define PM_SWAP			BIT_UL(62)
-#define PM_PRESENT		BIT_UL(63)
+	int ret = kpage_enrich(kp, entries, nr);
+	if (ret) {
+		pr_err("failed to read page flags, errmsg=%s.", strerror(-ret));
+		kpage_close(kp);
+		return;
+	}
 
-static int translate_address(unsigned long *pa, unsigned long va)
+	struct kpage_summary sum;
+	kpage_summarize(entries, nr, &sum);
+	pr_info("%zu pages classified in %lu reads: present=%zu, swapped=%zu, thp=%zu, "
+		"hugetlb=%zu, zero=%zu, anon=%zu, lru=%zu, active=%zu, mlocked=%zu, ksm=%zu, "
+		"shared=%zu.", sum.pages, kp->reads, sum.present, sum.swapped, sum.thp,
+		sum.hugetlb, sum.zero, sum.anon, sum.lru, sum.active, sum.mlocked, sum.ksm,
+		sum.shared);
+	if (sum.present)
+		pr_info("THP coverage: %zu%% of the present pages.", sum.thp * 100 / sum.present);
+
+	kpage_close(kp);
+}
+
+/*
+ * Translate a whole buffer, half of which has been touched, with a few large reads instead of a
+ * syscall per page.
+ */
+static int translate_buffer(struct pagemap *pm, void *buffer, size_t nr_pages)
 {
-	char file_path[64];
-	sprintf(file_path, "/proc/%d/pagemap", g_pid);
+	struct pagemap_entry *entries = calloc(nr_pages, sizeof(*entries));
+	if (!entries) {
+		pr_err("failed to allocate %zu entries.", nr_pages);
+		return ENOMEM;
+	}
+
+	unsigned long reads = pm->reads;
+	ssize_t ret = pagemap_translate_range(pm, (unsigned long)buffer, nr_pages, entries);
+	if (ret < 0) {
+		pr_err("failed to translate the buffer, errmsg=%s.", strerror(-ret));
+		free(entries);
+		return -ret;
+	}
+
+	size_t present = 0, contiguous = 0;
+	for (ssize_t i = 0; i < ret; i++) {
+		if (!(entries[i].flags & PM_PRESENT))
+			continue;
+		present++;
+		if (i && entries[i - 1].pfn && entries[i].pfn == entries[i - 1].pfn + 1)
+			contiguous++;
+	}
+	pr_info("process %d: %zd pages translated in %lu reads, %zu present, "
+		"%zu physically contiguous with the previous page.",
+		pm->pid, ret, pm->reads - reads, present, contiguous);
+
+	summarize_pages(entries, ret);
+	free(entries);
+	return 0;
+}
 
-	int fd = open(file_path, O_RDONLY);
-	if (fd == -1) {
+/*
+ * The same address in two processes: a forked child shares the parent's pages until it writes
+ * to them.
+ */
+static int translate_in_child(struct pagemap *pm, char *buffer)
+{
+	int to_parent[2], to_child[2];
+	if (pipe(to_parent) == -1 || pipe(to_child) == -1) {
 		int retval = errno;
-		pr_err("failed to open file %s, errmsg=%s.", file_path, strerror(errno));
+		pr_err("failed to create pipes, errmsg=%s.", strerror(errno));
 		return retval;
 	}
 
-	/* the offset: each page corresponds to a 64-bit entry */
-	off_t offset = (va / g_page_size) * 8;
-	off_t real_offset = lseek(fd, offset, SEEK_SET);
-	if (real_offset == -1) {
+	pid_t child = fork();
+	if (child == -1) {
 		int retval = errno;
-		pr_err("failed to move file cursor, errmsg=%s.", strerror(errno));
-		close(fd);
+		pr_err("failed to fork, errmsg=%s.", strerror(errno));
 		return retval;
 	}
-	if (real_offset != offset) {
-		pr_err("failed to complete file cursor moving. Expect %ld bytes; %ld bytes "
-			"actually moved.", offset, real_offset);
-		close(fd);
-		return EIO;
+	if (child == 0) {
+		char c = 0;
+		close(to_child[1]);
+		/* copy on write of the second page only */
+		buffer[g_page_size] = 1;
+		if (write(to_parent[1], &c, 1) != 1)
+			_exit(1);
+		/* wait for the parent to be done */
+		if (read(to_child[0], &c, 1) == -1)
+			_exit(1);
+		_exit(0);
 	}
 
-	unsigned long entry;
-	int ret = read(fd, &entry, sizeof(entry));
-	if (ret == -1) {
-		int retval = errno;
-		pr_err("failed to read PA from file %s, errmsg=%s.", file_path, strerror(errno));
-		close(fd);
-		return retval;
+	char c;
+	int ret = 0;
+	struct pagemap *child_pm = NULL;
+	if (read(to_parent[0], &c, 1) != 1) {
+		pr_err("child %d did not start.", child);
+		ret = EIO;
+		goto out;
 	}
-	if (ret != sizeof(entry)) {
-		pr_err("The reading of PA is not complete. Expect %lu bytes, got %d bytes.",
-			sizeof(entry), ret);
-		close(fd);
-		return EIO;
+
+	child_pm = pagemap_open(child);
+	if (!child_pm) {
+		ret = errno;
+		pr_err("failed to open pagemap of process %d, errmsg=%s.", child, strerror(errno));
+		goto out;
 	}
 
-	close(fd);
+	for (int i = 0; i < 2; i++) {
+		unsigned long va = (unsigned long)buffer + i * g_page_size;
+		uint64_t pa, child_pa;
+		if (pagemap_translate(pm, va, &pa) || pagemap_translate(child_pm, va, &child_pa)) {
+			pr_info("VA=0x%lx: translation failed.", va);
+			continue;
+		}
+		pr_info("VA=0x%lx: PA=0x%llx in process %d, PA=0x%llx in process %d (%s).", va,
+			(unsigned long long)pa, pm->pid, (unsigned long long)child_pa, child,
+			pa == child_pa ? "shared" : "copied");
+	}
 
-	/* decode the pagemap entry */
-	/* flags: bit 55 to bit 63, 9 bits in total (some is reserved) */
-	pr_info("entry=0x%lx, present=%d, swapped=%d, file-page|shared-anon=%d, "
-		"userfaultfd-writeprotect=%d exclusive-map=%d, soft-dirty=%d.",
-		entry, !!(entry & PM_PRESENT), !!(entry & PM_SWAP), !!(entry & PM_FILE),
-		!!(entry & PM_UFFD_WP), !!(entry & PM_MMAP_EXCLUSIVE), !!(entry & PM_SOFT_DIRTY)
-	);
-
-	/* swap: 50 bits for offset, 5 bits for swap type
-	 * mapped page: 55 bits for PFN */
-	if (entry & PM_SWAP) {
-		pr_info("\tswap-type=%lu, swap-offset=0x%lx.", entry & 0x1F,
-			(entry >> 5) & ((1UL << 50) - 1));
-		*pa = 0;
-		return ENOMEM;
-	} else {
-		unsigned long pfn = entry & ((1UL << PM_PFRAME_BITS) - 1);
-		pr_info("\tpfn=0x%lx.", pfn);
-		*pa = pfn * g_page_size + va % g_page_size;
+out:
+	pagemap_close(child_pm);
+	close(to_child[1]);
+	waitpid(child, NULL, 0);
+	close(to_child[0]);
+	close(to_parent[0]);
+	close(to_parent[1]);
+	return ret;
+}
+
+/* resident bytes per node, as "node0=...K node1=...K ?=...K", ? for no known node */
+static void format_nodes(char *buf, size_t size, const struct pagescan *scan,
+			 const struct pagescan_vma *vma)
+{
+	int len = 0;
+	for (int node = 0; node < scan->nr_nodes && len < (int)size; node++) {
+		if (vma->node_resident[node])
+			len += snprintf(buf + len, size - len, " node%d=%lluK", node,
+					(unsigned long long)vma->node_resident[node] >> 10);
+	}
+	if (vma->unknown_node && len < (int)size)
+		len += snprintf(buf + len, size - len, " ?=%lluK",
+				(unsigned long long)vma->unknown_node >> 10);
+	if (!len)
+		buf[0] = '\0';
+}
+
+/*
+ * Scan every VMA of a process with a pool of threads, print the resident VMAs when verbose and the
+ * totals.
+ */
+static int scan_process(pid_t pid, unsigned int nr_threads, int verbose)
+{
+	struct timespec begin, end;
+	struct pagescan scan;
+	char nodes[256];
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	int ret = pagescan_run(pid, nr_threads, &scan);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (ret) {
+		pr_err("failed to scan process %d, errmsg=%s.", scan.pid, strerror(-ret));
+		pagescan_free(&scan);
+		return -ret;
 	}
 
+	struct pagescan_vma total = {};
+	uint64_t total_nodes[scan.nr_nodes];
+	memset(total_nodes, 0, sizeof(total_nodes));
+	total.node_resident = total_nodes;
+	for (size_t i = 0; i < scan.nr_vmas; i++) {
+		struct pagescan_vma *vma = &scan.vmas[i];
+		total.resident += vma->resident;
+		total.swapped += vma->swapped;
+		total.unknown_node += vma->unknown_node;
+		for (int node = 0; node < scan.nr_nodes; node++)
+			total_nodes[node] += vma->node_resident[node];
+		if (!verbose || (!vma->resident && !vma->swapped))
+			continue;
+		format_nodes(nodes, sizeof(nodes), &scan, vma);
+		pr_info("0x%llx-0x%llx %s resident=%lluK swapped=%lluK%s %s",
+			(unsigned long long)vma->start, (unsigned long long)vma->end, vma->perms,
+			(unsigned long long)vma->resident >> 10,
+			(unsigned long long)vma->swapped >> 10, nodes, vma->name);
+	}
+
+	format_nodes(nodes, sizeof(nodes), &scan, &total);
+	pr_info("process %d: %zu VMAs in %zu chunks scanned by %u threads with %lu reads in %.3f ms: "
+		"resident=%lluK swapped=%lluK%s", scan.pid, scan.nr_vmas, scan.nr_chunks,
+		scan.nr_threads, scan.reads, (end.tv_sec - begin.tv_sec) * 1e3 +
+		(end.tv_nsec - begin.tv_nsec) / 1e6, (unsigned long long)total.resident >> 10,
+		(unsigned long long)total.swapped >> 10, nodes);
+
+	pagescan_free(&scan);
 	return 0;
 }
 
@@ -106,40 +276,64 @@ void sigint_hanlder(int sig)
 	pr_info("signal %d received.", sig);
 }
 
-int main(void)
+/* pages of the buffer translated in bulk, the first half of them touched */
+#define NR_PAGES		4096
+
+int main(int argc, char *argv[])
 {
 	g_page_size = sysconf(_SC_PAGESIZE);
 	g_pid = getpid();
 
+	/* va-to-pa PID [THREADS]: only scan another process, all the CPUs by default */
+	if (argc > 1)
+		return scan_process(atoi(argv[1]), argc > 2 ? atoi(argv[2]) : 0, 1);
+
+	struct pagemap *pm = pagemap_open(g_pid);
+	if (!pm) {
+		int retval = errno;
+		pr_err("failed to open pagemap of process %d, errmsg=%s.", g_pid, strerror(errno));
+		return retval;
+	}
+
 	/* create a valid mapping */
-	void *buffer = mmap(NULL, g_page_size, PROT_READ | PROT_WRITE,
+	size_t size = NR_PAGES * g_page_size;
+	void *buffer = mmap(NULL, size, PROT_READ | PROT_WRITE,
 		MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
 	if (buffer == MAP_FAILED) {
 		int retval = errno;
-		pr_err("failed to mmap a page, errmsg=%s.", strerror(errno));
+		pr_err("failed to mmap %d pages, errmsg=%s.", NR_PAGES, strerror(errno));
+		pagemap_close(pm);
 		return retval;
 	}
+	/* let THP back the buffer when it is enabled, to show up in the page classification */
+	madvise(buffer, size, MADV_HUGEPAGE);
 	pr_info("buffer allocated for process %d: VA=%p.", g_pid, buffer);
 	fflush(stdout);
 
 	unsigned long pa;
-	int ret = translate_address(&pa, (unsigned long)buffer);
+	int ret = translate_address(pm, &pa, (unsigned long)buffer);
 	if (ret)
 		pr_info("before access: translation failed.");
 	else
 		pr_info("before access: VA=%p, PA=0x%lx.", buffer, pa);
 
 	/* trigger demand paging */
-	memset(buffer, 0, g_page_size);
+	memset(buffer, 0, size / 2);
 
-	ret = translate_address(&pa, (unsigned long)buffer);
+	ret = translate_address(pm, &pa, (unsigned long)buffer);
 	if (ret)
 		pr_info("after access: translation failed.");
 	else
 		pr_info("after access: VA=%p, PA=0x%lx.", buffer, pa);
 
+	translate_buffer(pm, buffer, NR_PAGES);
+	fflush(stdout);
+	translate_in_child(pm, buffer);
+	scan_process(g_pid, 0, 0);
+
 	/* offer user a chance to check /proc/$PID/maps */
 	pr_info("pause process %d. Interrupt it with SIGINT", g_pid);
+	fflush(stdout);
 
 	if (signal(SIGINT, sigint_hanlder) == SIG_ERR) {
 		int retval = errno;
@@ -148,7 +342,8 @@ int main(void)
 	}
 	pause();
 
-	munmap(buffer, g_page_size);
+	munmap(buffer, size);
+	pagemap_close(pm);
 
 	/* the return value of the after-access translation is returned. */
 	return ret;